@@ -0,0 +1,438 @@
+// Throughput/latency benchmark for shealth_lock.
+//
+// Build:  g++ -std=c++17 -O2 -pthread bench/stealth_bench.cpp -o stealth_bench
+// Run:    ./stealth_bench --dir /tmp/sl_corpus --out results.json
+//
+// The application source is compiled into this binary (without its main), so the
+// numbers come from exactly the code the tool runs. A synthetic corpus is generated
+// under --dir and every case is timed end to end, including file I/O against a warm
+// page cache. Results are written as JSON in the "stealth-bench/1" schema:
+//
+//   { "schema": "stealth-bench/1", "timestamp": ..., "host": {...}, "config": {...},
+//     "results": [ { "case": "file.encrypt", "bytes": N, "files": F, "reps": R,
+//                    "mb_per_s": X, "latency_ms": { "min", "p50", "p90", "p99", "max" } } ] }
+//
+// mb_per_s is computed from the median latency (MB = 10^6 bytes). Fields are only
+// ever added to this schema; bump the version if one changes meaning.
+
+#define STEALTH_LOCK_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../shealth_lock.cpp"
+
+namespace
+{
+    struct CaseResult
+    {
+        string name;
+        uint64_t bytes;
+        uint64_t files;
+        vector<double> latencies; // seconds
+    };
+
+    // Silences the progress bars and status lines of the timed operations.
+    class QuietCout
+    {
+    public:
+        QuietCout() : old(cout.rdbuf(sink.rdbuf())) {}
+        ~QuietCout() { cout.rdbuf(old); }
+
+    private:
+        std::ostringstream sink;
+        std::streambuf *old;
+    };
+
+    bool parseSize(const string &text, uint64_t &bytes)
+    {
+        if (text.empty())
+            return false;
+        size_t used = 0;
+        unsigned long long n = std::stoull(text, &used);
+        string unit = text.substr(used);
+        uint64_t mult = 1;
+        if (unit == "K" || unit == "KB")
+            mult = 1024ULL;
+        else if (unit == "M" || unit == "MB")
+            mult = 1024ULL * 1024;
+        else if (unit == "G" || unit == "GB")
+            mult = 1024ULL * 1024 * 1024;
+        else if (!unit.empty())
+            return false;
+        bytes = n * mult;
+        return true;
+    }
+
+    string sizeLabel(uint64_t bytes)
+    {
+        static const char *units[] = {"", "K", "M", "G"};
+        int u = 0;
+        while (u < 3 && bytes >= 1024 && bytes % 1024 == 0)
+        {
+            bytes /= 1024;
+            ++u;
+        }
+        return std::to_string(bytes) + units[u];
+    }
+
+    // Fills a file with pseudo-random bytes; the data is incompressible and
+    // reproducible for a given seed.
+    bool writeRandomFile(const string &path, uint64_t size, uint64_t seed)
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out)
+            return false;
+        std::mt19937_64 rng(seed);
+        vector<uint64_t> block(512 * 1024);
+        for (uint64_t done = 0; done < size;)
+        {
+            for (uint64_t &w : block)
+                w = rng();
+            size_t n = static_cast<size_t>(std::min<uint64_t>(block.size() * 8, size - done));
+            out.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(n));
+            done += n;
+        }
+        return static_cast<bool>(out);
+    }
+
+    // Text corpus: printable lines, so the text-file paths see realistic input.
+    bool writeTextFile(const string &path, uint64_t size, uint64_t seed)
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out)
+            return false;
+        std::mt19937_64 rng(seed);
+        string line;
+        for (uint64_t done = 0; done < size;)
+        {
+            line.clear();
+            while (line.size() < 79)
+                line += static_cast<char>(' ' + rng() % 95);
+            line += '\n';
+            size_t n = static_cast<size_t>(std::min<uint64_t>(line.size(), size - done));
+            out.write(line.data(), static_cast<std::streamsize>(n));
+            done += n;
+        }
+        return static_cast<bool>(out);
+    }
+
+    // Repetitions per case: at least minReps, more for small inputs so the
+    // percentiles mean something, but never more than about 256 MiB of work.
+    int repsFor(uint64_t bytes, int minReps)
+    {
+        uint64_t budget = 256ULL * 1024 * 1024;
+        uint64_t reps = bytes ? budget / bytes : 100;
+        reps = std::min<uint64_t>(reps, 100);
+        return static_cast<int>(std::max<uint64_t>(reps, static_cast<uint64_t>(minReps)));
+    }
+
+    template <typename Fn>
+    bool timeCase(CaseResult &r, int reps, Fn fn)
+    {
+        for (int i = 0; i < reps; ++i)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            bool ok;
+            {
+                QuietCout quiet;
+                ok = fn();
+            }
+            r.latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            if (!ok)
+            {
+                std::cerr << "case " << r.name << " (" << r.bytes << " bytes) failed\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double percentile(const vector<double> &sorted, double p)
+    {
+        size_t rank = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size()) + 0.999999);
+        rank = std::max<size_t>(1, std::min(rank, sorted.size()));
+        return sorted[rank - 1];
+    }
+
+    void writeJson(std::ostream &os, const vector<CaseResult> &results, int minReps, uint64_t smallFiles)
+    {
+        os << std::fixed << std::setprecision(3);
+        os << "{\n";
+        os << "  \"schema\": \"stealth-bench/1\",\n";
+        os << "  \"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(
+                                         std::chrono::system_clock::now().time_since_epoch())
+                                         .count()
+           << ",\n";
+        os << "  \"host\": { \"hardware_threads\": " << std::thread::hardware_concurrency()
+           << ", \"xor_kernel\": \"" << activeXorKernel().name << "\", \"chacha_kernel\": \""
+           << stealth::activeChaChaKernel().name << "\", \"base64_kernel\": \"" << activeBase64Kernels().name
+           << "\" },\n";
+        os << "  \"config\": { \"cipher\": \""
+           << (BaseCrypto::getCipherMode() == CipherMode::ChaCha20 ? "chacha20" : "xor")
+           << "\", \"block_size\": " << BaseCrypto::getBlockSize() << ", \"min_reps\": " << minReps
+           << ", \"small_files\": " << smallFiles << " },\n";
+        os << "  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            vector<double> lat = results[i].latencies;
+            std::sort(lat.begin(), lat.end());
+            double p50 = percentile(lat, 50);
+            double mbps = p50 > 0 ? static_cast<double>(results[i].bytes) / p50 / 1e6 : 0.0;
+            os << (i ? ",\n" : "\n");
+            os << "    { \"case\": \"" << results[i].name << "\", \"bytes\": " << results[i].bytes
+               << ", \"files\": " << results[i].files << ", \"reps\": " << lat.size() << ", \"mb_per_s\": " << mbps
+               << ", \"latency_ms\": { \"min\": " << lat.front() * 1e3 << ", \"p50\": " << p50 * 1e3
+               << ", \"p90\": " << percentile(lat, 90) * 1e3 << ", \"p99\": " << percentile(lat, 99) * 1e3
+               << ", \"max\": " << lat.back() * 1e3 << " } }";
+        }
+        os << "\n  ]\n}\n";
+    }
+
+    void usage(const char *prog)
+    {
+        std::cerr << "Usage: " << prog << " [options]\n"
+             << "  --dir DIR          corpus directory (default ./bench_corpus, created if missing)\n"
+             << "  --out FILE         write JSON here instead of stdout\n"
+             << "  --sizes LIST       comma-separated file sizes, e.g. 1K,1M,64M,10G (default 1K,64K,1M,16M,256M)\n"
+             << "  --reps N           minimum repetitions per case (default 5)\n"
+             << "  --small-files N    files in the many-small-files tree (default 2000, 0 disables)\n"
+             << "  --cases LIST       subset of file,image,text,stego,tree (default all)\n"
+             << "  --keep             leave the corpus and outputs on disk\n"
+             << "  --cipher NAME      xor (default) or chacha20\n"
+             << "  --block-size BYTES, --threads N, --parallel-min BYTES  as for shealth_lock\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    string dir = "bench_corpus";
+    string outPath;
+    vector<uint64_t> sizes;
+    int minReps = 5;
+    uint64_t smallFiles = 2000;
+    string cases = "file,image,text,stego,tree";
+    bool keep = false;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--dir" && hasValue)
+                dir = argv[++i];
+            else if (arg == "--out" && hasValue)
+                outPath = argv[++i];
+            else if (arg == "--sizes" && hasValue)
+            {
+                std::stringstream list(argv[++i]);
+                string item;
+                while (std::getline(list, item, ','))
+                {
+                    uint64_t bytes = 0;
+                    if (!parseSize(trim(item), bytes) || bytes == 0)
+                        throw std::invalid_argument(item);
+                    sizes.push_back(bytes);
+                }
+            }
+            else if (arg == "--reps" && hasValue)
+                minReps = std::max(1, std::stoi(argv[++i]));
+            else if (arg == "--small-files" && hasValue)
+                smallFiles = std::stoull(argv[++i]);
+            else if (arg == "--cases" && hasValue)
+                cases = argv[++i];
+            else if (arg == "--keep")
+                keep = true;
+            else if (arg == "--block-size" && hasValue)
+                BaseCrypto::setBlockSize(static_cast<size_t>(std::stoull(argv[++i])));
+            else if (arg == "--threads" && hasValue)
+                BaseCrypto::setWorkerCount(static_cast<unsigned>(std::stoul(argv[++i])));
+            else if (arg == "--parallel-min" && hasValue)
+                BaseCrypto::setParallelThreshold(std::stoull(argv[++i]));
+            else if (arg == "--cipher" && hasValue && (string(argv[i + 1]) == "xor" || string(argv[i + 1]) == "chacha20"))
+                BaseCrypto::setCipherMode(string(argv[++i]) == "xor" ? CipherMode::Xor : CipherMode::ChaCha20);
+            else
+            {
+                usage(argv[0]);
+                return 2;
+            }
+        }
+    }
+    catch (const std::exception &)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (sizes.empty())
+        sizes = {1024ULL, 64 * 1024ULL, 1024 * 1024ULL, 16 * 1024 * 1024ULL, 256 * 1024 * 1024ULL};
+    auto wants = [&cases](const string &name)
+    { return ("," + cases + ",").find("," + name + ",") != string::npos; };
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (!fs::is_directory(dir))
+    {
+        std::cerr << "Cannot create corpus directory: " << dir << "\n";
+        return 1;
+    }
+    overwritePolicy = OverwritePolicy::Overwrite;
+    askInPlaceRecovery = false;
+
+    const unsigned long long key = UserManager().getKey("bench-password");
+    BaseCrypto::setPassphrase("bench-password");
+    vector<CaseResult> results;
+    vector<string> cleanup;
+    bool ok = true;
+
+    for (uint64_t size : sizes)
+    {
+        string label = sizeLabel(size);
+        int reps = repsFor(size, minReps);
+        std::cerr << "size " << label << " (" << reps << " reps)\n";
+
+        if (wants("file"))
+        {
+            string in = (fs::path(dir) / ("file_" + label)).string();
+            ok = ok && writeRandomFile(in, size, size);
+            string enc = FileCrypto::encryptedPathFor(in);
+            cleanup.insert(cleanup.end(), {in, enc});
+            FileCrypto fc;
+            CaseResult e{"file.encrypt", size, 1, {}};
+            ok = ok && timeCase(e, reps, [&]()
+                                { return fc.encrypt(in, key); });
+            CaseResult d{"file.decrypt", size, 1, {}};
+            ok = ok && timeCase(d, reps, [&]()
+                                { return fc.decrypt(enc, key); });
+            results.push_back(e);
+            results.push_back(d);
+        }
+
+        if (wants("image"))
+        {
+            string in = (fs::path(dir) / ("image_" + label + ".png")).string();
+            ok = ok && writeRandomFile(in, size, size + 1);
+            string enc = make_output_same_dir(in, "_enc");
+            cleanup.insert(cleanup.end(), {in, enc, make_output_same_dir(enc, "_dec", ".jpg")});
+            ImageCrypto ic;
+            CaseResult e{"image.encrypt", size, 1, {}};
+            ok = ok && timeCase(e, reps, [&]()
+                                { return ic.encrypt(in, key); });
+            CaseResult d{"image.decrypt", size, 1, {}};
+            ok = ok && timeCase(d, reps, [&]()
+                                { return ic.decrypt(enc, key); });
+            results.push_back(e);
+            results.push_back(d);
+        }
+
+        if (wants("text"))
+        {
+            // In-memory codec, capped so huge sizes do not need several copies in RAM.
+            if (size <= 256ULL * 1024 * 1024)
+            {
+                vector<unsigned char> data(static_cast<size_t>(size));
+                std::mt19937_64 rng(size + 2);
+                for (unsigned char &c : data)
+                    c = static_cast<unsigned char>(rng());
+                string encoded;
+                CaseResult e{"text.encode", size, 0, {}};
+                ok = ok && timeCase(e, reps, [&]()
+                                    { encoded = base64Encode(data);
+                                      return true; });
+                CaseResult d{"text.decode", size, 0, {}};
+                ok = ok && timeCase(d, reps, [&]()
+                                    { vector<unsigned char> out;
+                                      return base64Decode(encoded, out) && out.size() == data.size(); });
+                results.push_back(e);
+                results.push_back(d);
+            }
+
+            string in = (fs::path(dir) / ("text_" + label + ".txt")).string();
+            ok = ok && writeTextFile(in, size, size + 3);
+            string enc = in + "_enc.txt";
+            cleanup.insert(cleanup.end(), {in, enc, enc + "_dec.txt"});
+            TextCrypto tc;
+            CaseResult e{"text_file.encrypt", size, 1, {}};
+            ok = ok && timeCase(e, reps, [&]()
+                                { return tc.encryptFile(in, key); });
+            CaseResult d{"text_file.decrypt", size, 1, {}};
+            ok = ok && timeCase(d, reps, [&]()
+                                { return tc.decryptFile(enc, key); });
+            results.push_back(e);
+            results.push_back(d);
+        }
+
+        if (wants("stego"))
+        {
+            string cover = (fs::path(dir) / ("cover_" + label + ".png")).string();
+            string payload = (fs::path(dir) / ("payload_" + label + ".bin")).string();
+            ok = ok && writeRandomFile(cover, 1024 * 1024, 7) && writeRandomFile(payload, size, size + 4);
+            string stego = make_output_same_dir(cover, "_stego");
+            cleanup.insert(cleanup.end(), {cover, payload, stego,
+                                           (fs::path(dir) / ("recovered_payload_" + label + ".bin")).string()});
+            Stego st;
+            CaseResult s{"stego.store", size, 1, {}};
+            ok = ok && timeCase(s, reps, [&]()
+                                { return st.storeFileInImage(cover, payload, key); });
+            CaseResult r{"stego.retrieve", size, 1, {}};
+            ok = ok && timeCase(r, reps, [&]()
+                                { return st.retrieveFileFromImage(stego, key); });
+            results.push_back(s);
+            results.push_back(r);
+        }
+    }
+
+    if (wants("tree") && smallFiles > 0)
+    {
+        // Many small files (1 byte to 64 KiB) spread over 64 directories. Names have
+        // no extension so the decrypted outputs land back on the original names.
+        fs::path root = fs::path(dir) / "tree";
+        fs::remove_all(root, ec);
+        std::mt19937_64 rng(42);
+        uint64_t total = 0;
+        for (uint64_t i = 0; i < smallFiles && ok; ++i)
+        {
+            fs::path sub = root / ("d" + std::to_string(i % 64));
+            fs::create_directories(sub, ec);
+            uint64_t size = 1 + rng() % (64 * 1024);
+            ok = writeRandomFile((sub / ("f" + std::to_string(i))).string(), size, i);
+            total += size;
+        }
+        std::cerr << "tree " << smallFiles << " files, " << total << " bytes\n";
+        TreeCrypto tree;
+        vector<string> roots{root.string()};
+        int reps = std::max(minReps, 3);
+        CaseResult e{"tree.encrypt", total, smallFiles, {}};
+        ok = ok && timeCase(e, reps, [&]()
+                            { return tree.run(roots, key, false, "encrypt-tree") == 0; });
+        CaseResult d{"tree.decrypt", total, smallFiles, {}};
+        ok = ok && timeCase(d, reps, [&]()
+                            { return tree.run(roots, key, true, "decrypt-tree") == 0; });
+        results.push_back(e);
+        results.push_back(d);
+        if (!keep)
+            fs::remove_all(root, ec);
+    }
+
+    if (!keep)
+    {
+        for (const string &p : cleanup)
+            fs::remove(p, ec);
+    }
+    if (!ok || results.empty())
+        return 1;
+
+    if (outPath.empty())
+    {
+        writeJson(cout, results, minReps, smallFiles);
+    }
+    else
+    {
+        ofstream out(outPath, ios::trunc);
+        writeJson(out, results, minReps, smallFiles);
+        if (!out)
+        {
+            std::cerr << "Failed to write " << outPath << "\n";
+            return 1;
+        }
+        std::cerr << "Results written to " << outPath << "\n";
+    }
+    return 0;
+}
@@ -10,6 +10,52 @@
 #include <limits>
 #include <chrono>
 #include <thread>
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <cstdlib>
+#include <unordered_map>
+#include <unordered_set>
+#include <ctime>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define STEALTH_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+#endif
+
+#include "stealth_core.h"
 
 namespace fs = std::filesystem;
 
@@ -149,10 +195,35 @@ static string make_output_same_dir(const string &inputPath, const string &suffix
     return outPath.string();
 }
 
+// How existing output files are treated. The interactive menu asks; batch mode
+// overwrites, skips, or (by default) reports the item as failed.
+enum class OverwritePolicy
+{
+    Ask,
+    Overwrite,
+    Skip,
+    Fail
+};
+
+static OverwritePolicy overwritePolicy = OverwritePolicy::Ask;
+static bool refusedExistingOutput = false; // set when an existing output stopped an operation
+
+// What to do with an interrupted in-place run when not asking: resume or roll back.
+static bool askInPlaceRecovery = true;
+static bool rollbackInPlaceByDefault = false;
+
 static bool confirm_overwrite_if_exists(const string &path)
 {
     if (!fs::exists(path))
         return true;
+    if (overwritePolicy == OverwritePolicy::Overwrite)
+        return true;
+    if (overwritePolicy != OverwritePolicy::Ask)
+    {
+        cout << "Output already exists: " << path << endl;
+        refusedExistingOutput = true;
+        return false;
+    }
     cout << "File already exists: " << path << endl;
     cout << "Overwrite? (y/n): ";
     string ans;
@@ -164,905 +235,7853 @@ static bool confirm_overwrite_if_exists(const string &path)
     return (c == 'y');
 }
 
-static void print_progress_bar(uint64_t processed, uint64_t total)
+// Asked when an interrupted in-place run is found. Returns true to roll it back.
+static bool ask_rollback_in_place(const string &path)
 {
+    if (!askInPlaceRecovery)
+        return rollbackInPlaceByDefault;
+    cout << "An interrupted in-place run was found for: " << path << endl;
+    cout << "Resume it (r) or roll it back to the original (b)? ";
+    string ans;
+    std::getline(cin, ans);
+    ans = trim(ans);
+    return !ans.empty() && std::tolower(ans[0]) == 'b';
+}
 
-    if (total == 0)
-        return;
-    const int width = 40;
-    double ratio = (double)processed / (double)total;
-    int filled = static_cast<int>(ratio * width);
-    cout << "\r[";
-    for (int i = 0; i < filled; ++i)
-        cout << '=';
-    for (int i = filled; i < width; ++i)
-        cout << ' ';
-    cout << "] " << std::setw(3) << static_cast<int>(ratio * 100.0) << "%";
-    cout.flush();
-    if (processed == total)
-        cout << endl;
+static bool stream_is_terminal(int fd)
+{
+#ifdef _WIN32
+    return _isatty(fd) != 0;
+#else
+    return ::isatty(fd) != 0;
+#endif
 }
 
-class UserManager
+// Progress display shared by all workers. Hot loops only add to atomic byte
+// counters; one reporter thread redraws the line at 10 Hz with throughput and ETA
+// for the current file and, when a batch or tree job is running, for the whole
+// job. Nothing is drawn unless the output stream is a terminal.
+class ProgressReporter
 {
-private:
-    map<string, unsigned long long> users;
+public:
+    ProgressReporter() : out(&cout), enabled(stream_is_terminal(1)) {}
+    ~ProgressReporter()
+    {
+        stop();
+    }
 
-    unsigned long long customHash(const string &password)
+    void setOutput(std::ostream *os, bool draw)
+    {
+        out = os;
+        enabled = draw;
+    }
+
+    void beginJob(uint64_t totalBytes, uint64_t totalItems)
+    {
+        jobTotal = totalBytes;
+        jobDone = 0;
+        itemsTotal = totalItems;
+        itemsDone = 0;
+        jobActive = true;
+        start();
+    }
+
+    void itemDone()
+    {
+        ++itemsDone;
+    }
+
+    void endJob()
+    {
+        jobActive = false;
+        finish();
+        jobTotal = 0;
+    }
+
+    void beginFile(const string &label, uint64_t total, uint64_t alreadyDone = 0)
     {
-        unsigned long long hash = 5381ULL;
-        for (unsigned char c : password)
         {
-            hash = ((hash << 5) + hash) + static_cast<unsigned long long>(c); // hash * 33 + c
+            std::lock_guard<std::mutex> lock(drawMutex);
+            fileLabel = label;
+            fileStartedAt = std::chrono::steady_clock::now();
         }
-        return hash;
+        fileTotal = total;
+        fileDone = alreadyDone;
+        fileBase = alreadyDone;
+        fileActive = true;
+        start();
     }
 
-public:
-    UserManager()
+    void add(uint64_t bytes)
     {
-        users["admin"] = customHash("admin123");
-        users["guest"] = customHash("guest123");
+        fileDone += bytes;
+        jobDone += bytes;
     }
 
-    bool signup(const string &username, const string &password)
+    void endFile()
     {
-        if (username.empty())
+        fileActive = false;
+        finish();
+    }
+
+    // Scope of one file-sized transform; ends the file even on early returns.
+    class FileScope
+    {
+    public:
+        FileScope(ProgressReporter &reporter, const string &label, uint64_t total, uint64_t alreadyDone = 0)
+            : r(reporter)
         {
-            cout << "Username cannot be empty.\n";
-            return false;
+            r.beginFile(label, total, alreadyDone);
         }
-        if (users.find(username) != users.end())
+        ~FileScope()
         {
-            cout << "User already exists!\n";
-            return false;
+            r.endFile();
         }
-        users[username] = customHash(password);
-        cout << "Signup successful. Created user: " << username << "\n";
-        return true;
+
+    private:
+        ProgressReporter &r;
+    };
+
+private:
+    void start()
+    {
+        if (!enabled || worker.joinable())
+            return;
+        startedAt = std::chrono::steady_clock::now();
+        stopping = false;
+        worker = std::thread([this]()
+                             {
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            while (!wake.wait_for(lock, std::chrono::milliseconds(100), [this]()
+                                  { return stopping; }))
+                draw(false); });
     }
 
-    bool login(const string &username, const string &password)
+    void stop()
     {
-        auto it = users.find(username);
-        if (it != users.end() && it->second == customHash(password))
+        if (!worker.joinable())
+            return;
         {
-            cout << "Login successful! Welcome, " << username << ".\n";
-            return true;
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            stopping = true;
         }
-        cout << "Invalid username or password!\n";
-        return false;
+        wake.notify_all();
+        worker.join();
     }
 
-    unsigned long long getKey(const string &password)
+    // Final redraw and newline once neither a file nor a job is active.
+    void finish()
     {
-        return customHash(password);
+        if (!worker.joinable())
+            return;
+        if (jobActive)
+        {
+            draw(false);
+            return;
+        }
+        stop();
+        draw(true);
     }
 
-    bool exists(const string &username)
+    static string formatEta(double seconds)
+    {
+        if (!(seconds >= 0) || seconds > 359999)
+            return "--:--";
+        unsigned long long t = static_cast<unsigned long long>(seconds + 0.5);
+        std::ostringstream os;
+        if (t >= 3600)
+            os << t / 3600 << ":" << std::setw(2) << std::setfill('0') << (t / 60) % 60;
+        else
+            os << t / 60;
+        os << ":" << std::setw(2) << std::setfill('0') << t % 60;
+        return os.str();
+    }
+
+    void draw(bool final)
     {
-        return users.find(username) != users.end();
+        std::lock_guard<std::mutex> lock(drawMutex);
+        bool showFile = fileActive || jobTotal == 0;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                       (showFile ? fileStartedAt : startedAt))
+                             .count();
+        uint64_t done = showFile ? fileDone.load() : jobDone.load();
+        uint64_t total = showFile ? fileTotal.load() : jobTotal.load();
+        uint64_t moved = showFile ? done - std::min<uint64_t>(fileBase, done) : jobDone.load();
+        double ratio = total ? std::min(1.0, static_cast<double>(done) / static_cast<double>(total)) : 1.0;
+        double rate = elapsed > 0 ? static_cast<double>(moved) / elapsed : 0.0;
+
+        const int width = 30;
+        int filled = static_cast<int>(ratio * width);
+        std::ostringstream line;
+        line << "\r[" << string(static_cast<size_t>(filled), '=') << string(static_cast<size_t>(width - filled), ' ')
+             << "] " << std::setw(3) << static_cast<int>(ratio * 100.0) << "%  " << std::fixed << std::setprecision(1)
+             << rate / 1e6 << " MB/s  ETA "
+             << formatEta(rate > 0 ? static_cast<double>(total - std::min(done, total)) / rate : -1.0);
+        if (!showFile)
+        {
+            line << "  " << itemsDone << "/" << itemsTotal << " files";
+        }
+        else
+        {
+            line << "  " << fileLabel;
+            if (jobTotal > 0)
+            {
+                double jobRatio = std::min(1.0, static_cast<double>(jobDone) / static_cast<double>(jobTotal));
+                line << "  | all " << static_cast<int>(jobRatio * 100.0) << "% (" << itemsDone << "/" << itemsTotal
+                     << ")";
+            }
+        }
+        string text = line.str();
+        size_t len = text.size();
+        if (len < lastLength)
+            text.append(lastLength - len, ' ');
+        lastLength = len;
+        *out << text;
+        if (final)
+        {
+            *out << "\n";
+            lastLength = 0;
+        }
+        out->flush();
     }
+
+    std::ostream *out;
+    bool enabled;
+    std::thread worker;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::mutex drawMutex;
+    string fileLabel;
+    size_t lastLength = 0;
+    std::chrono::steady_clock::time_point startedAt;
+    std::chrono::steady_clock::time_point fileStartedAt;
+    std::atomic<bool> fileActive{false};
+    std::atomic<bool> jobActive{false};
+    std::atomic<uint64_t> fileTotal{0};
+    std::atomic<uint64_t> fileDone{0};
+    std::atomic<uint64_t> fileBase{0};
+    std::atomic<uint64_t> jobTotal{0};
+    std::atomic<uint64_t> jobDone{0};
+    std::atomic<uint64_t> itemsTotal{0};
+    std::atomic<uint64_t> itemsDone{0};
 };
 
-class BaseCrypto
+static ProgressReporter progress;
+
+// Process-wide counters for --stats, sampled before and after each operation.
+// Reads and writes are requests issued (pread, pwrite, io_uring entries, stream
+// reads); syscalls also include opens, resizes, syncs, mappings and io_uring_enter.
+// Durations are summed over threads, so parallel runs can exceed the wall time.
+struct OpCounters
 {
-protected:
-    static unsigned char keyByteFromKey(unsigned long long key, size_t i)
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> syscalls{0};
+    std::atomic<uint64_t> refills{0};
+    std::atomic<uint64_t> readNs{0};
+    std::atomic<uint64_t> transformNs{0};
+    std::atomic<uint64_t> writeNs{0};
+};
+
+static OpCounters opCounters;
+static bool opTiming = false; // set by --stats; untimed runs skip the clock reads and I/O counting in hot paths
+
+static uint64_t nanos_since(std::chrono::steady_clock::time_point t0)
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+}
+
+// Start of a timed section: the clock is only read when --stats is on.
+static std::chrono::steady_clock::time_point op_clock()
+{
+    return opTiming ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+}
+
+// Adds the time since t0 (from op_clock) to `total`.
+static void add_op_time(std::atomic<uint64_t> &total, std::chrono::steady_clock::time_point t0)
+{
+    if (opTiming)
+        total += nanos_since(t0);
+}
+
+// Records one read or write request that moved `bytes` and started at t0 (from op_clock).
+static void count_io(bool write, uint64_t bytes, std::chrono::steady_clock::time_point t0, bool syscall = true)
+{
+    if (!opTiming)
+        return;
+    uint64_t ns = nanos_since(t0);
+    if (syscall)
+        ++opCounters.syscalls;
+    if (write)
     {
-        size_t shift = (i % 8) * 8;
-        unsigned char b = static_cast<unsigned char>((key >> shift) & 0xFFULL);
-        return b;
+        ++opCounters.writes;
+        opCounters.bytesWritten += bytes;
+        opCounters.writeNs += ns;
     }
-
-    static unsigned char applyXor(unsigned char dataByte, unsigned long long key, size_t index)
+    else
     {
-        unsigned char k = keyByteFromKey(key, index);
-        return static_cast<unsigned char>(dataByte ^ k);
+        ++opCounters.reads;
+        opCounters.bytesRead += bytes;
+        opCounters.readNs += ns;
     }
-};
+}
 
-class ImageCrypto : public BaseCrypto
+// Positional file I/O (pread/pwrite, or overlapped offsets on Windows) so that
+// several workers can read and write disjoint ranges through one descriptor.
+class RawFile
 {
 public:
-    ImageCrypto() = default;
+    RawFile() = default;
+    ~RawFile()
+    {
+        close();
+    }
+    RawFile(const RawFile &) = delete;
+    RawFile &operator=(const RawFile &) = delete;
 
-    bool encrypt(const string &inputPath, unsigned long long key)
+#ifdef _WIN32
+    bool openRead(const string &path)
     {
-        string in = trim(inputPath);
-        if (!fs::exists(in))
-        {
-            cout << "Input image does not exist: " << in << "\n";
-            return false;
-        }
+        close();
+        h = CreateFileW(fs::path(path).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        ++opCounters.syscalls;
+        return isOpen();
+    }
 
-        string out = make_output_same_dir(in, "_enc", extension_of(in).empty() ? ".img" : "");
-        if (!confirm_overwrite_if_exists(out))
-        {
-            cout << "Skipping encrypt for: " << in << "\n";
-            return false;
-        }
+    bool openWrite(const string &path, bool truncate)
+    {
+        close();
+        h = CreateFileW(fs::path(path).wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                        nullptr, truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        ++opCounters.syscalls;
+        return isOpen();
+    }
 
-        ifstream fin(in, ios::binary);
-        ofstream fout(out, ios::binary);
-        if (!fin || !fout)
-        {
-            cout << "Failed to open files for image encrypt.\n";
-            return false;
-        }
+    bool isOpen() const
+    {
+        return h != INVALID_HANDLE_VALUE;
+    }
 
-        uint64_t total = filesize_bytes(in);
-        uint64_t processed = 0;
-        char buffer;
-        size_t idx = 0;
-        while (fin.get(buffer))
+    void close()
+    {
+        if (isOpen())
         {
-            unsigned char byte = static_cast<unsigned char>(buffer);
-            unsigned char transformed = applyXor(byte, key, idx);
-            fout.put(static_cast<char>(transformed));
-            ++idx;
-            ++processed;
-            if ((processed & 0x1FFF) == 0 || processed == total)
-            {
-                print_progress_bar(processed, total);
-            }
+            CloseHandle(h);
+            ++opCounters.syscalls;
         }
+        h = INVALID_HANDLE_VALUE;
+    }
 
-        fin.close();
-        fout.close();
-        cout << "\nImage encrypted to: " << out << "\n";
-        return true;
+    // Returns bytes read, 0 at end of file, -1 on error.
+    long long readAt(void *buf, size_t len, uint64_t offset)
+    {
+        OVERLAPPED ov = {};
+        ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFFULL);
+        ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD got = 0;
+        DWORD want = static_cast<DWORD>(std::min<size_t>(len, 0x40000000));
+        auto t0 = op_clock();
+        BOOL ok = ReadFile(h, buf, want, &got, &ov);
+        count_io(false, ok ? got : 0, t0);
+        if (!ok)
+            return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+        return static_cast<long long>(got);
     }
 
-    bool decrypt(const string &inputPath, unsigned long long key)
+    bool writeAt(const void *buf, size_t len, uint64_t offset)
     {
-        string in = trim(inputPath);
-        if (!fs::exists(in))
+        const char *p = static_cast<const char *>(buf);
+        while (len > 0)
         {
-            cout << "Input encrypted image does not exist: " << in << "\n";
-            return false;
+            OVERLAPPED ov = {};
+            ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFFULL);
+            ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD put = 0;
+            DWORD want = static_cast<DWORD>(std::min<size_t>(len, 0x40000000));
+            auto t0 = op_clock();
+            BOOL ok = WriteFile(h, p, want, &put, &ov);
+            count_io(true, ok ? put : 0, t0);
+            if (!ok || put == 0)
+                return false;
+            p += put;
+            len -= put;
+            offset += put;
         }
+        return true;
+    }
 
-        string out = make_output_same_dir(in, "_dec", ".jpg");
-        if (!confirm_overwrite_if_exists(out))
-        {
-            cout << "Skipping decrypt for: " << in << "\n";
-            return false;
-        }
+    struct Piece
+    {
+        const void *data;
+        size_t len;
+    };
 
-        ifstream fin(in, ios::binary);
-        ofstream fout(out, ios::binary);
-        if (!fin || !fout)
+    bool writeGatherAt(const vector<Piece> &pieces, uint64_t offset)
+    {
+        for (const Piece &piece : pieces)
         {
-            cout << "Failed to open files for image decrypt.\n";
-            return false;
+            if (!writeAt(piece.data, piece.len, offset))
+                return false;
+            offset += piece.len;
         }
+        return true;
+    }
 
-        uint64_t total = filesize_bytes(in);
-        uint64_t processed = 0;
-        char buffer;
-        size_t idx = 0;
-        while (fin.get(buffer))
-        {
-            unsigned char byte = static_cast<unsigned char>(buffer);
-            unsigned char transformed = applyXor(byte, key, idx);
-            fout.put(static_cast<char>(transformed));
-            ++idx;
-            ++processed;
-            if ((processed & 0x1FFF) == 0 || processed == total)
-            {
-                print_progress_bar(processed, total);
-            }
-        }
+    bool resize(uint64_t size)
+    {
+        LARGE_INTEGER li;
+        li.QuadPart = static_cast<LONGLONG>(size);
+        opCounters.syscalls += 2;
+        return SetFilePointerEx(h, li, nullptr, FILE_BEGIN) && SetEndOfFile(h);
+    }
 
-        fin.close();
-        fout.close();
-        cout << "\nImage decrypted to: " << out << "\n";
+    bool sync()
+    {
+        ++opCounters.syscalls;
+        return FlushFileBuffers(h) != 0;
+    }
+
+    // Exclusive advisory lock on the whole file, held until close(). Without
+    // `wait`, fails at once if another process holds it.
+    bool lock(bool wait)
+    {
+        OVERLAPPED ov = {};
+        ++opCounters.syscalls;
+        return LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY), 0, MAXDWORD, MAXDWORD,
+                          &ov) != 0;
+    }
+
+    // Size, last write time and file index, used to recognize the same input later.
+    bool identity(uint64_t &size, int64_t &mtime, uint64_t &id)
+    {
+        BY_HANDLE_FILE_INFORMATION info;
+        ++opCounters.syscalls;
+        if (!GetFileInformationByHandle(h, &info))
+            return false;
+        size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+        mtime = static_cast<int64_t>((static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) |
+                                     info.ftLastWriteTime.dwLowDateTime);
+        id = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
         return true;
     }
-};
 
-class FileCrypto : public BaseCrypto
-{
-public:
-    FileCrypto() = default;
+    // Shared read-write view of [offset, offset + len); offset must be a multiple of
+    // the allocation granularity (64 KiB).
+    unsigned char *mapRange(uint64_t offset, size_t len)
+    {
+        opCounters.syscalls += 3;
+        HANDLE mapping = CreateFileMappingW(h, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+        if (!mapping)
+            return nullptr;
+        void *view = MapViewOfFile(mapping, FILE_MAP_WRITE, static_cast<DWORD>(offset >> 32),
+                                   static_cast<DWORD>(offset & 0xFFFFFFFFULL), len);
+        CloseHandle(mapping);
+        return static_cast<unsigned char *>(view);
+    }
 
-    bool encrypt(const string &inputPath, unsigned long long key)
+    // Read-only view, for files opened with openRead().
+    const unsigned char *mapReadRange(uint64_t offset, size_t len)
     {
-        string in = trim(inputPath);
-        if (!fs::exists(in))
+        opCounters.syscalls += 3;
+        HANDLE mapping = CreateFileMappingW(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+            return nullptr;
+        void *view = MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(offset >> 32),
+                                   static_cast<DWORD>(offset & 0xFFFFFFFFULL), len);
+        CloseHandle(mapping);
+        return static_cast<const unsigned char *>(view);
+    }
+
+    bool flushRange(unsigned char *view, size_t len)
+    {
+        ++opCounters.syscalls;
+        return FlushViewOfFile(view, len) && sync();
+    }
+
+    void unmapRange(const unsigned char *view, size_t)
+    {
+        ++opCounters.syscalls;
+        UnmapViewOfFile(view);
+    }
+
+private:
+    HANDLE h = INVALID_HANDLE_VALUE;
+#else
+    bool openRead(const string &path)
+    {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY);
+        ++opCounters.syscalls;
+        return isOpen();
+    }
+
+    bool openWrite(const string &path, bool truncate)
+    {
+        close();
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        ++opCounters.syscalls;
+        return isOpen();
+    }
+
+    bool isOpen() const
+    {
+        return fd >= 0;
+    }
+
+    void close()
+    {
+        if (isOpen())
         {
-            cout << "Input file does not exist: " << in << "\n";
-            return false;
+            ::close(fd);
+            ++opCounters.syscalls;
         }
+        fd = -1;
+    }
 
-        string ext = extension_of(in);
-        string out = make_output_same_dir(in, "_enc", ext.empty() ? ".enc" : ".enc");
-        if (!confirm_overwrite_if_exists(out))
+    // Returns bytes read, 0 at end of file, -1 on error.
+    long long readAt(void *buf, size_t len, uint64_t offset)
+    {
+        ssize_t got;
+        do
         {
-            cout << "Skipping encrypt for: " << in << "\n";
-            return false;
+            auto t0 = op_clock();
+            got = ::pread(fd, buf, len, static_cast<off_t>(offset));
+            count_io(false, got > 0 ? static_cast<uint64_t>(got) : 0, t0);
+        } while (got < 0 && errno == EINTR);
+        return static_cast<long long>(got);
+    }
+
+    bool writeAt(const void *buf, size_t len, uint64_t offset)
+    {
+        const char *p = static_cast<const char *>(buf);
+        while (len > 0)
+        {
+            auto t0 = op_clock();
+            ssize_t put = ::pwrite(fd, p, len, static_cast<off_t>(offset));
+            count_io(true, put > 0 ? static_cast<uint64_t>(put) : 0, t0);
+            if (put < 0 && errno == EINTR)
+                continue;
+            if (put <= 0)
+                return false;
+            p += put;
+            len -= static_cast<size_t>(put);
+            offset += static_cast<uint64_t>(put);
         }
+        return true;
+    }
 
-        ifstream fin(in, ios::binary);
-        ofstream fout(out, ios::binary);
-        if (!fin || !fout)
+    struct Piece
+    {
+        const void *data;
+        size_t len;
+    };
+
+    // Writes several buffers back to back with one pwritev; a short write is
+    // finished piece by piece.
+    bool writeGatherAt(const vector<Piece> &pieces, uint64_t offset)
+    {
+        vector<iovec> iov;
+        for (const Piece &piece : pieces)
+            iov.push_back({const_cast<void *>(piece.data), piece.len});
+        ssize_t put;
+        do
         {
-            cout << "Failed to open files for file encrypt.\n";
+            auto t0 = op_clock();
+            put = ::pwritev(fd, iov.data(), static_cast<int>(iov.size()), static_cast<off_t>(offset));
+            count_io(true, put > 0 ? static_cast<uint64_t>(put) : 0, t0);
+        } while (put < 0 && errno == EINTR);
+        if (put < 0)
             return false;
-        }
 
-        uint64_t total = filesize_bytes(in);
-        uint64_t processed = 0;
-        char buffer;
-        size_t idx = 0;
-        while (fin.get(buffer))
+        size_t skip = static_cast<size_t>(put);
+        for (const Piece &piece : pieces)
         {
-            unsigned char byte = static_cast<unsigned char>(buffer);
-            unsigned char transformed = applyXor(byte, key, idx);
-            fout.put(static_cast<char>(transformed));
-            ++idx;
-            ++processed;
-            if ((processed & 0x1FFF) == 0 || processed == total)
+            uint64_t at = offset;
+            offset += piece.len;
+            if (skip >= piece.len)
             {
-                print_progress_bar(processed, total);
+                skip -= piece.len;
+                continue;
             }
+            if (!writeAt(static_cast<const char *>(piece.data) + skip, piece.len - skip, at + skip))
+                return false;
+            skip = 0;
         }
-
-        fin.close();
-        fout.close();
-        cout << "\nFile encrypted to: " << out << "\n";
         return true;
     }
 
-    bool decrypt(const string &inputPath, unsigned long long key)
+    bool resize(uint64_t size)
     {
-        string in = trim(inputPath);
-        if (!fs::exists(in))
-        {
-            cout << "Encrypted file does not exist: " << in << "\n";
-            return false;
-        }
+        ++opCounters.syscalls;
+        return ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+    }
 
-        string dir = dirname_of(in);
-        string base = basename_of(in);
-        string outName;
+    bool sync()
+    {
+        ++opCounters.syscalls;
+        return ::fsync(fd) == 0;
+    }
 
-        size_t posEnc = base.rfind("_enc");
-        if (posEnc != string::npos)
+    // Exclusive advisory lock on the whole file, held until close(). Without
+    // `wait`, fails at once if another process holds it.
+    bool lock(bool wait)
+    {
+        int r;
+        do
         {
+            ++opCounters.syscalls;
+            r = ::flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB));
+        } while (r != 0 && errno == EINTR);
+        return r == 0;
+    }
 
-            string withoutEnc = base.substr(0, posEnc);
-            string ext = fs::path(base).extension().string();
-
-            if (ext == ".enc")
-            {
+    // Size, modification time (ns) and inode, used to recognize the same input later.
+    bool identity(uint64_t &size, int64_t &mtime, uint64_t &id)
+    {
+        struct stat st;
+        ++opCounters.syscalls;
+        if (::fstat(fd, &st) != 0)
+            return false;
+        size = static_cast<uint64_t>(st.st_size);
+#ifdef __linux__
+        mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+        mtime = static_cast<int64_t>(st.st_mtime) * 1000000000LL;
+#endif
+        id = static_cast<uint64_t>(st.st_ino);
+        return true;
+    }
 
-                string stem = fs::path(withoutEnc).stem().string();
-                string origExt = fs::path(withoutEnc).extension().string();
-                if (!origExt.empty())
-                {
-                    outName = stem + origExt;
-                }
-                else
-                {
-                    outName = withoutEnc;
-                }
-            }
-            else
-            {
-                outName = withoutEnc + ext;
-            }
-        }
-        else if (base.size() > 4 && base.substr(base.size() - 4) == ".enc")
-        {
-            outName = base.substr(0, base.size() - 4);
-        }
-        else
-        {
-            outName = base + "_dec";
-        }
+    // Shared read-write mapping of [offset, offset + len); offset must be page aligned.
+    unsigned char *mapRange(uint64_t offset, size_t len)
+    {
+        opCounters.syscalls += 2;
+        void *view = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(offset));
+        if (view == MAP_FAILED)
+            return nullptr;
+        ::madvise(view, len, MADV_SEQUENTIAL);
+        return static_cast<unsigned char *>(view);
+    }
 
-        string outPath = (fs::path(dir) / fs::path(outName)).string();
-        if (!confirm_overwrite_if_exists(outPath))
-        {
-            cout << "Skipping decrypt for: " << in << "\n";
-            return false;
-        }
+    // Read-only view, for files opened with openRead().
+    const unsigned char *mapReadRange(uint64_t offset, size_t len)
+    {
+        ++opCounters.syscalls;
+        void *view = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(offset));
+        if (view == MAP_FAILED)
+            return nullptr;
+        return static_cast<const unsigned char *>(view);
+    }
 
-        ifstream fin(in, ios::binary);
-        ofstream fout(outPath, ios::binary);
-        if (!fin || !fout)
-        {
-            cout << "Failed to open files for file decrypt.\n";
-            return false;
-        }
+    bool flushRange(unsigned char *view, size_t len)
+    {
+        ++opCounters.syscalls;
+        return ::msync(view, len, MS_SYNC) == 0;
+    }
 
-        uint64_t total = filesize_bytes(in);
-        uint64_t processed = 0;
-        char buffer;
-        size_t idx = 0;
+    void unmapRange(const unsigned char *view, size_t len)
+    {
+        ++opCounters.syscalls;
+        ::munmap(const_cast<unsigned char *>(view), len);
+    }
 
-        while (fin.get(buffer))
-        {
-            unsigned char byte = static_cast<unsigned char>(buffer);
-            unsigned char transformed = applyXor(byte, key, idx);
-            fout.put(static_cast<char>(transformed));
-            ++idx;
-            ++processed;
-            if ((processed & 0x1FFF) == 0 || processed == total)
-            {
-                print_progress_bar(processed, total);
-            }
-        }
+    int handle() const
+    {
+        return fd;
+    }
 
-        fin.close();
-        fout.close();
-        cout << "\nFile decrypted to: " << outPath << "\n";
-        return true;
+    // Takes ownership of an already open descriptor.
+    void adopt(int descriptor)
+    {
+        close();
+        fd = descriptor;
     }
+
+private:
+    int fd = -1;
+#endif
 };
 
-string base64Encode(const vector<unsigned char> &data)
+// Copies src to dst (created or truncated) letting the kernel move the bytes: a
+// reflink clone where the filesystem supports it, then copy_file_range, then
+// sendfile, and a userspace stream copy as the last resort.
+static bool copy_file_fast(const string &src, const string &dst)
 {
-    static const char table[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-    string encoded;
-    int val = 0, valb = -6;
-    for (unsigned char c : data)
+#ifdef __linux__
+    RawFile in;
+    RawFile out;
+    if (!in.openRead(src) || !out.openWrite(dst, true))
+        return false;
+#ifdef FICLONE
+    ++opCounters.syscalls;
+    if (::ioctl(out.handle(), FICLONE, in.handle()) == 0)
+        return true;
+#endif
+    uint64_t total = filesize_bytes(src);
+    uint64_t copied = 0;
+    bool useCopyRange = true;
+    while (copied < total)
     {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0)
+        size_t want = static_cast<size_t>(std::min<uint64_t>(total - copied, 1ULL << 30));
+        auto t0 = op_clock();
+        ssize_t n;
+        if (useCopyRange)
         {
-            encoded.push_back(table[(val >> valb) & 0x3F]);
-            valb -= 6;
+            n = ::copy_file_range(in.handle(), nullptr, out.handle(), nullptr, want, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) && copied == 0)
+            {
+                ++opCounters.syscalls;
+                useCopyRange = false;
+                continue;
+            }
         }
+        else
+        {
+            n = ::sendfile(out.handle(), in.handle(), nullptr, want);
+        }
+        count_io(true, n > 0 ? static_cast<uint64_t>(n) : 0, t0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        copied += static_cast<uint64_t>(n);
     }
-    if (valb > -6)
-        encoded.push_back(table[((val << 8) >> (valb + 8)) & 0x3F]);
-    while (encoded.size() % 4)
-        encoded.push_back('=');
-    return encoded;
+    if (copied == total)
+        return true;
+    in.close();
+    out.close();
+#endif
+    ifstream fin(src, ios::binary);
+    ofstream fout(dst, ios::binary | ios::trunc);
+    if (!fin || !fout)
+        return false;
+    if (filesize_bytes(src) > 0)
+        fout << fin.rdbuf();
+    return static_cast<bool>(fout);
 }
 
-vector<unsigned char> base64Decode(const string &s)
+// Blocking FIFO of buffer-slot indices used to hand slots between pipeline stages.
+// Each queue can only ever hold the pipeline's fixed set of slots.
+class SlotQueue
 {
-    static const int T[256] = {
-        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
-        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, 64, -1, -1,
-        -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
-        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
-        -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51};
-
-    vector<unsigned char> out;
-    int val = 0, valb = -8;
-    for (unsigned char c : s)
+public:
+    void push(int slot)
     {
-        if (T[c] == -1)
-            break;
-        if (T[c] == 64)
-            break;
-        val = (val << 6) + T[c];
-        valb += 6;
-        if (valb >= 0)
         {
-            out.push_back((val >> valb) & 0xFF);
-            valb -= 8;
+            std::lock_guard<std::mutex> lock(m);
+            items.push_back(slot);
         }
+        cv.notify_one();
     }
-    return out;
-}
 
-class TextCrypto : public BaseCrypto
+    int pop()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]
+                { return !items.empty(); });
+        int slot = items.front();
+        items.pop_front();
+        return slot;
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<int> items;
+};
+
+// Task pool with one deque per worker: owners take tasks from the front, idle
+// workers steal from the back of the other deques. run() returns once every task,
+// including tasks pushed by running tasks, has finished.
+class WorkStealingPool
 {
 public:
-    TextCrypto() = default;
+    typedef std::function<void(unsigned worker)> Task;
 
-    bool encryptInput(const string &input, unsigned long long key, bool isFile)
+    explicit WorkStealingPool(unsigned workers) : queues(workers ? workers : 1) {}
+
+    unsigned size() const
     {
-        string text;
-        string filePath;
+        return static_cast<unsigned>(queues.size());
+    }
 
-        if (isFile)
-        {
-            filePath = trim(input);
-            if (!fs::exists(filePath))
-            {
-                cout << "Text file does not exist: " << filePath << "\n";
-                return false;
-            }
-            ifstream fin(filePath);
-            if (!fin)
-            {
-                cout << "Failed to open text file.\n";
-                return false;
-            }
-            stringstream buffer;
-            buffer << fin.rdbuf();
-            text = buffer.str();
-            fin.close();
-        }
-        else
+    void push(unsigned worker, Task task)
+    {
+        Queue &q = queues[worker % queues.size()];
+        ++pending;
         {
-            text = input;
+            std::lock_guard<std::mutex> lock(q.m);
+            q.tasks.push_back(std::move(task));
+            ++queued;
         }
-
-        vector<unsigned char> encrypted;
-        encrypted.reserve(text.size());
-        size_t idx = 0;
-        for (unsigned char ch : text)
         {
-            encrypted.push_back(applyXor(ch, key, idx));
-            ++idx;
+            std::lock_guard<std::mutex> lock(idleMutex);
         }
+        idle.notify_one();
+    }
 
-        string encoded = base64Encode(encrypted);
+    void run()
+    {
+        vector<std::thread> threads;
+        for (unsigned w = 1; w < size(); ++w)
+            threads.emplace_back([this, w]()
+                                 { loop(w); });
+        loop(0);
+        for (std::thread &t : threads)
+            t.join();
+    }
 
-        cout << "Encrypted text (Base64): " << encoded << "\n";
+private:
+    struct Queue
+    {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
 
-        if (isFile)
+    bool take(unsigned worker, Task &task)
+    {
+        for (unsigned k = 0; k < size(); ++k)
         {
-            char choice;
-            cout << "Do you want to save encrypted text to a file? (y/n): ";
-            cin >> choice;
-            cin.ignore();
-            if (choice == 'y' || choice == 'Y')
+            Queue &q = queues[(worker + k) % size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.tasks.empty())
+                continue;
+            if (k == 0)
+            {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            else
             {
-                string outPath = filePath + "_enc.txt";
-                ofstream fout(outPath);
-                fout << encoded;
-                fout.close();
-                cout << "Encrypted text saved to: " << outPath << "\n";
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
             }
+            --queued;
+            return true;
         }
-        return true;
+        return false;
     }
 
-    bool decryptInput(const string &input, unsigned long long key, bool isFile)
+    // Idle workers sleep until push() queues a task or the last task finishes.
+    void loop(unsigned worker)
     {
-        string encBase64;
-        string filePath;
-
-        if (isFile)
+        for (;;)
         {
-            filePath = trim(input);
-            if (!fs::exists(filePath))
-            {
-                cout << "Encrypted text file does not exist: " << filePath << "\n";
-                return false;
-            }
-            ifstream fin(filePath);
-            if (!fin)
+            Task task;
+            if (take(worker, task))
             {
-                cout << "Failed to open encrypted text file.\n";
-                return false;
+                task(worker);
+                if (--pending == 0)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(idleMutex);
+                    }
+                    idle.notify_all();
+                }
+                continue;
             }
-            stringstream buffer;
-            buffer << fin.rdbuf();
-            encBase64 = buffer.str();
-            fin.close();
-        }
-        else
-        {
-            encBase64 = input;
+            std::unique_lock<std::mutex> lock(idleMutex);
+            idle.wait(lock, [this]()
+                      { return pending == 0 || queued > 0; });
+            if (pending == 0)
+                return;
         }
+    }
 
-        vector<unsigned char> encrypted = base64Decode(encBase64);
+    vector<Queue> queues;
+    std::atomic<uint64_t> pending{0}; // pushed and not yet finished
+    std::atomic<uint64_t> queued{0};  // pushed and not yet taken
+    std::mutex idleMutex;
+    std::condition_variable idle;
+};
 
-        string decrypted;
-        decrypted.reserve(encrypted.size());
-        size_t idx = 0;
-        for (unsigned char ch : encrypted)
-        {
-            decrypted.push_back(static_cast<char>(applyXor(ch, key, idx)));
-            ++idx;
-        }
+#ifdef STEALTH_HAVE_IO_URING
+// Minimal io_uring wrapper over the raw syscalls (no liburing dependency): one
+// submission/completion ring pair, vectored reads and writes with user data.
+class IoRing
+{
+public:
+    IoRing() = default;
+    ~IoRing()
+    {
+        if (sqes)
+            ::munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing)
+            ::munmap(cqRing, cqRingSize);
+        if (sqRing)
+            ::munmap(sqRing, sqRingSize);
+        if (ringFd >= 0)
+            ::close(ringFd);
+    }
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
 
-        cout << "Decrypted text: " << decrypted << "\n";
+    // Fails (and the caller falls back to threads) on kernels without io_uring or
+    // where it is disabled, e.g. by a seccomp policy.
+    bool init(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        ++opCounters.syscalls;
+        if (ringFd < 0)
+            return false;
 
-        if (isFile)
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mapRing(sqRingSize, IORING_OFF_SQ_RING);
+        if (!sqRing)
+            return false;
+        cqRing = single ? sqRing : mapRing(cqRingSize, IORING_OFF_CQ_RING);
+        if (!cqRing)
+            return false;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mapRing(sqesSize, IORING_OFF_SQES));
+        if (!sqes)
+            return false;
+
+        unsigned char *sq = static_cast<unsigned char *>(sqRing);
+        unsigned char *cq = static_cast<unsigned char *>(cqRing);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void queue(unsigned char opcode, int fd, const iovec *iov, uint64_t offset, uint64_t userData)
+    {
+        unsigned tail = *sqTail;
+        unsigned idx = tail & sqMask;
+        io_uring_sqe *sqe = &sqes[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(iov);
+        sqe->len = 1;
+        sqe->off = offset;
+        sqe->user_data = userData;
+        sqArray[idx] = idx;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++toSubmit;
+    }
+
+    // Submits everything queued and blocks until at least one completion is ready.
+    bool submitAndWait()
+    {
+        for (;;)
         {
-            char choice;
-            cout << "Do you want to save decrypted text to a file? (y/n): ";
-            cin >> choice;
-            cin.ignore();
-            if (choice == 'y' || choice == 'Y')
+            long r = ::syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            ++opCounters.syscalls;
+            if (r >= 0)
             {
-                string outPath = filePath + "_dec.txt";
-                ofstream fout(outPath);
-                fout << decrypted;
-                fout.close();
-                cout << "Decrypted text saved to: " << outPath << "\n";
+                toSubmit -= static_cast<unsigned>(r) < toSubmit ? static_cast<unsigned>(r) : toSubmit;
+                return true;
             }
+            if (errno != EINTR)
+                return false;
         }
+    }
+
+    bool pop(uint64_t &userData, int &result)
+    {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return false;
+        const io_uring_cqe &cqe = cqes[head & cqMask];
+        userData = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
         return true;
     }
+
+private:
+    void *mapRing(size_t size, off_t offset)
+    {
+        ++opCounters.syscalls;
+        void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    int ringFd = -1;
+    void *sqRing = nullptr;
+    void *cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned *sqArray = nullptr;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned cqMask = 0;
+    unsigned toSubmit = 0;
 };
+#endif
 
-class Stego : public BaseCrypto
+// Persistent user database in one file: a header, an open-addressing index of
+// (name hash, record offset) slots, then an append-only log of records
+// (u32 name length, u32 check, 16-byte salt, 16-byte password verifier, name,
+// padded to 8 bytes). No record holds anything the file key can be derived from
+// without guessing the password. The file is
+// memory-mapped at open and lookups probe the index directly, so opening does not
+// read the indexed records. Records appended after the last compaction (the tail)
+// are scanned into a small map at open; compaction rewrites the file with every
+// record indexed once the tail grows past a fraction of the indexed count.
+class UserStore
 {
 public:
-    Stego() = default;
+    UserStore() = default;
+    ~UserStore()
+    {
+        unmap();
+    }
+    UserStore(const UserStore &) = delete;
+    UserStore &operator=(const UserStore &) = delete;
 
-    bool storeFileInImage(const string &imagePath, const string &filePath, unsigned long long key)
+    // Salted one-way check of a password, see UserManager::credentialFor().
+    struct Credential
     {
-        string img = trim(imagePath);
-        string file = trim(filePath);
+        unsigned char salt[16];
+        unsigned char verifier[16];
+    };
 
-        if (!fs::exists(img))
+    // A missing file is an empty store. Returns false if the file is not a valid
+    // user database; appends are then refused so it is never overwritten.
+    bool open(const string &dbPath)
+    {
+        unmap();
+        path = dbPath;
+        tail.clear();
+        broken = false;
+        if (!fs::exists(path))
+            return true;
+
+        mappedSize = filesize_bytes(path);
+        if (mappedSize < sizeof(Header) || !file.openWrite(path, false) ||
+            !(view = file.mapRange(0, static_cast<size_t>(mappedSize))))
         {
-            cout << "Image does not exist: " << img << "\n";
+            broken = true;
+            unmap();
             return false;
         }
-        if (!fs::exists(file))
+        std::memcpy(&header, view, sizeof(header));
+        if (std::memcmp(header.magic, "SLUSRDB2", 8) != 0 || header.slots == 0 ||
+            (header.slots & (header.slots - 1)) != 0 || header.slots > (mappedSize - sizeof(Header)) / sizeof(Slot) ||
+            header.recordsBegin != sizeof(Header) + header.slots * sizeof(Slot) ||
+            header.recordsEnd < header.recordsBegin || header.recordsEnd > mappedSize)
         {
-            cout << "File to hide does not exist: " << file << "\n";
+            broken = true;
+            unmap();
             return false;
         }
 
-        string out = make_output_same_dir(img, "_stego", extension_of(img).empty() ? ".img" : "");
-        if (!confirm_overwrite_if_exists(out))
+        // Only the tail is read; a torn record at the very end is ignored and
+        // overwritten by the next append.
+        string name;
+        Credential cred;
+        uint64_t pos = header.recordsEnd;
+        uint64_t next;
+        while (readRecord(pos, name, cred, next))
         {
-            cout << "Skipping store in image.\n";
-            return false;
+            tail[name] = cred;
+            pos = next;
         }
+        validEnd = pos;
+        return true;
+    }
 
-        ifstream finImg(img, ios::binary);
-        ifstream finFile(file, ios::binary);
-        ofstream fout(out, ios::binary);
-        if (!finImg || !finFile || !fout)
+    bool find(const string &name, Credential &cred) const
+    {
+        auto it = tail.find(name);
+        if (it != tail.end())
         {
-            cout << "Failed to open files for stego store.\n";
-            return false;
+            cred = it->second;
+            return true;
         }
+        if (!view)
+            return false;
+        const uint64_t slot = findSlot(name);
+        string found;
+        uint64_t next;
+        return slot != kNoSlot && slotAt(slot).offset != 0 && readRecord(slotAt(slot).offset, found, cred, next);
+    }
 
-        fout << finImg.rdbuf();
-
-        const string signature = "STEGOSTR";
-        fout.write(signature.c_str(), static_cast<std::streamsize>(signature.size()));
-
-        string hiddenFileName = basename_of(file);
-        uint64_t nameLen = static_cast<uint64_t>(hiddenFileName.size());
-        fout.write(reinterpret_cast<const char *>(&nameLen), sizeof(nameLen));
-        fout.write(hiddenFileName.c_str(), static_cast<std::streamsize>(hiddenFileName.size()));
-
-        uint64_t total = filesize_bytes(file);
-        uint64_t processed = 0;
-        char buffer;
-        size_t idx = 0;
-        while (finFile.get(buffer))
+    // Appends one record (creating the file if needed) and enters it in the index
+    // in place. The record is synced before the header covers it, so a crash
+    // leaves at most an unindexed record at the end, which open() reads back and
+    // the next append compacts. Processes sharing the file take turns through a
+    // lock file and pick up each other's appends before writing.
+    bool append(const string &name, const Credential &cred)
+    {
+        if (broken || name.empty() || name.size() > kMaxName)
+            return false;
+        RawFile lock;
+        if (!lockStore(lock) || !open(path))
+            return false;
+        const uint64_t slot = view ? findSlot(name) : kNoSlot;
+        if (slot == kNoSlot || !tail.empty() || (header.indexed + 1) * 4 > header.slots * 3)
         {
-            unsigned char byte = static_cast<unsigned char>(buffer);
-            unsigned char enc = applyXor(byte, key, idx);
-            fout.put(static_cast<char>(enc));
-            ++idx;
-            ++processed;
-            if ((processed & 0x1FFF) == 0 || processed == total)
-            {
-                print_progress_bar(processed, total);
-            }
+            tail[name] = cred;
+            return compact();
         }
-
-        finImg.close();
-        finFile.close();
-        fout.close();
-
-        cout << "\nStored file '" << hiddenFileName << "' inside image: " << out << "\n";
-        cout << "Original image size (bytes) which you may need for retrieval: " << filesize_bytes(img) << "\n";
+        const bool replaces = slotAt(slot).offset != 0;
+        const Slot entry = {nameHash(name), validEnd};
+        vector<unsigned char> rec = encodeRecord(name, cred);
+        Header next = header;
+        next.recordsEnd = validEnd + rec.size();
+        if (!replaces)
+            ++next.indexed;
+        if (!file.writeAt(rec.data(), rec.size(), validEnd) ||
+            !file.writeAt(&entry, sizeof(entry), sizeof(Header) + slot * sizeof(Slot)) || !file.sync() ||
+            !file.writeAt(&next, sizeof(next), 0) || !file.sync())
+            return false;
+        header = next;
+        validEnd = next.recordsEnd;
+        tail[name] = cred; // past the mapping until the next open()
         return true;
     }
 
-    bool retrieveFileFromImage(const string &imageWithFile, uint64_t originalImageSize, unsigned long long key)
+    // Bulk load: the new records go straight into one compacted rewrite instead of
+    // being appended (and synced) one at a time.
+    bool appendMany(const vector<std::pair<string, Credential>> &records)
     {
-        string img = trim(imageWithFile);
-        if (!fs::exists(img))
-        {
-            cout << "Image-with-file does not exist: " << img << "\n";
+        if (broken)
+            return false;
+        if (records.empty())
+            return true;
+        RawFile lock;
+        if (!lockStore(lock) || !open(path))
             return false;
+        for (const auto &r : records)
+        {
+            if (r.first.empty() || r.first.size() > kMaxName)
+                return false;
+            tail[r.first] = r.second;
         }
+        return compact();
+    }
 
-        ifstream fin(img, ios::binary);
-        if (!fin)
-        {
-            cout << "Failed to open image-with-file for reading.\n";
+    // Rewrites the file with every record in the index, via a temporary file that
+    // replaces the old one only once it is complete. A name recorded more than
+    // once keeps its last credential.
+    bool compact()
+    {
+        if (broken)
             return false;
+        vector<std::pair<string, Credential>> records;
+        records.reserve(static_cast<size_t>(header.indexed) + tail.size());
+        if (view)
+        {
+            std::unordered_map<string, size_t> seen;
+            string name;
+            Credential cred;
+            uint64_t next;
+            for (uint64_t pos = header.recordsBegin; pos < header.recordsEnd && readRecord(pos, name, cred, next);
+                 pos = next)
+            {
+                if (tail.find(name) != tail.end())
+                    continue;
+                auto ins = seen.emplace(name, records.size());
+                if (ins.second)
+                    records.emplace_back(name, cred);
+                else
+                    records[ins.first->second].second = cred;
+            }
         }
+        for (const auto &entry : tail)
+            records.emplace_back(entry.first, entry.second);
+        return writeCompacted(records);
+    }
 
-        uint64_t fileLen = filesize_bytes(img);
-        if (originalImageSize >= fileLen)
+    uint64_t size() const
+    {
+        return (view ? header.indexed : 0) + tail.size();
+    }
+
+private:
+    static const size_t kMaxName = 4096;
+    static const uint64_t kNoSlot = UINT64_MAX;
+
+    struct Header
+    {
+        char magic[8];
+        uint64_t slots;
+        uint64_t indexed;
+        uint64_t recordsBegin;
+        uint64_t recordsEnd;
+        uint64_t reserved[3];
+    };
+
+    struct Slot
+    {
+        uint64_t hash;
+        uint64_t offset; // 0 marks an empty slot
+    };
+
+    static uint64_t nameHash(const string &name)
+    {
+        uint64_t h = 1469598103934665603ULL; // FNV-1a
+        for (unsigned char c : name)
         {
-            cout << "Given original image size is equal or larger than the file; nothing to retrieve.\n";
-            fin.close();
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static const size_t kRecordHead = 8 + sizeof(Credential);
+
+    static uint32_t recordCheck(uint64_t hash, const Credential &cred, uint32_t len)
+    {
+        return stealth::crc32c(reinterpret_cast<const unsigned char *>(&cred), sizeof(cred),
+                               static_cast<uint32_t>(hash ^ (hash >> 32)) ^ len);
+    }
+
+    static vector<unsigned char> encodeRecord(const string &name, const Credential &cred)
+    {
+        uint32_t len = static_cast<uint32_t>(name.size());
+        uint32_t check = recordCheck(nameHash(name), cred, len);
+        vector<unsigned char> rec((kRecordHead + name.size() + 7) & ~static_cast<size_t>(7), 0);
+        std::memcpy(rec.data(), &len, 4);
+        std::memcpy(rec.data() + 4, &check, 4);
+        std::memcpy(rec.data() + 8, &cred, sizeof(cred));
+        std::memcpy(rec.data() + kRecordHead, name.data(), name.size());
+        return rec;
+    }
+
+    Slot slotAt(uint64_t i) const
+    {
+        Slot slot;
+        std::memcpy(&slot, view + sizeof(Header) + i * sizeof(Slot), sizeof(slot));
+        return slot;
+    }
+
+    // Slot holding `name`, else the empty slot where it would go; kNoSlot if the
+    // probe visits every slot without finding either.
+    uint64_t findSlot(const string &name) const
+    {
+        const uint64_t h = nameHash(name);
+        const uint64_t mask = header.slots - 1;
+        uint64_t i = h & mask;
+        for (uint64_t probes = 0; probes < header.slots; ++probes, i = (i + 1) & mask)
+        {
+            Slot slot = slotAt(i);
+            if (slot.offset == 0)
+                return i;
+            string found;
+            Credential cred;
+            uint64_t next;
+            if (slot.hash == h && readRecord(slot.offset, found, cred, next) && found == name)
+                return i;
+        }
+        return kNoSlot;
+    }
+
+    bool lockStore(RawFile &lock) const
+    {
+        return lock.openWrite(path + ".lock", false) && lock.lock(true);
+    }
+
+    // Decodes the record at `pos` from the mapping; false past the end or if the
+    // record is torn or corrupt.
+    bool readRecord(uint64_t pos, string &name, Credential &cred, uint64_t &next) const
+    {
+        if (!view || pos + kRecordHead > mappedSize)
             return false;
+        uint32_t len;
+        uint32_t check;
+        std::memcpy(&len, view + pos, 4);
+        std::memcpy(&check, view + pos + 4, 4);
+        std::memcpy(&cred, view + pos + 8, sizeof(cred));
+        next = pos + ((kRecordHead + static_cast<uint64_t>(len) + 7) & ~7ULL);
+        if (len == 0 || len > kMaxName || next > mappedSize)
+            return false;
+        name.assign(reinterpret_cast<const char *>(view + pos + kRecordHead), len);
+        return recordCheck(nameHash(name), cred, len) == check;
+    }
+
+    bool writeCompacted(const vector<std::pair<string, Credential>> &records)
+    {
+        uint64_t slots = 16;
+        while (slots < records.size() * 2)
+            slots <<= 1;
+        Header h = {};
+        std::memcpy(h.magic, "SLUSRDB2", 8);
+        h.slots = slots;
+        h.indexed = records.size();
+        h.recordsBegin = sizeof(Header) + slots * sizeof(Slot);
+
+        vector<Slot> index(static_cast<size_t>(slots), Slot{0, 0});
+        vector<unsigned char> log;
+        for (const auto &r : records)
+        {
+            uint64_t offset = h.recordsBegin + log.size();
+            vector<unsigned char> rec = encodeRecord(r.first, r.second);
+            log.insert(log.end(), rec.begin(), rec.end());
+            uint64_t hash = nameHash(r.first);
+            uint64_t i = hash & (slots - 1);
+            while (index[static_cast<size_t>(i)].offset != 0)
+                i = (i + 1) & (slots - 1);
+            index[static_cast<size_t>(i)] = Slot{hash, offset};
         }
+        h.recordsEnd = h.recordsBegin + log.size();
 
-        fin.seekg(static_cast<std::streamoff>(originalImageSize), ios::beg);
+        string tmp = path + ".tmp";
+        {
+            RawFile out;
+            vector<RawFile::Piece> pieces = {{&h, sizeof(h)},
+                                             {index.data(), index.size() * sizeof(Slot)},
+                                             {log.data(), log.size()}};
+            if (!out.openWrite(tmp, true) || !out.writeGatherAt(pieces, 0) || !out.sync())
+            {
+                std::error_code ec;
+                fs::remove(tmp, ec);
+                return false;
+            }
+        }
+        unmap();
+        std::error_code ec;
+        fs::rename(tmp, path, ec);
+        if (ec)
+            return false;
+        return open(path);
+    }
 
-        char sigBuf[9] = {0};
-        fin.read(sigBuf, 8);
-        string signature(sigBuf, 8);
-        if (signature != "STEGOSTR")
+    void unmap()
+    {
+        if (view)
+            file.unmapRange(view, static_cast<size_t>(mappedSize));
+        view = nullptr;
+        mappedSize = 0;
+        validEnd = 0;
+        header = {};
+        file.close();
+    }
+
+    string path;
+    RawFile file;
+    unsigned char *view = nullptr;
+    uint64_t mappedSize = 0;
+    uint64_t validEnd = 0;
+    Header header = {};
+    bool broken = false;
+    std::unordered_map<string, Credential> tail;
+};
+
+class UserManager
+{
+private:
+    map<string, unsigned long long> users; // built-in accounts and unsaved signups
+    UserStore store;
+    inline static string storePath = "stealth_users.db";
+
+    unsigned long long customHash(const string &password)
+    {
+        return stealth::deriveKey(password);
+    }
+
+    // What the user database keeps of a password: the salt is put in front of the
+    // password before the stretched key derivation, and the verifier is a truncated
+    // HMAC-SHA-256 under the derived key. Unlike customHash(), it is not the file key.
+    static UserStore::Credential credentialFor(const string &password, const unsigned char salt[16])
+    {
+        static const char label[] = "SLUSER";
+        UserStore::Credential cred;
+        std::memcpy(cred.salt, salt, sizeof(cred.salt));
+        stealth::ChaCha20Key k =
+            stealth::deriveChaChaKey(string(reinterpret_cast<const char *>(salt), sizeof(cred.salt)) + password);
+        unsigned char macKey[32];
+        unsigned char mac[32];
+        std::memcpy(macKey, k.words, sizeof(macKey));
+        stealth::hmacSha256(macKey, reinterpret_cast<const unsigned char *>(label), sizeof(label) - 1, mac);
+        std::memcpy(cred.verifier, mac, sizeof(cred.verifier));
+        return cred;
+    }
+
+    static UserStore::Credential newCredential(const string &password)
+    {
+        std::random_device rd;
+        unsigned char salt[16];
+        for (unsigned char &b : salt)
+            b = static_cast<unsigned char>(rd());
+        return credentialFor(password, salt);
+    }
+
+public:
+    UserManager()
+    {
+        users["admin"] = customHash("admin123");
+        users["guest"] = customHash("guest123");
+        if (!store.open(storePath))
+            cout << "User database is unreadable, signups will not be saved: " << storePath << "\n";
+    }
+
+    // User database file (default stealth_users.db in the working directory). It is
+    // created by the first signup.
+    static void setStorePath(const string &path)
+    {
+        storePath = path;
+    }
+
+    // Adds "username:password" lines from listPath to the database, skipping names
+    // that already exist. Returns the number added or -1.
+    long long importUsers(const string &listPath)
+    {
+        ifstream in(listPath);
+        if (!in)
+            return -1;
+        vector<std::pair<string, string>> lines;
+        std::unordered_map<string, bool> seen;
+        string line;
+        while (std::getline(in, line))
         {
-            cout << "Warning: signature not found at expected position. Retrieval may fail.\n";
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            size_t colon = line.find(':');
+            if (colon == string::npos || colon == 0)
+                continue;
+            string name = line.substr(0, colon);
+            if (exists(name) || !seen.emplace(name, true).second)
+                continue;
+            lines.emplace_back(name, line.substr(colon + 1));
         }
 
-        uint64_t nameLen = 0;
-        fin.read(reinterpret_cast<char *>(&nameLen), sizeof(nameLen));
-        if (!fin)
+        // Each credential costs one stretched key derivation; spread them over the cores.
+        vector<std::pair<string, UserStore::Credential>> added(lines.size());
+        std::atomic<size_t> next(0);
+        auto derive = [&]()
         {
-            cout << "Failed to read filename length; retrieval aborted.\n";
-            fin.close();
+            for (size_t k = next++; k < lines.size(); k = next++)
+                added[k] = {lines[k].first, newCredential(lines[k].second)};
+        };
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        vector<std::thread> workers;
+        for (unsigned w = 1; w < cores && w < lines.size(); ++w)
+            workers.emplace_back(derive);
+        derive();
+        for (std::thread &t : workers)
+            t.join();
+        return store.appendMany(added) ? static_cast<long long>(added.size()) : -1;
+    }
+
+    bool signup(const string &username, const string &password)
+    {
+        if (username.empty())
+        {
+            cout << "Username cannot be empty.\n";
+            return false;
+        }
+        if (exists(username))
+        {
+            cout << "User already exists!\n";
             return false;
         }
+        if (!store.append(username, newCredential(password)))
+        {
+            users[username] = customHash(password);
+            cout << "Could not save to " << storePath << "; the account lasts for this session only.\n";
+        }
+        cout << "Signup successful. Created user: " << username << "\n";
+        return true;
+    }
 
-        string hiddenFileName;
-        if (nameLen > 0)
+    // Silent credential check, for callers that report the result themselves.
+    bool verify(const string &username, const string &password)
+    {
+        auto it = users.find(username);
+        if (it != users.end())
+            return it->second == customHash(password);
+        UserStore::Credential stored;
+        if (!store.find(username, stored))
+            return false;
+        UserStore::Credential given = credentialFor(password, stored.salt);
+        return std::memcmp(given.verifier, stored.verifier, sizeof(given.verifier)) == 0;
+    }
+
+    bool login(const string &username, const string &password)
+    {
+        if (verify(username, password))
         {
-            hiddenFileName.resize(static_cast<size_t>(nameLen));
-            fin.read(&hiddenFileName[0], static_cast<std::streamsize>(nameLen));
-            if (!fin)
+            cout << "Login successful! Welcome, " << username << ".\n";
+            return true;
+        }
+        cout << "Invalid username or password!\n";
+        return false;
+    }
+
+    unsigned long long getKey(const string &password)
+    {
+        return customHash(password);
+    }
+
+    bool exists(const string &username)
+    {
+        UserStore::Credential ignored;
+        return users.count(username) > 0 || store.find(username, ignored);
+    }
+};
+
+using stealth::activeXorKernel;
+using stealth::availableXorKernels;
+using stealth::XorKernel;
+
+enum class CipherMode
+{
+    Xor,
+    ChaCha20
+};
+
+// Key material for the transforms: the legacy 64-bit XOR key or a per-file ChaCha20
+// key. Converts implicitly from the XOR key so existing callers are unchanged.
+struct CipherKey
+{
+    CipherKey(unsigned long long key) : xorKey(key), chacha(false), chachaKey() {}
+    CipherKey(const stealth::ChaCha20Key &key) : xorKey(0), chacha(true), chachaKey(key) {}
+
+    unsigned long long xorKey;
+    bool chacha;
+    stealth::ChaCha20Key chachaKey;
+};
+
+class BaseCrypto
+{
+public:
+    static const size_t kMinBlockSize = 64 * 1024;
+    static const size_t kMaxBlockSize = 64 * 1024 * 1024;
+    // Container chunk size, also the work unit of checkpointed encrypts.
+    static const uint64_t kChunkUnit = 1024 * 1024;
+
+    // Size of the buffers used by the streaming modes (default 4 MiB).
+    static void setBlockSize(size_t bytes)
+    {
+        if (bytes < kMinBlockSize)
+            bytes = kMinBlockSize;
+        if (bytes > kMaxBlockSize)
+            bytes = kMaxBlockSize;
+        blockSize = bytes & ~static_cast<size_t>(7);
+    }
+
+    static size_t getBlockSize()
+    {
+        return blockSize;
+    }
+
+    // Worker threads for range-parallel transforms; 0 means one per hardware thread.
+    static void setWorkerCount(unsigned count)
+    {
+        workerCount = count;
+    }
+
+    // Inputs smaller than this are always processed on the calling thread.
+    static void setParallelThreshold(uint64_t bytes)
+    {
+        parallelThreshold = bytes;
+    }
+
+    // Buffers kept in flight by the single-stream pipeline (memory = depth * block size).
+    static void setQueueDepth(unsigned depth)
+    {
+        queueDepth = depth < 2 ? 2 : depth;
+    }
+
+    // Prefer io_uring for the pipeline when the kernel offers it.
+    static void setUseIoUring(bool enabled)
+    {
+        useIoUring = enabled;
+    }
+
+    // Print per-stage timings and the achieved overlap after each pipelined transform.
+    static void setReportIoStats(bool enabled)
+    {
+        reportIoStats = enabled;
+    }
+
+    // Image and file modes rewrite the input itself instead of creating a copy.
+    static void setInPlace(bool enabled)
+    {
+        inPlace = enabled;
+    }
+
+    // Cipher used for new outputs. Decryption detects the cipher from the header.
+    static void setCipherMode(CipherMode mode)
+    {
+        cipherMode = mode;
+    }
+
+    static CipherMode getCipherMode()
+    {
+        return cipherMode;
+    }
+
+    // File modes write the chunked container (default) instead of raw ciphertext.
+    static void setContainerFormat(bool enabled)
+    {
+        containerFormat = enabled;
+    }
+
+    // LZ4-compress file, tree and single-file stego payloads before encrypting them.
+    static void setCompression(bool enabled)
+    {
+        compressOutput = enabled;
+    }
+
+    // Encrypts of inputs larger than this sync the output and record a checkpoint
+    // every `bytes` (rounded up to whole chunks); 0 turns checkpoints off.
+    static void setCheckpointInterval(uint64_t bytes)
+    {
+        checkpointInterval = (bytes + kChunkUnit - 1) / kChunkUnit * kChunkUnit;
+    }
+
+    // Continue interrupted file encrypts from their checkpoint instead of starting over.
+    static void setResume(bool enabled)
+    {
+        resumeRuns = enabled;
+    }
+
+    // encrypt-tree skips sources unchanged since the last run (per-root manifest).
+    static void setIncremental(bool enabled)
+    {
+        incrementalTrees = enabled;
+    }
+
+    static string checkpointPathFor(const string &outPath)
+    {
+        return outPath + ".slckpt";
+    }
+
+    // Derives the ChaCha20 master key; call wherever the XOR key is derived.
+    static void setPassphrase(const string &password)
+    {
+        chachaMaster = stealth::deriveChaChaKey(password);
+    }
+
+    static bool hasContainerMagic(const string &path)
+    {
+        char magic[8];
+        RawFile f;
+        return f.openRead(path) && f.readAt(magic, sizeof(magic), 0) == static_cast<long long>(sizeof(magic)) &&
+               std::memcmp(magic, "SLCNTR01", 8) == 0;
+    }
+
+    // True if the file starts with a ChaCha20 header.
+    static bool hasCipherHeader(const string &path)
+    {
+        CipherHeader header;
+        RawFile f;
+        return f.openRead(path) && f.readAt(&header, sizeof(header), 0) == static_cast<long long>(sizeof(header)) &&
+               std::memcmp(header.magic, "SLCHACHA", 8) == 0;
+    }
+
+    // Runs every available XOR kernel against the per-byte reference on random
+    // buffers, lengths and stream offsets. Returns false on the first mismatch.
+    static bool selfCheckKernels(int rounds = 200)
+    {
+        std::mt19937_64 rng(std::random_device{}());
+        vector<XorKernel> kernels = availableXorKernels();
+        bool ok = true;
+        for (const XorKernel &k : kernels)
+        {
+            bool kernelOk = true;
+            for (int r = 0; r < rounds && kernelOk; ++r)
             {
-                cout << "Failed to read hidden filename; aborting.\n";
-                fin.close();
-                return false;
+                unsigned long long key = rng();
+                uint64_t offset = rng() % 4096;
+                size_t len = static_cast<size_t>(rng() % 5000);
+                size_t misalign = static_cast<size_t>(rng() % 64);
+                vector<unsigned char> data(len + misalign);
+                for (unsigned char &b : data)
+                    b = static_cast<unsigned char>(rng());
+                vector<unsigned char> expected(data.begin() + misalign, data.end());
+                for (size_t i = 0; i < len; ++i)
+                    expected[i] = applyXor(expected[i], key, static_cast<size_t>(offset + i));
+                k.fn(data.data() + misalign, len, keyPatternAt(key, offset));
+                if (!std::equal(expected.begin(), expected.end(), data.begin() + misalign))
+                    kernelOk = false;
+            }
+            cout << "XOR kernel " << std::left << std::setw(8) << k.name << std::right
+                 << (kernelOk ? "ok" : "MISMATCH") << "\n";
+            ok = ok && kernelOk;
+        }
+        cout << "Active kernel: " << activeXorKernel().name << "\n";
+        return ok;
+    }
+
+    // Known-answer test of the block function, then every ChaCha20 kernel against the
+    // scalar one at random counters (including the 32-bit carry) and lengths.
+    static bool selfCheckChaCha(int rounds = 200)
+    {
+        static const unsigned char expected[16] = {0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+                                                   0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28};
+        unsigned char block[64];
+        stealth::chachaBlockBytes(stealth::ChaCha20Key(), 0, 0, block);
+        bool ok = std::memcmp(block, expected, sizeof(expected)) == 0;
+        cout << "ChaCha20 test vector " << (ok ? "ok" : "MISMATCH") << "\n";
+
+        std::mt19937_64 rng(std::random_device{}());
+        for (const stealth::ChaChaKernel &k : stealth::availableChaChaKernels())
+        {
+            bool kernelOk = true;
+            for (int r = 0; r < rounds && kernelOk; ++r)
+            {
+                stealth::ChaCha20Key key;
+                for (uint32_t &w : key.words)
+                    w = static_cast<uint32_t>(rng());
+                uint64_t nonce = rng();
+                uint64_t counter = (r % 4 == 0) ? 0xFFFFFFFFULL - rng() % 20 : rng() % 100000;
+                size_t blocks = static_cast<size_t>(rng() % 40);
+                vector<unsigned char> data(blocks * 64);
+                for (unsigned char &b : data)
+                    b = static_cast<unsigned char>(rng());
+                vector<unsigned char> reference = data;
+                stealth::chachaKernelScalar(key, nonce, counter, reference.data(), blocks);
+                k.fn(key, nonce, counter, data.data(), blocks);
+                kernelOk = data == reference;
             }
+            cout << "ChaCha kernel " << std::left << std::setw(10) << k.name << std::right
+                 << (kernelOk ? "ok" : "MISMATCH") << "\n";
+            ok = ok && kernelOk;
+        }
+        cout << "Active ChaCha kernel: " << stealth::activeChaChaKernel().name << "\n";
+        return ok;
+    }
+
+protected:
+    inline static size_t blockSize = 4 * 1024 * 1024;
+    inline static unsigned workerCount = 0;
+    inline static uint64_t parallelThreshold = 64ULL * 1024 * 1024;
+    inline static bool inPlace = false;
+    inline static unsigned queueDepth = 4;
+    inline static bool useIoUring = true;
+    inline static bool reportIoStats = false;
+    inline static CipherMode cipherMode = CipherMode::Xor;
+    inline static bool containerFormat = true;
+    inline static uint64_t checkpointInterval = 256ULL * 1024 * 1024;
+    inline static bool resumeRuns = false;
+    inline static bool incrementalTrees = false;
+    inline static bool compressOutput = false;
+    inline static stealth::ChaCha20Key chachaMaster = {}; // set by setPassphrase()
+
+    // Prefix of every ChaCha20 output (file, image, text, stego payload). The salt
+    // selects the per-file key; `check` detects a wrong password before any output.
+    struct CipherHeader
+    {
+        char magic[8]; // "SLCHACHA"
+        unsigned char salt[16];
+        uint64_t check;
+    };
+
+    enum class HeaderState
+    {
+        None,
+        Valid,
+        WrongPassword
+    };
+
+    // Starts a ChaCha20 output: a fresh random salt and the key it selects.
+    static CipherKey newCipherHeader(CipherHeader &header)
+    {
+        std::memcpy(header.magic, "SLCHACHA", 8);
+        std::random_device rd;
+        for (unsigned char &b : header.salt)
+            b = static_cast<unsigned char>(rd());
+        return CipherKey(stealth::chachaSubKey(chachaMaster, header.salt, header.check));
+    }
+
+    // Recognizes a header at the start of `data`; on Valid, `key` becomes the file key.
+    static HeaderState parseCipherHeader(const unsigned char *data, size_t len, CipherKey &key)
+    {
+        CipherHeader header;
+        if (len < sizeof(header))
+            return HeaderState::None;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, "SLCHACHA", 8) != 0)
+            return HeaderState::None;
+        uint64_t check = 0;
+        stealth::ChaCha20Key fileKey = stealth::chachaSubKey(chachaMaster, header.salt, check);
+        if (check != header.check)
+            return HeaderState::WrongPassword;
+        key = CipherKey(fileKey);
+        return HeaderState::Valid;
+    }
+
+    // Reads and parses the header at `offset` of `path` (if `len` leaves room for one).
+    // Silent; passwordFits() is the variant that reports a mismatch.
+    static HeaderState readCipherHeader(const string &path, uint64_t offset, uint64_t len, CipherKey &key)
+    {
+        unsigned char buf[sizeof(CipherHeader)];
+        RawFile f;
+        if (len < sizeof(buf) || !f.openRead(path) ||
+            f.readAt(buf, sizeof(buf), offset) != static_cast<long long>(sizeof(buf)))
+            return HeaderState::None;
+        return parseCipherHeader(buf, sizeof(buf), key);
+    }
+
+    // Busy time per pipeline stage. Stages overlap, so their sum divided by the wall
+    // time is how many stages were active on average (1.0 = fully sequential).
+    struct PipelineStats
+    {
+        const char *engine;
+        unsigned depth;
+        double readSec;
+        double transformSec;
+        double writeSec;
+        double wallSec;
+    };
+
+    static double secondsSince(std::chrono::steady_clock::time_point t0)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    static const size_t kInPlaceWindow = 64 * 1024 * 1024;
+    static const size_t kJournalPage = 4096;
+
+    // Sidecar written next to a file while it is transformed in place. Everything
+    // before `committed` is durably transformed; [committed, pendingEnd) is the window
+    // in flight, described by one fingerprint per kJournalPage of its original bytes.
+    // The fingerprints let a later run tell exactly how far each page got.
+    struct InPlaceJournal
+    {
+        char magic[8];
+        uint64_t fileSize;
+        uint64_t keyCheck;
+        uint64_t targetEnd;
+        uint64_t committed;
+        uint64_t pendingEnd;
+        uint64_t rollingBack; // 1 once a rollback pass has started over [0, targetEnd)
+        unsigned char salt[16]; // of the passwordCheck() in keyCheck
+    };
+
+    static unsigned char keyByteFromKey(unsigned long long key, size_t i)
+    {
+        return stealth::keyByteAt(key, i);
+    }
+
+    static unsigned char applyXor(unsigned char dataByte, unsigned long long key, size_t index)
+    {
+        unsigned char k = keyByteFromKey(key, index);
+        return static_cast<unsigned char>(dataByte ^ k);
+    }
+
+    // 8-byte key pattern as it lies in memory for a buffer whose first byte sits at
+    // key-stream position `offset`. Built bytewise so it is independent of endianness.
+    static uint64_t keyPatternAt(unsigned long long key, uint64_t offset)
+    {
+        return stealth::keyPatternAt(key, offset);
+    }
+
+    // Applies the key stream to `len` bytes in place; `offset` is the stream position
+    // of data[0]. The ChaCha20 nonce is fixed because every file has its own key.
+    static void xorBuffer(unsigned char *data, size_t len, const CipherKey &key, uint64_t offset)
+    {
+        if (!opTiming)
+            return applyCipher(data, len, key, offset);
+        auto t0 = std::chrono::steady_clock::now();
+        applyCipher(data, len, key, offset);
+        opCounters.transformNs += nanos_since(t0);
+    }
+
+    static void applyCipher(unsigned char *data, size_t len, const CipherKey &key, uint64_t offset)
+    {
+        if (key.chacha)
+            stealth::chacha20Transform(key.chachaKey, 0, data, len, offset);
+        else
+            stealth::xorTransform(data, len, key.xorKey, offset);
+    }
+
+    static unsigned resolvedWorkerCount()
+    {
+        unsigned n = workerCount ? workerCount : std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    static bool useParallel(uint64_t length)
+    {
+        return length >= parallelThreshold && resolvedWorkerCount() > 1 && length > blockSize;
+    }
+
+    // Transforms `length` bytes of src starting at inOffset into dst at outOffset.
+    // The cipher only depends on the key-stream position, so the range is cut into
+    // blockSize chunks that workers claim from a shared counter and process with
+    // positional reads and writes. `keyOffset` is the key-stream position of the first
+    // byte. Returns false if an I/O call fails.
+    static bool transformRangeParallel(RawFile &src, uint64_t inOffset, RawFile &dst, uint64_t outOffset,
+                                       uint64_t length, const CipherKey &key, uint64_t keyOffset,
+                                       const string &label)
+    {
+        if (!dst.resize(outOffset + length))
+            return false;
+
+        const uint64_t chunk = blockSize;
+        const uint64_t chunks = (length + chunk - 1) / chunk;
+        unsigned workers = static_cast<unsigned>(std::min<uint64_t>(resolvedWorkerCount(), chunks));
+        std::atomic<uint64_t> nextChunk(0);
+        std::atomic<bool> failed(false);
+        ProgressReporter::FileScope shown(progress, label, length);
+
+        auto worker = [&]()
+        {
+            vector<unsigned char> buffer(static_cast<size_t>(chunk));
+            while (!failed)
+            {
+                uint64_t c = nextChunk.fetch_add(1);
+                if (c >= chunks)
+                    break;
+                uint64_t pos = c * chunk;
+                size_t len = static_cast<size_t>(std::min<uint64_t>(chunk, length - pos));
+                size_t filled = 0;
+                while (filled < len)
+                {
+                    long long got = src.readAt(buffer.data() + filled, len - filled, inOffset + pos + filled);
+                    if (got <= 0)
+                        break;
+                    filled += static_cast<size_t>(got);
+                }
+                if (filled != len)
+                {
+                    failed = true;
+                    break;
+                }
+                ++opCounters.refills;
+                xorBuffer(buffer.data(), len, key, keyOffset + pos);
+                if (!dst.writeAt(buffer.data(), len, outOffset + pos))
+                {
+                    failed = true;
+                    break;
+                }
+                progress.add(len);
+            }
+        };
+
+        vector<std::thread> pool;
+        for (unsigned i = 1; i < workers; ++i)
+            pool.emplace_back(worker);
+        worker();
+        for (std::thread &t : pool)
+            t.join();
+        return !failed;
+    }
+
+    static string inPlaceJournalPath(const string &path)
+    {
+        return path + ".sljournal";
+    }
+
+    static uint64_t mixWord(uint64_t word, uint64_t pos)
+    {
+        uint64_t m = word ^ (pos * 0x9E3779B97F4A7C15ULL);
+        m ^= m >> 31;
+        m *= 0xBF58476D1CE4E5B9ULL;
+        m ^= m >> 29;
+        return m;
+    }
+
+    // HMAC-SHA-256 of `label`, `salt` and the XOR key under the ChaCha20 master key,
+    // which is derived from the password and never written anywhere.
+    static void passwordMac(const char *label, const unsigned char salt[16], unsigned long long key,
+                            unsigned char out[32])
+    {
+        vector<unsigned char> msg(label, label + std::strlen(label));
+        msg.insert(msg.end(), salt, salt + 16);
+        for (int i = 0; i < 8; ++i)
+            msg.push_back(static_cast<unsigned char>(key >> (8 * i)));
+        unsigned char macKey[32];
+        std::memcpy(macKey, chachaMaster.words, sizeof(macKey));
+        stealth::hmacSha256(macKey, msg.data(), msg.size(), out);
+    }
+
+    // Lets a stored header reject the wrong password without revealing the key: a
+    // truncated passwordMac().
+    static uint64_t passwordCheck(const char *label, const unsigned char salt[16], unsigned long long key)
+    {
+        unsigned char mac[32];
+        passwordMac(label, salt, key, mac);
+        uint64_t check;
+        std::memcpy(&check, mac, sizeof(check));
+        return check;
+    }
+
+    static void randomSalt(unsigned char salt[16])
+    {
+        std::random_device rd;
+        for (int i = 0; i < 16; ++i)
+            salt[i] = static_cast<unsigned char>(rd());
+    }
+
+    static uint64_t loadWord(const unsigned char *p, size_t len)
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, p, std::min<size_t>(len, 8));
+        return word;
+    }
+
+    // Position-dependent sum over 8-byte words, so the fingerprint of a page whose
+    // first t bytes are transformed can be evaluated for every t in one pass.
+    static uint64_t pageFingerprint(const unsigned char *p, size_t len, uint64_t pos)
+    {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < len; i += 8)
+            sum += mixWord(loadWord(p + i, len - i), pos + i);
+        return sum;
+    }
+
+    // Finds the transformed prefix length of an interrupted page (the kernels write
+    // whole aligned words, so the prefix ends on a word boundary) and then either
+    // finishes the page or restores it. Returns false if no prefix matches.
+    static bool settlePage(unsigned char *p, size_t len, uint64_t pos, uint64_t fingerprint,
+                           unsigned long long key, bool rollback)
+    {
+        size_t words = (len + 7) / 8;
+        vector<uint64_t> suffix(words + 1, 0);
+        for (size_t j = words; j-- > 0;)
+            suffix[j] = suffix[j + 1] + mixWord(loadWord(p + j * 8, len - j * 8), pos + j * 8);
+
+        uint64_t prefix = 0;
+        for (size_t j = 0; j <= words; ++j)
+        {
+            if (prefix + suffix[j] == fingerprint)
+            {
+                size_t t = std::min(j * 8, len);
+                if (rollback)
+                    xorBuffer(p, t, key, pos);
+                else
+                    xorBuffer(p + t, len - t, key, pos + t);
+                return true;
+            }
+            if (j == words)
+                break;
+            unsigned char flipped[8] = {0};
+            size_t n = std::min<size_t>(8, len - j * 8);
+            std::memcpy(flipped, p + j * 8, n);
+            stealth::xorTransform(flipped, n, key, pos + j * 8);
+            prefix += mixWord(loadWord(flipped, n), pos + j * 8);
+        }
+        return false;
+    }
+
+    static bool writeJournal(RawFile &journal, const InPlaceJournal &j, const vector<uint64_t> &fingerprints)
+    {
+        if (!journal.writeAt(&j, sizeof(j), 0))
+            return false;
+        if (!fingerprints.empty() &&
+            !journal.writeAt(fingerprints.data(), fingerprints.size() * sizeof(uint64_t), sizeof(j)))
+            return false;
+        return journal.sync();
+    }
+
+    // Brings the in-flight window of an interrupted run to a known state: fully
+    // transformed when resuming, untouched when rolling back. A window of a
+    // rollback pass is always finished, since that pass is what undoes the file.
+    static bool settlePendingWindow(RawFile &file, RawFile &journal, InPlaceJournal &j,
+                                    unsigned long long key, bool rollback)
+    {
+        if (j.pendingEnd <= j.committed)
+            return true;
+        const bool undo = rollback && !j.rollingBack;
+        size_t len = static_cast<size_t>(j.pendingEnd - j.committed);
+        vector<uint64_t> fingerprints((len + kJournalPage - 1) / kJournalPage);
+        long long want = static_cast<long long>(fingerprints.size() * sizeof(uint64_t));
+        if (journal.readAt(fingerprints.data(), static_cast<size_t>(want), sizeof(j)) != want)
+            return false;
+
+        unsigned char *view = file.mapRange(j.committed, len);
+        if (!view)
+            return false;
+        bool ok = true;
+        for (size_t page = 0; page < fingerprints.size() && ok; ++page)
+        {
+            size_t at = page * kJournalPage;
+            ok = settlePage(view + at, std::min(kJournalPage, len - at), j.committed + at,
+                            fingerprints[page], key, undo);
+        }
+        ok = ok && file.flushRange(view, len);
+        file.unmapRange(view, len);
+        if (!ok)
+            return false;
+
+        if (!undo)
+            j.committed = j.pendingEnd;
+        j.pendingEnd = j.committed;
+        return writeJournal(journal, j, vector<uint64_t>());
+    }
+
+    // Transforms a file where it lies, one mapped window at a time. Before a window is
+    // touched the journal records its bounds and page fingerprints; after it is flushed
+    // the journal's committed offset moves past it. With `rollback` an interrupted run
+    // is undone instead of finished; an interrupted rollback is always finished, and
+    // `rollback` is then set. The journal is removed on success.
+    static bool transformInPlace(const string &path, unsigned long long key, bool &rollback)
+    {
+        const string journalPath = inPlaceJournalPath(path);
+        const uint64_t fileSize = filesize_bytes(path);
+        RawFile file;
+        RawFile journal;
+        if (!file.openWrite(path, false))
+        {
+            cout << "Failed to open file for in-place transform.\n";
+            return false;
+        }
+
+        InPlaceJournal j = {};
+        if (fs::exists(journalPath))
+        {
+            if (!journal.openWrite(journalPath, false) ||
+                journal.readAt(&j, sizeof(j), 0) != static_cast<long long>(sizeof(j)) ||
+                std::memcmp(j.magic, "SLJRNL01", 8) != 0)
+            {
+                cout << "In-place journal is unreadable: " << journalPath << "\n";
+                return false;
+            }
+            if (j.fileSize != fileSize || j.keyCheck != passwordCheck("SLJRNL", j.salt, key))
+            {
+                cout << "In-place journal does not match this file or password.\n";
+                return false;
+            }
+            if (j.rollingBack && !rollback)
+                cout << "The interrupted run was a rollback; finishing it.\n";
+            if (!settlePendingWindow(file, journal, j, key, rollback))
+            {
+                cout << "Could not reconcile the interrupted window; the journal was kept.\n";
+                return false;
+            }
+            if (rollback && !j.rollingBack)
+            {
+                j.targetEnd = j.committed;
+                j.committed = 0;
+                j.pendingEnd = 0;
+                j.rollingBack = 1;
+            }
+            rollback = j.rollingBack != 0;
+        }
+        else
+        {
+            if (!journal.openWrite(journalPath, true))
+            {
+                cout << "Failed to create in-place journal: " << journalPath << "\n";
+                return false;
+            }
+            std::memcpy(j.magic, "SLJRNL01", 8);
+            j.fileSize = fileSize;
+            randomSalt(j.salt);
+            j.keyCheck = passwordCheck("SLJRNL", j.salt, key);
+            j.targetEnd = fileSize;
+        }
+        if (!writeJournal(journal, j, vector<uint64_t>()))
+            return false;
+
+        vector<uint64_t> fingerprints;
+        ProgressReporter::FileScope shown(progress, basename_of(path), j.targetEnd, j.committed);
+        while (j.committed < j.targetEnd)
+        {
+            size_t len = static_cast<size_t>(std::min<uint64_t>(kInPlaceWindow, j.targetEnd - j.committed));
+            unsigned char *view = file.mapRange(j.committed, len);
+            if (!view)
+            {
+                cout << "Failed to map file window at offset " << j.committed << ".\n";
+                return false;
+            }
+
+            fingerprints.assign((len + kJournalPage - 1) / kJournalPage, 0);
+            for (size_t page = 0; page < fingerprints.size(); ++page)
+            {
+                size_t at = page * kJournalPage;
+                fingerprints[page] = pageFingerprint(view + at, std::min(kJournalPage, len - at), j.committed + at);
+            }
+            j.pendingEnd = j.committed + len;
+            bool ok = writeJournal(journal, j, fingerprints);
+
+            if (ok)
+            {
+                ++opCounters.refills;
+                xorBuffer(view, len, key, j.committed);
+                ok = file.flushRange(view, len);
+            }
+            file.unmapRange(view, len);
+            if (!ok)
+            {
+                cout << "I/O error during in-place transform; rerun to resume.\n";
+                return false;
+            }
+
+            j.committed = j.pendingEnd;
+            if (!writeJournal(journal, j, vector<uint64_t>()))
+                return false;
+            progress.add(len);
+        }
+
+        journal.close();
+        file.close();
+        std::error_code ec;
+        fs::remove(journalPath, ec);
+        return true;
+    }
+
+    // Entry point for the image and file modes when in-place mode is on.
+    static bool runInPlace(const string &path, unsigned long long key, const string &doneMessage)
+    {
+        if (cipherMode != CipherMode::Xor || hasCipherHeader(path) || hasContainerMagic(path))
+        {
+            cout << "In-place mode only supports raw XOR files (ChaCha20 and container files carry a header).\n";
+            return false;
+        }
+        bool rollback = fs::exists(inPlaceJournalPath(path)) && ask_rollback_in_place(path);
+        if (!transformInPlace(path, key, rollback))
+            return false;
+        cout << "\n" << (rollback ? string("Rolled back in place: ") : doneMessage) << path << "\n";
+        return true;
+    }
+
+    // Runs `work(firstChunk, count, buffer)` over groups of up to blockSize bytes of
+    // chunks in [begin, end), on all workers when `parallel`. The buffer holds
+    // `buffers` groups. Workers stop claiming groups after a failure; `failedChunk`
+    // gets the first chunk of the lowest failed group.
+    static bool forEachChunkGroup(uint64_t begin, uint64_t end, uint64_t chunkSize, bool parallel, unsigned buffers,
+                                  uint64_t &failedChunk,
+                                  const std::function<bool(uint64_t, uint64_t, vector<unsigned char> &)> &work)
+    {
+        const uint64_t perGroup = std::max<uint64_t>(1, blockSize / chunkSize);
+        const uint64_t groups = (end - begin + perGroup - 1) / perGroup;
+        std::atomic<uint64_t> next(0);
+        std::atomic<bool> failed(false);
+        std::mutex failMutex;
+        failedChunk = UINT64_MAX;
+        auto worker = [&]()
+        {
+            vector<unsigned char> buf(static_cast<size_t>(perGroup * chunkSize * buffers));
+            while (!failed)
+            {
+                uint64_t g = next.fetch_add(1);
+                if (g >= groups)
+                    break;
+                uint64_t first = begin + g * perGroup;
+                if (!work(first, std::min(perGroup, end - first), buf))
+                {
+                    std::lock_guard<std::mutex> lock(failMutex);
+                    failedChunk = std::min(failedChunk, first);
+                    failed = true;
+                }
+            }
+        };
+        unsigned workers = parallel ? static_cast<unsigned>(std::min<uint64_t>(resolvedWorkerCount(), groups)) : 1;
+        vector<std::thread> pool;
+        for (unsigned i = 1; i < workers; ++i)
+            pool.emplace_back(worker);
+        worker();
+        for (std::thread &t : pool)
+            t.join();
+        return !failed;
+    }
+
+    // Sidecar of a checkpointed encrypt (<output>.slckpt). Plaintext [0, committed)
+    // is durably in the output as its first `storedEnd` bytes after the `prefix`
+    // (container or ChaCha20 header, which a resumed run reuses so the key stream
+    // stays the same). `committed` is also the key-stream position to continue at.
+    // A container's chunk CRCs follow the struct, then, if compressed, the stored
+    // chunk lengths (room for every chunk of the input is reserved for the CRCs).
+    struct EncryptCheckpoint
+    {
+        char magic[8]; // "SLCKPT01"
+        uint64_t inputSize;
+        int64_t inputMtime;
+        uint64_t inputId;
+        uint64_t keyCheck;
+        uint64_t committed;
+        uint64_t storedEnd;
+        uint32_t container;
+        uint32_t cipher; // 0 = XOR, 1 = ChaCha20
+        uint32_t compressed;
+        uint32_t prefixLen;
+        unsigned char prefix[64];
+        unsigned char salt[16]; // of the passwordCheck() in keyCheck
+    };
+
+    static const uint64_t kResumeCheckBytes = 8 * 1024 * 1024;
+
+    static bool wantsCheckpoints(uint64_t size)
+    {
+        return checkpointInterval > 0 && size > checkpointInterval;
+    }
+
+    static void newCheckpoint(const string &inPath, unsigned long long key, bool container, bool compressed,
+                              const void *prefix, size_t prefixLen, EncryptCheckpoint &cp)
+    {
+        cp = {};
+        std::memcpy(cp.magic, "SLCKPT01", 8);
+        RawFile src;
+        if (src.openRead(inPath))
+            src.identity(cp.inputSize, cp.inputMtime, cp.inputId);
+        randomSalt(cp.salt);
+        cp.keyCheck = passwordCheck("SLCKPT", cp.salt, key);
+        cp.container = container ? 1 : 0;
+        cp.cipher = cipherMode == CipherMode::ChaCha20 ? 1 : 0;
+        cp.compressed = compressed ? 1 : 0;
+        cp.prefixLen = static_cast<uint32_t>(prefixLen);
+        std::memcpy(cp.prefix, prefix, prefixLen);
+    }
+
+    // With --resume, reads the checkpoint of `outPath` and checks that it belongs to
+    // this input (size, mtime, inode), password, format, cipher and compression, and
+    // that the output still starts with the recorded prefix and is long enough.
+    // Prints why a checkpoint cannot be used; the caller then starts over.
+    static bool loadCheckpoint(const string &inPath, const string &outPath, unsigned long long key, bool container,
+                               EncryptCheckpoint &cp, vector<uint32_t> *crcs, vector<uint32_t> *lengths)
+    {
+        const string path = checkpointPathFor(outPath);
+        if (!resumeRuns || !fs::exists(path))
+            return false;
+        RawFile ck;
+        RawFile src;
+        RawFile dst;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        uint64_t id = 0;
+        unsigned char prefix[sizeof(cp.prefix)];
+        const char *problem = nullptr;
+        if (!ck.openRead(path) || !readFully(ck, reinterpret_cast<unsigned char *>(&cp), sizeof(cp), 0) ||
+            std::memcmp(cp.magic, "SLCKPT01", 8) != 0 || cp.prefixLen > sizeof(cp.prefix) ||
+            cp.committed > cp.inputSize || cp.committed % kChunkUnit != 0)
+            problem = "the checkpoint is unreadable";
+        else if (!src.openRead(inPath) || !src.identity(size, mtime, id) || size != cp.inputSize ||
+                 mtime != cp.inputMtime || id != cp.inputId)
+            problem = "the input changed since it was written";
+        else if (cp.keyCheck != passwordCheck("SLCKPT", cp.salt, key))
+            problem = "it was written with another password";
+        else if ((cp.container != 0) != container || (cp.cipher != 0) != (cipherMode == CipherMode::ChaCha20) ||
+                 (cp.compressed != 0) != (lengths != nullptr))
+            problem = "it was written with another --format, --cipher or --compress";
+        else if (!dst.openRead(outPath) || filesize_bytes(outPath) < cp.prefixLen + cp.storedEnd ||
+                 !readFully(dst, prefix, cp.prefixLen, 0) || std::memcmp(prefix, cp.prefix, cp.prefixLen) != 0)
+            problem = "the output no longer matches it";
+        if (!problem && crcs)
+        {
+            const size_t done = static_cast<size_t>(cp.committed / kChunkUnit);
+            const uint64_t lengthsAt = sizeof(cp) + crcs->size() * sizeof(uint32_t);
+            uint64_t stored = 0;
+            if (!readFully(ck, reinterpret_cast<unsigned char *>(crcs->data()), done * sizeof(uint32_t), sizeof(cp)) ||
+                (lengths && !readFully(ck, reinterpret_cast<unsigned char *>(lengths->data()),
+                                       done * sizeof(uint32_t), lengthsAt)))
+                problem = "the checkpoint is unreadable";
+            for (size_t i = 0; !problem && lengths && i < done; ++i)
+                stored += (*lengths)[i];
+            if (!problem && lengths && stored != cp.storedEnd)
+                problem = "the checkpoint is unreadable";
+        }
+        if (problem)
+            cout << "Cannot resume " << outPath << ": " << problem << "; starting over.\n";
+        return problem == nullptr;
+    }
+
+    // Turns plaintext chunk `index` (`len` bytes at `p`) into its stored form in
+    // place: LZ4-compressed when `compress` is set and that makes it smaller, then
+    // encrypted at key-stream position index * kChunkUnit (compressed data never
+    // reaches past its chunk's slot, so no key-stream byte is used twice). `scratch`
+    // needs kChunkUnit bytes. Returns the stored length.
+    static size_t sealChunk(unsigned char *p, size_t len, uint64_t index, const CipherKey &cipher, bool compress,
+                            unsigned char *scratch)
+    {
+        size_t stored = len;
+        if (compress && len > 0)
+        {
+            auto t0 = op_clock();
+            size_t packed = stealth::lzCompress(p, len, scratch, len - 1);
+            if (packed > 0)
+            {
+                std::memcpy(p, scratch, packed);
+                stored = packed;
+            }
+            add_op_time(opCounters.transformNs, t0);
+        }
+        xorBuffer(p, stored, cipher, index * kChunkUnit);
+        return stored;
+    }
+
+    // Stored-form check of the last committed chunks (up to kResumeCheckBytes): each
+    // is sealed again from the input and compared, with its CRC if given, against
+    // the output, so a resumed run only builds on data that really reached the disk.
+    static bool checkpointTailMatches(const string &inPath, const string &outPath, const EncryptCheckpoint &cp,
+                                      const CipherKey &cipher, const vector<uint32_t> *crcs,
+                                      const vector<uint32_t> *lengths)
+    {
+        const uint64_t last = cp.committed / kChunkUnit;
+        const uint64_t first = (cp.committed - std::min(cp.committed, kResumeCheckBytes)) / kChunkUnit;
+        uint64_t at = cp.prefixLen + first * kChunkUnit;
+        if (lengths)
+        {
+            at = cp.prefixLen + cp.storedEnd;
+            for (uint64_t i = first; i < last; ++i)
+                at -= (*lengths)[static_cast<size_t>(i)];
+        }
+        vector<unsigned char> expected(static_cast<size_t>(kChunkUnit));
+        vector<unsigned char> actual(static_cast<size_t>(kChunkUnit));
+        vector<unsigned char> scratch(static_cast<size_t>(kChunkUnit));
+        RawFile src;
+        RawFile dst;
+        bool ok = src.openRead(inPath) && dst.openRead(outPath);
+        for (uint64_t i = first; ok && i < last; ++i)
+        {
+            size_t stored = lengths ? (*lengths)[static_cast<size_t>(i)] : static_cast<size_t>(kChunkUnit);
+            ok = stored <= kChunkUnit && readFully(src, expected.data(), kChunkUnit, i * kChunkUnit) &&
+                 readFully(dst, actual.data(), stored, at) &&
+                 sealChunk(expected.data(), kChunkUnit, i, cipher, lengths != nullptr, scratch.data()) == stored &&
+                 std::memcmp(expected.data(), actual.data(), stored) == 0 &&
+                 (!crcs || stealth::crc32c(actual.data(), stored) == (*crcs)[static_cast<size_t>(i)]);
+            at += stored;
+        }
+        if (!ok)
+            cout << "Cannot resume " << outPath << ": the output no longer matches the checkpoint; starting over.\n";
+        return ok;
+    }
+
+    // Encrypts plaintext [cp.committed, cp.inputSize) of src into dst after the
+    // prefix, in kChunkUnit pieces, spread over the workers if `parallel`. With `crcs`, each
+    // chunk's CRC-32C is stored at its index, and with `plainCrcs` that of its
+    // plaintext. With `lengths`, chunks are compressed
+    // and appended back to back in order, and their stored sizes recorded; otherwise
+    // chunk i sits at a fixed offset. With `checkpoints`, after every
+    // checkpointInterval the output is synced and then the checkpoint advanced, so
+    // an interrupted run loses at most one interval. The caller removes the
+    // checkpoint once the output is complete.
+    static bool encryptCheckpointed(RawFile &src, RawFile &dst, const string &outPath, EncryptCheckpoint &cp,
+                                    const CipherKey &cipher, vector<uint32_t> *crcs, vector<uint32_t> *lengths,
+                                    vector<uint32_t> *plainCrcs, bool parallel, bool checkpoints)
+    {
+        const uint64_t size = cp.inputSize;
+        const string path = checkpointPathFor(outPath);
+        RawFile ck;
+        if (cp.committed == 0)
+        {
+            std::error_code ec;
+            fs::remove(path, ec);
+        }
+        if (checkpoints && !ck.openWrite(path, false))
+            return false;
+        uint64_t saved = cp.committed / kChunkUnit; // chunks already recorded in the checkpoint
+        const uint64_t step = checkpoints ? checkpointInterval : size;
+        const uint64_t lengthsAt = sizeof(cp) + (crcs ? crcs->size() * sizeof(uint32_t) : 0);
+        if (!lengths)
+            cp.storedEnd = cp.committed;
+
+        // Compressed groups finish out of order; each waits for its turn to append.
+        std::mutex turnMutex;
+        std::condition_variable turnChanged;
+        uint64_t turn = 0;
+        bool aborted = false;
+        while (cp.committed < size)
+        {
+            const uint64_t end = std::min(size, cp.committed + step);
+            uint64_t failedChunk = 0;
+            turn = cp.committed / kChunkUnit;
+            bool ok = forEachChunkGroup(cp.committed / kChunkUnit, (end + kChunkUnit - 1) / kChunkUnit, kChunkUnit,
+                                        parallel && useParallel(size), lengths ? 2 : 1, failedChunk,
+                                        [&](uint64_t first, uint64_t count, vector<unsigned char> &buf)
+                                        {
+                uint64_t pos = first * kChunkUnit;
+                size_t len = static_cast<size_t>(std::min(count * kChunkUnit, size - pos));
+                if (!readFully(src, buf.data(), len, pos))
+                {
+                    std::lock_guard<std::mutex> lock(turnMutex);
+                    aborted = true;
+                    turnChanged.notify_all();
+                    return false;
+                }
+                for (uint64_t c = 0; plainCrcs && c < count; ++c)
+                {
+                    size_t at = static_cast<size_t>(c * kChunkUnit);
+                    (*plainCrcs)[static_cast<size_t>(first + c)] =
+                        stealth::crc32c(buf.data() + at, std::min<size_t>(kChunkUnit, len - at));
+                }
+                if (!lengths)
+                {
+                    xorBuffer(buf.data(), len, cipher, pos);
+                    if (crcs)
+                    {
+                        auto t0 = op_clock();
+                        for (uint64_t c = 0; c < count; ++c)
+                        {
+                            size_t at = static_cast<size_t>(c * kChunkUnit);
+                            (*crcs)[static_cast<size_t>(first + c)] =
+                                stealth::crc32c(buf.data() + at, std::min<size_t>(kChunkUnit, len - at));
+                        }
+                        add_op_time(opCounters.transformNs, t0);
+                    }
+                    progress.add(len);
+                    return dst.writeAt(buf.data(), len, cp.prefixLen + pos);
+                }
+
+                // Seal each chunk in place, then pack them to the front of the buffer.
+                unsigned char *scratch = buf.data() + buf.size() / 2;
+                size_t packed = 0;
+                for (uint64_t c = 0; c < count; ++c)
+                {
+                    size_t at = static_cast<size_t>(c * kChunkUnit);
+                    size_t stored = sealChunk(buf.data() + at, std::min<size_t>(kChunkUnit, len - at), first + c,
+                                              cipher, true, scratch);
+                    std::memmove(buf.data() + packed, buf.data() + at, stored);
+                    if (crcs)
+                        (*crcs)[static_cast<size_t>(first + c)] = stealth::crc32c(buf.data() + packed, stored);
+                    (*lengths)[static_cast<size_t>(first + c)] = static_cast<uint32_t>(stored);
+                    packed += stored;
+                }
+                std::unique_lock<std::mutex> lock(turnMutex);
+                turnChanged.wait(lock, [&]()
+                                 { return turn == first || aborted; });
+                bool good = !aborted && dst.writeAt(buf.data(), packed, cp.prefixLen + cp.storedEnd);
+                cp.storedEnd += packed;
+                aborted = aborted || !good;
+                turn = first + count;
+                lock.unlock();
+                turnChanged.notify_all();
+                progress.add(len);
+                return good; });
+            if (!ok)
+                return false;
+            cp.committed = end;
+            if (!lengths)
+                cp.storedEnd = end;
+            if (checkpoints && end < size)
+            {
+                const uint64_t now = end / kChunkUnit;
+                const size_t bytes = static_cast<size_t>(now - saved) * sizeof(uint32_t);
+                if (!dst.sync() ||
+                    (crcs && !ck.writeAt(crcs->data() + saved, bytes, sizeof(cp) + saved * sizeof(uint32_t))) ||
+                    (lengths && !ck.writeAt(lengths->data() + saved, bytes, lengthsAt + saved * sizeof(uint32_t))) ||
+                    !ck.writeAt(&cp, sizeof(cp), 0) || !ck.sync())
+                    return false;
+                saved = now;
+            }
+        }
+        return true;
+    }
+
+    static void removeCheckpoint(const string &outPath)
+    {
+        std::error_code ec;
+        fs::remove(checkpointPathFor(outPath), ec);
+    }
+
+    // Reads every block fully, retrying short reads. Returns false on error or early EOF.
+    static bool readFully(RawFile &src, unsigned char *buf, size_t len, uint64_t offset)
+    {
+        ++opCounters.refills;
+        size_t filled = 0;
+        while (filled < len)
+        {
+            long long got = src.readAt(buf + filled, len - filled, offset + filled);
+            if (got <= 0)
+                return false;
+            filled += static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    // Three-stage pipeline over a fixed set of slots: a reader thread fills slot k+1
+    // while the calling thread transforms slot k and a writer thread drains slot k-1.
+    static bool pipelineWithThreads(RawFile &src, uint64_t inOffset, RawFile &dst, uint64_t outOffset,
+                                    uint64_t length, const CipherKey &key, uint64_t keyOffset,
+                                    vector<vector<unsigned char>> &slots, PipelineStats &stats)
+    {
+        const uint64_t chunk = slots[0].size();
+        vector<uint64_t> slotPos(slots.size());
+        vector<size_t> slotLen(slots.size());
+        SlotQueue freeSlots;
+        SlotQueue filled;
+        SlotQueue transformed;
+        std::atomic<bool> failed(false);
+        for (size_t i = 0; i < slots.size(); ++i)
+            freeSlots.push(static_cast<int>(i));
+
+        std::thread reader([&]()
+                           {
+            for (uint64_t pos = 0; pos < length && !failed; pos += chunk)
+            {
+                int slot = freeSlots.pop();
+                slotPos[slot] = pos;
+                slotLen[slot] = static_cast<size_t>(std::min<uint64_t>(chunk, length - pos));
+                auto t0 = std::chrono::steady_clock::now();
+                if (!readFully(src, slots[slot].data(), slotLen[slot], inOffset + pos))
+                    failed = true;
+                stats.readSec += secondsSince(t0);
+                filled.push(failed ? -1 : slot);
+                if (failed)
+                    return;
+            }
+            filled.push(-1); });
+
+        std::thread writer([&]()
+                           {
+            for (int slot = transformed.pop(); slot >= 0; slot = transformed.pop())
+            {
+                if (!failed)
+                {
+                    auto t0 = std::chrono::steady_clock::now();
+                    if (!dst.writeAt(slots[slot].data(), slotLen[slot], outOffset + slotPos[slot]))
+                        failed = true;
+                    stats.writeSec += secondsSince(t0);
+                    progress.add(slotLen[slot]);
+                }
+                freeSlots.push(slot);
+            } });
+
+        for (int slot = filled.pop(); slot >= 0; slot = filled.pop())
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            xorBuffer(slots[slot].data(), slotLen[slot], key, keyOffset + slotPos[slot]);
+            stats.transformSec += secondsSince(t0);
+            transformed.push(slot);
+        }
+        transformed.push(-1);
+        reader.join();
+        writer.join();
+        return !failed;
+    }
+
+#ifdef STEALTH_HAVE_IO_URING
+    // Same pipeline driven by io_uring from the calling thread: every slot is always
+    // either being read, transformed or written, and the kernel services the reads
+    // and writes of the other slots while one is being transformed.
+    static bool pipelineWithIoUring(IoRing &ring, RawFile &src, uint64_t inOffset, RawFile &dst,
+                                    uint64_t outOffset, uint64_t length, const CipherKey &key,
+                                    uint64_t keyOffset, vector<vector<unsigned char>> &slots,
+                                    PipelineStats &stats)
+    {
+        const uint64_t chunk = slots[0].size();
+        const size_t n = slots.size();
+        vector<uint64_t> slotPos(n);
+        vector<size_t> slotLen(n);
+        vector<size_t> slotDone(n);
+        vector<bool> slotWriting(n);
+        vector<iovec> iov(n);
+        uint64_t nextPos = 0;
+        size_t inFlight = 0;
+        unsigned readsOut = 0;
+        unsigned writesOut = 0;
+        auto readSince = std::chrono::steady_clock::now();
+        auto writeSince = readSince;
+
+        auto submit = [&](size_t slot)
+        {
+            iov[slot].iov_base = slots[slot].data() + slotDone[slot];
+            iov[slot].iov_len = slotLen[slot] - slotDone[slot];
+            uint64_t at = slotPos[slot] + slotDone[slot];
+            if (slotWriting[slot])
+            {
+                if (writesOut++ == 0)
+                    writeSince = std::chrono::steady_clock::now();
+                ring.queue(IORING_OP_WRITEV, dst.handle(), &iov[slot], outOffset + at, slot);
+            }
+            else
+            {
+                if (readsOut++ == 0)
+                    readSince = std::chrono::steady_clock::now();
+                ring.queue(IORING_OP_READV, src.handle(), &iov[slot], inOffset + at, slot);
+            }
+        };
+        auto startRead = [&](size_t slot)
+        {
+            slotPos[slot] = nextPos;
+            slotLen[slot] = static_cast<size_t>(std::min<uint64_t>(chunk, length - nextPos));
+            slotDone[slot] = 0;
+            slotWriting[slot] = false;
+            nextPos += slotLen[slot];
+            ++inFlight;
+            submit(slot);
+        };
+
+        // The kernel writes into the slots until an operation completes, so a failed
+        // run reaps every operation still outstanding before the slots go away.
+        auto drain = [&]()
+        {
+            uint64_t userData;
+            int res;
+            while (readsOut + writesOut > 0 && ring.submitAndWait())
+            {
+                while (ring.pop(userData, res))
+                    --(slotWriting[static_cast<size_t>(userData)] ? writesOut : readsOut);
+            }
+            return false;
+        };
+
+        for (size_t slot = 0; slot < n && nextPos < length; ++slot)
+            startRead(slot);
+
+        while (inFlight > 0)
+        {
+            if (!ring.submitAndWait())
+                return drain();
+            uint64_t userData;
+            int res;
+            while (ring.pop(userData, res))
+            {
+                size_t slot = static_cast<size_t>(userData);
+                if (slotWriting[slot])
+                {
+                    if (--writesOut == 0)
+                        stats.writeSec += secondsSince(writeSince);
+                }
+                else if (--readsOut == 0)
+                {
+                    stats.readSec += secondsSince(readSince);
+                }
+                if (res <= 0)
+                    return drain();
+                ++(slotWriting[slot] ? opCounters.writes : opCounters.reads);
+                (slotWriting[slot] ? opCounters.bytesWritten : opCounters.bytesRead) += static_cast<uint64_t>(res);
+                slotDone[slot] += static_cast<size_t>(res);
+                if (slotDone[slot] < slotLen[slot])
+                {
+                    submit(slot);
+                    continue;
+                }
+                if (!slotWriting[slot])
+                {
+                    ++opCounters.refills;
+                    auto t0 = std::chrono::steady_clock::now();
+                    xorBuffer(slots[slot].data(), slotLen[slot], key, keyOffset + slotPos[slot]);
+                    stats.transformSec += secondsSince(t0);
+                    slotWriting[slot] = true;
+                    slotDone[slot] = 0;
+                    submit(slot);
+                    continue;
+                }
+                progress.add(slotLen[slot]);
+                --inFlight;
+                if (nextPos < length)
+                    startRead(slot);
+            }
+        }
+        return true;
+    }
+#endif
+
+    // Single-stream transform of a byte range with reads, XOR and writes overlapped.
+    // Memory is bounded by queueDepth buffers of at most blockSize bytes.
+    static bool transformRangePipelined(RawFile &src, uint64_t inOffset, RawFile &dst, uint64_t outOffset,
+                                        uint64_t length, const CipherKey &key, uint64_t keyOffset,
+                                        const string &label)
+    {
+        if (length == 0)
+            return true;
+        if (!dst.resize(outOffset + length))
+            return false;
+
+        const uint64_t chunk = std::min<uint64_t>(blockSize, (length + 7) & ~7ULL);
+        const uint64_t chunks = (length + chunk - 1) / chunk;
+        vector<vector<unsigned char>> slots(static_cast<size_t>(std::min<uint64_t>(queueDepth, chunks)),
+                                            vector<unsigned char>(static_cast<size_t>(chunk)));
+        PipelineStats stats = {"threads", static_cast<unsigned>(slots.size()), 0, 0, 0, 0};
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok;
+        progress.beginFile(label, length);
+#ifdef STEALTH_HAVE_IO_URING
+        IoRing ring;
+        if (useIoUring && ring.init(static_cast<unsigned>(slots.size())))
+        {
+            stats.engine = "io_uring";
+            ok = pipelineWithIoUring(ring, src, inOffset, dst, outOffset, length, key, keyOffset, slots, stats);
+            opCounters.readNs += static_cast<uint64_t>(stats.readSec * 1e9);
+            opCounters.writeNs += static_cast<uint64_t>(stats.writeSec * 1e9);
+        }
+        else
+#endif
+        {
+            ok = pipelineWithThreads(src, inOffset, dst, outOffset, length, key, keyOffset, slots, stats);
+        }
+        stats.wallSec = secondsSince(t0);
+        progress.endFile();
+
+        if (ok && reportIoStats && stats.wallSec > 0)
+        {
+            double overlap = (stats.readSec + stats.transformSec + stats.writeSec) / stats.wallSec;
+            cout << std::fixed << std::setprecision(3)
+                 << "Pipeline [" << stats.engine << ", depth " << stats.depth << "]: read " << stats.readSec
+                 << " s, transform " << stats.transformSec << " s, write " << stats.writeSec
+                 << " s, wall " << stats.wallSec << " s, overlap " << std::setprecision(2) << overlap << "x\n";
+            cout.unsetf(std::ios::floatfield);
+            cout << std::setprecision(6);
+        }
+        return ok;
+    }
+
+    // Transforms `length` bytes of inPath at inOffset into outPath at outOffset, using
+    // the parallel workers for large ranges and the pipelined single stream otherwise.
+    static bool transformRange(const string &inPath, uint64_t inOffset, const string &outPath,
+                               uint64_t outOffset, uint64_t length, const CipherKey &key,
+                               bool truncateOut, uint64_t keyOffset = 0)
+    {
+        RawFile src;
+        RawFile dst;
+        if (!src.openRead(inPath) || !dst.openWrite(outPath, truncateOut))
+            return false;
+        return transformRange(src, inOffset, dst, outOffset, length, key, keyOffset, basename_of(outPath));
+    }
+
+    // Same on files that are already open, e.g. descriptors handed over by a client.
+    static bool transformRange(RawFile &src, uint64_t inOffset, RawFile &dst, uint64_t outOffset, uint64_t length,
+                               const CipherKey &key, uint64_t keyOffset, const string &label)
+    {
+        if (useParallel(length))
+            return transformRangeParallel(src, inOffset, dst, outOffset, length, key, keyOffset, label);
+        return transformRangePipelined(src, inOffset, dst, outOffset, length, key, keyOffset, label);
+    }
+
+    // Whole-file transform used by the image and file modes. Returns false if the
+    // files cannot be opened or an I/O call fails.
+    static bool transformFile(const string &inPath, const string &outPath, unsigned long long key)
+    {
+        return transformRange(inPath, 0, outPath, 0, filesize_bytes(inPath), key, true);
+    }
+
+    // Whole-file encrypt with the selected cipher; ChaCha20 outputs start with a header.
+    static bool encryptFileTo(const string &inPath, const string &outPath, unsigned long long key)
+    {
+        if (wantsCheckpoints(filesize_bytes(inPath)) || resumeRuns)
+            return encryptFileCheckpointed(inPath, outPath, key);
+        if (cipherMode == CipherMode::Xor)
+            return transformFile(inPath, outPath, key);
+        CipherHeader header;
+        CipherKey fileKey = newCipherHeader(header);
+        RawFile src;
+        RawFile dst;
+        if (!src.openRead(inPath) || !dst.openWrite(outPath, true) || !dst.writeAt(&header, sizeof(header), 0))
+            return false;
+        return transformRange(src, 0, dst, sizeof(header), filesize_bytes(inPath), fileKey, 0, basename_of(outPath));
+    }
+
+    // encryptFileTo for large inputs and --resume runs: the same output, written in
+    // checkpointed intervals and continued from a valid checkpoint.
+    static bool encryptFileCheckpointed(const string &inPath, const string &outPath, unsigned long long key)
+    {
+        EncryptCheckpoint cp;
+        CipherKey cipher(key);
+        bool resumed = loadCheckpoint(inPath, outPath, key, false, cp, nullptr, nullptr);
+        if (resumed && cp.cipher == 1)
+            resumed = parseCipherHeader(cp.prefix, cp.prefixLen, cipher) == HeaderState::Valid;
+        resumed = resumed && checkpointTailMatches(inPath, outPath, cp, cipher, nullptr, nullptr);
+        CipherHeader header;
+        if (!resumed)
+        {
+            cipher = CipherKey(key);
+            bool chacha = cipherMode == CipherMode::ChaCha20;
+            if (chacha)
+                cipher = newCipherHeader(header);
+            newCheckpoint(inPath, key, false, false, &header, chacha ? sizeof(header) : 0, cp);
+        }
+        RawFile src;
+        RawFile dst;
+        if (!src.openRead(inPath) || !dst.openWrite(outPath, !resumed) ||
+            (!resumed && cp.prefixLen && !dst.writeAt(cp.prefix, cp.prefixLen, 0)))
+            return false;
+        ProgressReporter::FileScope shown(progress, basename_of(outPath), cp.inputSize, cp.committed);
+        if (!encryptCheckpointed(src, dst, outPath, cp, cipher, nullptr, nullptr, nullptr, true,
+                                 wantsCheckpoints(cp.inputSize)))
+            return false;
+        removeCheckpoint(outPath);
+        return true;
+    }
+
+    // Whole-file decrypt of either format. Callers check the password beforehand
+    // with readCipherHeader, so a false return here means an I/O failure.
+    static bool decryptFileTo(const string &inPath, const string &outPath, unsigned long long key)
+    {
+        uint64_t size = filesize_bytes(inPath);
+        CipherKey fileKey(key);
+        if (readCipherHeader(inPath, 0, size, fileKey) != HeaderState::Valid)
+            return transformFile(inPath, outPath, key);
+        return transformRange(inPath, sizeof(CipherHeader), outPath, 0, size - sizeof(CipherHeader), fileKey, true);
+    }
+
+    // Prints the mismatch and returns false if `path` is ChaCha20 data for another password.
+    static bool passwordFits(const string &path, unsigned long long key)
+    {
+        CipherKey ignored(key);
+        if (readCipherHeader(path, 0, filesize_bytes(path), ignored) != HeaderState::WrongPassword)
+            return true;
+        reportWrongPassword();
+        return false;
+    }
+
+    static void reportWrongPassword()
+    {
+        cout << "The password does not match this ChaCha20-encrypted data.\n";
+    }
+};
+
+class ImageCrypto : public BaseCrypto
+{
+public:
+    ImageCrypto() = default;
+
+    static string encryptedPathFor(const string &in)
+    {
+        return make_output_same_dir(in, "_enc", extension_of(in).empty() ? ".img" : "");
+    }
+
+    static string decryptedPathFor(const string &in)
+    {
+        return make_output_same_dir(in, "_dec", ".jpg");
+    }
+
+    bool encrypt(const string &inputPath, unsigned long long key)
+    {
+        string in = trim(inputPath);
+        if (!fs::exists(in))
+        {
+            cout << "Input image does not exist: " << in << "\n";
+            return false;
+        }
+        if (inPlace)
+        {
+            return runInPlace(in, key, "Image encrypted in place: ");
+        }
+
+        string out = encryptedPathFor(in);
+        if (!confirm_overwrite_if_exists(out))
+        {
+            cout << "Skipping encrypt for: " << in << "\n";
+            return false;
+        }
+
+        if (!encryptFileTo(in, out, key))
+        {
+            cout << "Failed to open files for image encrypt.\n";
+            return false;
+        }
+        cout << "\nImage encrypted to: " << out << "\n";
+        return true;
+    }
+
+    bool decrypt(const string &inputPath, unsigned long long key)
+    {
+        string in = trim(inputPath);
+        if (!fs::exists(in))
+        {
+            cout << "Input encrypted image does not exist: " << in << "\n";
+            return false;
+        }
+        if (inPlace)
+        {
+            return runInPlace(in, key, "Image decrypted in place: ");
+        }
+        if (!passwordFits(in, key))
+            return false;
+
+        string out = decryptedPathFor(in);
+        if (!confirm_overwrite_if_exists(out))
+        {
+            cout << "Skipping decrypt for: " << in << "\n";
+            return false;
+        }
+
+        if (!decryptFileTo(in, out, key))
+        {
+            cout << "Failed to open files for image decrypt.\n";
+            return false;
+        }
+        cout << "\nImage decrypted to: " << out << "\n";
+        return true;
+    }
+};
+
+// Chunked container written by the file modes (magic "SLCNTR01"):
+//   header (64 bytes) | chunk 0 | chunk 1 | ... | CRC-32C per chunk | trailer (32 bytes)
+// Chunks are fixed-size (the last may be shorter) and hold ciphertext, so chunk i
+// starts at sizeof(Header) + i * chunkSize. The key stream position is the plaintext
+// offset, as in the raw format. The CRCs cover the ciphertext, so a file can be
+// verified without the password, and every chunk can be checked and decrypted on
+// its own, in parallel. Version 2 (--compress) stores each chunk LZ4-compressed
+// where that helps, back to back; the index then also lists every stored length.
+class ContainerCrypto : public BaseCrypto
+{
+public:
+    static const uint64_t kChunkSize = kChunkUnit;
+
+    // Each function below returns false with a one-line reason in `error`. A
+    // non-empty `label` shows the file on the progress line. Without `parallel` the
+    // chunks are processed on the calling thread only, for callers that already
+    // keep every worker busy. encryptTo() can also return the CRC-32C of the whole
+    // plaintext in `fingerprint`, taken from the data as it is encrypted.
+    static bool encryptTo(const string &inPath, const string &outPath, unsigned long long key, const string &label,
+                          bool parallel, uint32_t *fingerprint, string &error)
+    {
+        const uint64_t size = filesize_bytes(inPath);
+        const uint64_t chunks = (size + kChunkSize - 1) / kChunkSize;
+        vector<uint32_t> crcs(static_cast<size_t>(chunks));
+        vector<uint32_t> lengths(compressOutput ? crcs.size() : 0);
+        vector<uint32_t> *stored = compressOutput ? &lengths : nullptr;
+        Header h = {};
+        CipherKey cipher(key);
+        EncryptCheckpoint cp;
+        bool resumed = loadCheckpoint(inPath, outPath, key, true, cp, &crcs, stored) && cp.prefixLen == sizeof(h);
+        if (resumed)
+        {
+            std::memcpy(&h, cp.prefix, sizeof(h));
+            resumed = checkKey(h, key, cipher, error) &&
+                      checkpointTailMatches(inPath, outPath, cp, cipher, &crcs, stored);
+        }
+        if (!resumed)
+        {
+            error.clear();
+            h = {};
+            std::memcpy(h.magic, "SLCNTR01", 8);
+            h.version = compressOutput ? 2 : 1;
+            h.chunkSize = kChunkSize;
+            h.dataSize = size;
+            cipher = CipherKey(key);
+            if (cipherMode == CipherMode::ChaCha20)
+            {
+                CipherHeader ch;
+                cipher = newCipherHeader(ch);
+                h.cipher = 1;
+                std::memcpy(h.salt, ch.salt, sizeof(h.salt));
+                h.keyCheck = ch.check;
+            }
+            else
+            {
+                randomSalt(h.salt);
+                h.keyCheck = passwordCheck("SLCNTR-XOR", h.salt, key);
+            }
+            h.headerCrc = headerCrcOf(h);
+            newCheckpoint(inPath, key, true, compressOutput, &h, sizeof(h), cp);
+        }
+
+        RawFile src;
+        RawFile dst;
+        if (!src.openRead(inPath) || !dst.openWrite(outPath, !resumed))
+        {
+            error = "Failed to open files for file encrypt.";
+            return false;
+        }
+        std::unique_ptr<ProgressReporter::FileScope> shown;
+        if (!label.empty())
+            shown.reset(new ProgressReporter::FileScope(progress, label, size, cp.committed));
+
+        // A resumed run does not read the committed chunks, so their part of the
+        // fingerprint is read separately.
+        vector<uint32_t> plainCrcs(fingerprint ? crcs.size() : 0);
+        vector<unsigned char> buf(fingerprint && cp.committed ? static_cast<size_t>(kChunkSize) : 0);
+        bool ok = true;
+        for (uint64_t c = 0; ok && fingerprint && c < cp.committed / kChunkSize; ++c)
+        {
+            size_t n = static_cast<size_t>(std::min(kChunkSize, size - c * kChunkSize));
+            ok = readFully(src, buf.data(), n, c * kChunkSize);
+            plainCrcs[static_cast<size_t>(c)] = stealth::crc32c(buf.data(), n);
+        }
+        ok = ok && (resumed || dst.writeAt(&h, sizeof(h), 0)) &&
+             encryptCheckpointed(src, dst, outPath, cp, cipher, &crcs, stored, fingerprint ? &plainCrcs : nullptr,
+                                 parallel, wantsCheckpoints(size));
+        if (ok && fingerprint)
+        {
+            *fingerprint = 0;
+            for (uint64_t c = 0; c < chunks; ++c)
+                *fingerprint = stealth::crc32cCombine(*fingerprint, plainCrcs[static_cast<size_t>(c)],
+                                                      std::min(kChunkSize, size - c * kChunkSize));
+        }
+        if (ok)
+        {
+            const size_t indexBytes = crcs.size() * sizeof(uint32_t);
+            Trailer t = {sizeof(Header) + cp.storedEnd, chunks, 0, 0, {'S', 'L', 'C', 'I', 'D', 'X', '0', '1'}};
+            t.indexCrc = stealth::crc32c(reinterpret_cast<const unsigned char *>(crcs.data()), indexBytes);
+            t.indexCrc = stealth::crc32c(reinterpret_cast<const unsigned char *>(lengths.data()),
+                                         lengths.size() * sizeof(uint32_t), t.indexCrc);
+            ok = dst.writeGatherAt({{crcs.data(), indexBytes},
+                                    {lengths.data(), lengths.size() * sizeof(uint32_t)},
+                                    {&t, sizeof(t)}},
+                                   t.indexOffset);
+            // A resumed run may follow a longer partial output.
+            ok = ok && (!resumed || dst.resize(t.indexOffset + indexBytes + lengths.size() * sizeof(uint32_t) +
+                                               sizeof(t)));
+        }
+        if (!ok)
+            error = "I/O error while writing the container.";
+        else
+            removeCheckpoint(outPath);
+        return ok;
+    }
+
+    // Checks the password, then every chunk's CRC while decrypting. Stops at the
+    // first bad chunk and removes the partial output.
+    static bool decryptTo(const string &inPath, const string &outPath, unsigned long long key, const string &label,
+                          bool parallel, string &error)
+    {
+        Layout l;
+        CipherKey cipher(key);
+        RawFile src;
+        if (!openLayout(inPath, src, l, error) || !checkKey(l.header, key, cipher, error))
+            return false;
+        RawFile dst;
+        if (!dst.openWrite(outPath, true) || !dst.resize(l.header.dataSize))
+        {
+            error = "Failed to open files for file decrypt.";
+            return false;
+        }
+        bool ok = processChunks(src, l, 0, l.chunks(), &cipher, label, error, parallel, false,
+                                [&](uint64_t pos, const unsigned char *p, size_t len)
+                                { return dst.writeAt(p, len, pos); });
+        if (!ok)
+        {
+            dst.close();
+            std::error_code ec;
+            fs::remove(outPath, ec);
+        }
+        return ok;
+    }
+
+    // Structure and CRC check of every chunk; needs no password.
+    static bool verify(const string &path, const string &label, string &error)
+    {
+        Layout l;
+        RawFile src;
+        return openLayout(path, src, l, error) &&
+               processChunks(src, l, 0, l.chunks(), nullptr, label, error, true, false, nullptr);
+    }
+
+    // Plaintext size of a container (0 if the layout is unreadable).
+    static uint64_t dataSize(const string &path)
+    {
+        Layout l;
+        RawFile src;
+        string ignored;
+        return openLayout(path, src, l, ignored) ? l.header.dataSize : 0;
+    }
+
+    // Decrypts [offset, offset + length) of the plaintext, clipped to the data, and
+    // hands it to `sink` in order. Only the chunks overlapping the range are read,
+    // and each is CRC-checked first.
+    static bool readRange(const string &path, uint64_t offset, uint64_t &length, unsigned long long key,
+                          const std::function<bool(const unsigned char *, size_t)> &sink, string &error)
+    {
+        Layout l;
+        CipherKey cipher(key);
+        RawFile src;
+        if (!openLayout(path, src, l, error) || !checkKey(l.header, key, cipher, error))
+            return false;
+        if (offset > l.header.dataSize)
+        {
+            error = "Range starts past the end of the data (" + std::to_string(l.header.dataSize) + " bytes).";
+            return false;
+        }
+        length = std::min(length, l.header.dataSize - offset);
+        if (length == 0)
+            return true;
+        const uint64_t end = offset + length;
+        return processChunks(src, l, offset / kChunkSize, (end + kChunkSize - 1) / kChunkSize, &cipher, "", error, true, true,
+                             [&](uint64_t pos, const unsigned char *p, size_t len)
+                             {
+                                 uint64_t from = std::max(pos, offset);
+                                 uint64_t to = std::min<uint64_t>(pos + len, end);
+                                 return sink(p + (from - pos), static_cast<size_t>(to - from));
+                             });
+    }
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t cipher; // 0 = XOR, 1 = ChaCha20
+        uint64_t chunkSize;
+        uint64_t dataSize;
+        unsigned char salt[16]; // ChaCha20 per-file key salt, or the salt of an XOR passwordCheck()
+        uint64_t keyCheck;
+        uint32_t headerCrc; // CRC-32C of the bytes before this field
+        uint32_t reserved;
+    };
+
+    struct Trailer
+    {
+        uint64_t indexOffset;
+        uint64_t chunkCount;
+        uint32_t indexCrc;
+        uint32_t reserved;
+        char magic[8]; // "SLCIDX01"
+    };
+
+    struct Layout
+    {
+        Header header;
+        vector<uint32_t> crcs;
+        vector<uint64_t> offsets; // chunk i is stored at [offsets[i], offsets[i + 1]) after the header
+
+        uint64_t chunks() const
+        {
+            return crcs.size();
+        }
+
+        bool compressed() const
+        {
+            return header.version == 2;
+        }
+    };
+
+    static uint32_t headerCrcOf(const Header &h)
+    {
+        return stealth::crc32c(reinterpret_cast<const unsigned char *>(&h), offsetof(Header, headerCrc));
+    }
+
+    // Reads and cross-checks header, trailer and chunk index against the file size.
+    static bool openLayout(const string &path, RawFile &src, Layout &l, string &error)
+    {
+        const uint64_t fileSize = filesize_bytes(path);
+        Trailer t;
+        if (!src.openRead(path))
+        {
+            error = "Encrypted file does not exist: " + path;
+            return false;
+        }
+        if (fileSize < sizeof(Header) + sizeof(Trailer) || !readFully(src, reinterpret_cast<unsigned char *>(&l.header), sizeof(Header), 0) ||
+            !readFully(src, reinterpret_cast<unsigned char *>(&t), sizeof(t), fileSize - sizeof(t)))
+        {
+            error = "Container is truncated.";
+            return false;
+        }
+        const Header &h = l.header;
+        if (std::memcmp(h.magic, "SLCNTR01", 8) != 0)
+        {
+            error = "Not a container file.";
+            return false;
+        }
+        if ((h.version != 1 && h.version != 2) || h.headerCrc != headerCrcOf(h) ||
+            h.chunkSize == 0 || h.chunkSize > kMaxBlockSize)
+        {
+            error = "Container header is damaged or of an unknown version.";
+            return false;
+        }
+        const uint64_t chunks = (h.dataSize + h.chunkSize - 1) / h.chunkSize;
+        const uint64_t indexBytes = chunks * sizeof(uint32_t) * (l.compressed() ? 2 : 1);
+        if (std::memcmp(t.magic, "SLCIDX01", 8) != 0 || t.chunkCount != chunks ||
+            t.indexOffset < sizeof(Header) || (!l.compressed() && t.indexOffset != sizeof(Header) + h.dataSize) ||
+            fileSize != t.indexOffset + indexBytes + sizeof(Trailer))
+        {
+            error = "Container is truncated or its chunk index is missing.";
+            return false;
+        }
+        vector<uint32_t> index(static_cast<size_t>(indexBytes / sizeof(uint32_t)));
+        bool ok = readFully(src, reinterpret_cast<unsigned char *>(index.data()), index.size() * sizeof(uint32_t),
+                            t.indexOffset) &&
+                  stealth::crc32c(reinterpret_cast<const unsigned char *>(index.data()),
+                                  index.size() * sizeof(uint32_t)) == t.indexCrc;
+        l.crcs.assign(index.begin(), index.begin() + static_cast<std::ptrdiff_t>(chunks));
+        l.offsets.assign(static_cast<size_t>(chunks) + 1, 0);
+        for (uint64_t i = 0; ok && i < chunks; ++i)
+        {
+            uint64_t plain = std::min(h.chunkSize, h.dataSize - i * h.chunkSize);
+            uint64_t stored = l.compressed() ? index[static_cast<size_t>(chunks + i)] : plain;
+            ok = stored <= plain;
+            l.offsets[static_cast<size_t>(i + 1)] = l.offsets[static_cast<size_t>(i)] + stored;
+        }
+        if (!ok || l.offsets.back() != t.indexOffset - sizeof(Header))
+        {
+            error = "Container chunk index is damaged.";
+            return false;
+        }
+        return true;
+    }
+
+    static bool checkKey(const Header &h, unsigned long long key, CipherKey &cipher, string &error)
+    {
+        bool ok;
+        if (h.cipher == 1)
+        {
+            CipherHeader ch;
+            std::memcpy(ch.magic, "SLCHACHA", 8);
+            std::memcpy(ch.salt, h.salt, sizeof(ch.salt));
+            ch.check = h.keyCheck;
+            ok = parseCipherHeader(reinterpret_cast<const unsigned char *>(&ch), sizeof(ch), cipher) ==
+                 HeaderState::Valid;
+        }
+        else
+        {
+            ok = h.cipher == 0 && h.keyCheck == passwordCheck("SLCNTR-XOR", h.salt, key);
+            cipher = CipherKey(key);
+        }
+        if (!ok)
+            error = "The password does not match this file.";
+        return ok;
+    }
+
+    // Reads chunks [begin, end), checks each CRC and, given a cipher, decrypts (and
+    // expands) them and passes (plaintext offset, bytes) to `emit`: in chunk order if
+    // `ordered` (a stream sink), otherwise from the workers as groups finish. Uses
+    // all workers for large ranges if `parallel`.
+    static bool processChunks(RawFile &src, const Layout &l, uint64_t begin, uint64_t end, const CipherKey *cipher,
+                              const string &label, string &error, bool parallel, bool ordered,
+                              const std::function<bool(uint64_t, const unsigned char *, size_t)> &emit)
+    {
+        const uint64_t cs = l.header.chunkSize;
+        const uint64_t size = l.header.dataSize;
+        const uint64_t bytes = std::min(end * cs, size) - std::min(begin * cs, size);
+        std::unique_ptr<ProgressReporter::FileScope> shown;
+        if (!label.empty())
+            shown.reset(new ProgressReporter::FileScope(progress, label, bytes));
+
+        // Groups finish out of order; with `ordered` each waits for its turn to emit.
+        std::mutex turnMutex;
+        std::condition_variable turnChanged;
+        uint64_t turn = begin;
+        std::atomic<bool> aborted(false);
+        std::atomic<uint64_t> badChunk(UINT64_MAX);
+        std::atomic<bool> badData(false);
+        uint64_t failedChunk = 0;
+        auto markBad = [&](uint64_t chunk)
+        {
+            uint64_t prev = badChunk;
+            while (chunk < prev && !badChunk.compare_exchange_weak(prev, chunk))
+                ;
+        };
+
+        bool ok = forEachChunkGroup(begin, end, cs, parallel && useParallel(bytes), l.compressed() && cipher ? 2 : 1,
+                                    failedChunk,
+                                    [&](uint64_t first, uint64_t count, vector<unsigned char> &buf)
+                                    {
+            uint64_t pos = first * cs;
+            size_t len = static_cast<size_t>(std::min(count * cs, size - pos));
+            const uint64_t from = l.offsets[static_cast<size_t>(first)];
+            bool good = readFully(src, buf.data(), static_cast<size_t>(l.offsets[static_cast<size_t>(first + count)] - from),
+                                  sizeof(Header) + from);
+            auto t0 = op_clock();
+            for (uint64_t c = 0; good && c < count; ++c)
+            {
+                size_t at = static_cast<size_t>(l.offsets[static_cast<size_t>(first + c)] - from);
+                size_t n = static_cast<size_t>(l.offsets[static_cast<size_t>(first + c + 1)] - from) - at;
+                if (stealth::crc32c(buf.data() + at, n) != l.crcs[static_cast<size_t>(first + c)])
+                {
+                    markBad(first + c);
+                    good = false;
+                }
+            }
+            add_op_time(opCounters.transformNs, t0);
+            const unsigned char *out = buf.data();
+            if (good && cipher && !l.compressed())
+            {
+                xorBuffer(buf.data(), len, *cipher, pos);
+            }
+            else if (good && cipher)
+            {
+                unsigned char *plain = buf.data() + buf.size() / 2;
+                for (uint64_t c = 0; good && c < count; ++c)
+                {
+                    size_t at = static_cast<size_t>(l.offsets[static_cast<size_t>(first + c)] - from);
+                    size_t n = static_cast<size_t>(l.offsets[static_cast<size_t>(first + c + 1)] - from) - at;
+                    uint64_t chunkPos = (first + c) * cs;
+                    size_t plainLen = static_cast<size_t>(std::min(cs, size - chunkPos));
+                    xorBuffer(buf.data() + at, n, *cipher, chunkPos);
+                    auto t1 = op_clock();
+                    if (n == plainLen)
+                        std::memcpy(plain + c * cs, buf.data() + at, n);
+                    else if (!stealth::lzDecompress(buf.data() + at, n, plain + c * cs, plainLen))
+                    {
+                        markBad(first + c);
+                        badData = true;
+                        good = false;
+                    }
+                    add_op_time(opCounters.transformNs, t1);
+                }
+                out = plain;
+            }
+            if (good && emit && !ordered)
+            {
+                good = !aborted && emit(pos, out, len);
+            }
+            else if (good && emit)
+            {
+                std::unique_lock<std::mutex> lock(turnMutex);
+                turnChanged.wait(lock, [&]()
+                                 { return turn == first || aborted; });
+                good = !aborted && emit(pos, out, len);
+            }
+            if (!good)
+                aborted = true;
+            if (ordered)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(turnMutex);
+                    turn = first + count;
+                }
+                turnChanged.notify_all();
+            }
+            progress.add(len);
+            return good; });
+        if (!ok)
+        {
+            if (badChunk != UINT64_MAX)
+                error = "Chunk " + std::to_string(badChunk.load()) + " (offset " +
+                        std::to_string(badChunk.load() * cs) + ")" +
+                        (badData ? " could not be decompressed." : " failed its CRC check.");
+            else
+                error = "I/O error at chunk " + std::to_string(failedChunk) + ".";
+        }
+        return ok;
+    }
+};
+
+class FileCrypto : public BaseCrypto
+{
+public:
+    FileCrypto() = default;
+
+    static string encryptedPathFor(const string &in)
+    {
+        string ext = extension_of(in);
+        return make_output_same_dir(in, "_enc", ext.empty() ? ".enc" : ".enc");
+    }
+
+    // Reverses the _enc / .enc naming where possible, otherwise appends _dec.
+    static string decryptedPathFor(const string &in)
+    {
+        string dir = dirname_of(in);
+        string base = basename_of(in);
+        string outName;
+
+        size_t posEnc = base.rfind("_enc");
+        if (posEnc != string::npos)
+        {
+
+            string withoutEnc = base.substr(0, posEnc);
+            string ext = fs::path(base).extension().string();
+
+            if (ext == ".enc")
+            {
+
+                string stem = fs::path(withoutEnc).stem().string();
+                string origExt = fs::path(withoutEnc).extension().string();
+                if (!origExt.empty())
+                {
+                    outName = stem + origExt;
+                }
+                else
+                {
+                    outName = withoutEnc;
+                }
+            }
+            else
+            {
+                outName = withoutEnc + ext;
+            }
+        }
+        else if (base.size() > 4 && base.substr(base.size() - 4) == ".enc")
+        {
+            outName = base.substr(0, base.size() - 4);
+        }
+        else
+        {
+            outName = base + "_dec";
+        }
+
+        return (fs::path(dir) / fs::path(outName)).string();
+    }
+
+    bool encrypt(const string &inputPath, unsigned long long key)
+    {
+        string in = trim(inputPath);
+        if (!fs::exists(in))
+        {
+            cout << "Input file does not exist: " << in << "\n";
+            return false;
+        }
+        if (inPlace)
+        {
+            return runInPlace(in, key, "File encrypted in place: ");
+        }
+
+        string out = encryptedPathFor(in);
+        bool interrupted = fs::exists(checkpointPathFor(out));
+        if (interrupted && !resumeRuns)
+            cout << "An interrupted encrypt left a checkpoint for " << out << "; use --resume to continue it.\n";
+        if (!(interrupted && resumeRuns) && !confirm_overwrite_if_exists(out))
+        {
+            cout << "Skipping encrypt for: " << in << "\n";
+            return false;
+        }
+
+        string error;
+        if (containerFormat ? !ContainerCrypto::encryptTo(in, out, key, basename_of(out), true, nullptr, error)
+                            : !encryptFileTo(in, out, key))
+        {
+            cout << (error.empty() ? "Failed to open files for file encrypt." : error) << "\n";
+            return false;
+        }
+        if (interrupted)
+            removeCheckpoint(out);
+        cout << "\nFile encrypted to: " << out << "\n";
+        return true;
+    }
+
+    bool decrypt(const string &inputPath, unsigned long long key)
+    {
+        string in = trim(inputPath);
+        if (!fs::exists(in))
+        {
+            cout << "Encrypted file does not exist: " << in << "\n";
+            return false;
+        }
+        if (inPlace)
+        {
+            return runInPlace(in, key, "File decrypted in place: ");
+        }
+        bool container = hasContainerMagic(in);
+        if (!container && !passwordFits(in, key))
+            return false;
+
+        string outPath = decryptedPathFor(in);
+        if (!confirm_overwrite_if_exists(outPath))
+        {
+            cout << "Skipping decrypt for: " << in << "\n";
+            return false;
+        }
+
+        string error;
+        if (container ? !ContainerCrypto::decryptTo(in, outPath, key, basename_of(outPath), true, error)
+                      : !decryptFileTo(in, outPath, key))
+        {
+            cout << (error.empty() ? "Failed to open files for file decrypt." : error) << "\n";
+            return false;
+        }
+        cout << "\nFile decrypted to: " << outPath << "\n";
+        return true;
+    }
+
+    // Decrypts `length` bytes of the plaintext starting at `offset` without touching
+    // the rest of the file: the key stream is random access, so only the range is
+    // read. A range running past the end is clipped.
+    bool decryptRange(const string &path, uint64_t offset, uint64_t length, unsigned long long key,
+                      vector<unsigned char> &out)
+    {
+        if (hasContainerMagic(trim(path)))
+        {
+            out.clear();
+            return readContainerRange(trim(path), offset, length, key, [&out](const unsigned char *p, size_t n)
+                                      {
+                out.insert(out.end(), p, p + n);
+                return true; });
+        }
+        RawFile src;
+        CipherKey cipher(key);
+        uint64_t base = 0;
+        if (!openRange(trim(path), offset, length, key, src, cipher, base))
+            return false;
+        out.resize(static_cast<size_t>(length));
+        if (!readFully(src, out.data(), out.size(), base + offset))
+        {
+            cout << "Failed to read encrypted file.\n";
+            return false;
+        }
+        xorBuffer(out.data(), out.size(), cipher, offset);
+        return true;
+    }
+
+    // Same, streamed to `out` in blockSize pieces so large ranges need no large buffer.
+    bool decryptRange(const string &path, uint64_t offset, uint64_t length, unsigned long long key,
+                      std::ostream &out)
+    {
+        string in = trim(path);
+        auto write = [&out](const unsigned char *p, size_t n)
+        {
+            auto t0 = op_clock();
+            out.write(reinterpret_cast<const char *>(p), static_cast<std::streamsize>(n));
+            count_io(true, n, t0, false);
+            return static_cast<bool>(out);
+        };
+        if (hasContainerMagic(in))
+        {
+            if (!readContainerRange(in, offset, length, key, write))
+                return false;
+            cout << "Decrypted " << length << " bytes of " << in << " from offset " << offset << "\n";
+            return true;
+        }
+
+        RawFile src;
+        CipherKey cipher(key);
+        uint64_t base = 0;
+        if (!openRange(in, offset, length, key, src, cipher, base))
+            return false;
+        vector<unsigned char> buffer(static_cast<size_t>(std::min<uint64_t>(blockSize, length)));
+        for (uint64_t done = 0; done < length;)
+        {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(buffer.size(), length - done));
+            if (!readFully(src, buffer.data(), n, base + offset + done))
+            {
+                cout << "Failed to read encrypted file.\n";
+                return false;
+            }
+            xorBuffer(buffer.data(), n, cipher, offset + done);
+            write(buffer.data(), n);
+            done += n;
+        }
+        out.flush();
+        if (!out)
+        {
+            cout << "Failed to write decrypted range.\n";
+            return false;
+        }
+        cout << "Decrypted " << length << " bytes of " << in << " from offset " << offset << "\n";
+        return true;
+    }
+
+private:
+    static bool readContainerRange(const string &path, uint64_t offset, uint64_t &length, unsigned long long key,
+                                   const std::function<bool(const unsigned char *, size_t)> &sink)
+    {
+        string error;
+        if (ContainerCrypto::readRange(path, offset, length, key, sink, error))
+            return true;
+        cout << error << "\n";
+        return false;
+    }
+
+    // Opens an encrypted file for a range read: checks the password, finds where the
+    // data starts (`base`, after a ChaCha20 header) and clips `length` to the data.
+    static bool openRange(const string &path, uint64_t offset, uint64_t &length, unsigned long long key,
+                          RawFile &src, CipherKey &cipher, uint64_t &base)
+    {
+        uint64_t size = filesize_bytes(path);
+        if (!src.openRead(path))
+        {
+            cout << "Encrypted file does not exist: " << path << "\n";
+            return false;
+        }
+        switch (readCipherHeader(path, 0, size, cipher))
+        {
+        case HeaderState::WrongPassword:
+            reportWrongPassword();
+            return false;
+        case HeaderState::Valid:
+            base = sizeof(CipherHeader);
+            size -= base;
+            break;
+        case HeaderState::None:
+            cipher = CipherKey(key);
+            break;
+        }
+        if (offset > size)
+        {
+            cout << "Range starts past the end of the data (" << size << " bytes).\n";
+            return false;
+        }
+        length = std::min(length, size - offset);
+        return true;
+    }
+};
+
+// Record of an incremental encrypt-tree run, kept at <root>/stealth_tree.slman:
+// per source (path relative to the root) its size, modification time, inode and
+// CRC-32C of the content when its output was written. The next run memory-maps it
+// and looks every source up by path hash, so an unchanged tree costs one stat per
+// file instead of a re-encrypt.
+class TreeManifest
+{
+public:
+    // Sorted by (hash, name); names live in one block after the entries.
+    struct Entry
+    {
+        uint64_t hash;
+        uint64_t size; // kIncomplete: the output was started but not finished
+        int64_t mtime;
+        uint64_t inode;
+        uint64_t nameOffset;
+        uint32_t nameLength;
+        uint32_t fingerprint;
+    };
+
+    static const uint64_t kIncomplete = UINT64_MAX;
+
+    TreeManifest() = default;
+    ~TreeManifest()
+    {
+        unmap();
+    }
+    TreeManifest(const TreeManifest &) = delete;
+    TreeManifest &operator=(const TreeManifest &) = delete;
+
+    static string pathFor(const string &root)
+    {
+        return (fs::path(root) / "stealth_tree.slman").string();
+    }
+
+    // Maps the manifest of `root`. A missing, damaged or unreadable manifest
+    // leaves this one empty.
+    bool load(const string &root)
+    {
+        unmap();
+        const string path = pathFor(root);
+        if (!fs::exists(path))
+            return false;
+        mappedSize = filesize_bytes(path);
+        if (mappedSize < sizeof(Header) || !file.openRead(path) ||
+            !(view = file.mapReadRange(0, static_cast<size_t>(mappedSize))))
+        {
+            unmap();
+            return false;
+        }
+        std::memcpy(&header, view, sizeof(header));
+        const uint64_t body = mappedSize - sizeof(Header);
+        if (std::memcmp(header.magic, "SLINCR01", 8) != 0 || header.count > body / sizeof(Entry) ||
+            header.namesOffset != sizeof(Header) + header.count * sizeof(Entry) ||
+            header.namesOffset + header.namesSize != mappedSize ||
+            stealth::crc32c(view + sizeof(Header), static_cast<size_t>(body)) != header.crc)
+        {
+            unmap();
+            return false;
+        }
+        entries = reinterpret_cast<const Entry *>(view + sizeof(Header));
+        for (uint64_t i = 0; i < header.count; ++i)
+        {
+            if (entries[i].nameOffset + entries[i].nameLength > header.namesSize)
+            {
+                unmap();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A passwordCheck() under salt().
+    uint64_t keyCheck() const
+    {
+        return header.keyCheck;
+    }
+
+    const unsigned char *salt() const
+    {
+        return header.salt;
+    }
+
+    uint64_t settings() const
+    {
+        return header.settings;
+    }
+
+    size_t size() const
+    {
+        return entries ? static_cast<size_t>(header.count) : 0;
+    }
+
+    const Entry &at(size_t i) const
+    {
+        return entries[i];
+    }
+
+    string nameAt(size_t i) const
+    {
+        return string(reinterpret_cast<const char *>(view + header.namesOffset + entries[i].nameOffset),
+                      entries[i].nameLength);
+    }
+
+    // Index of `name`, or SIZE_MAX.
+    size_t find(const string &name) const
+    {
+        const uint64_t h = pathHash(name);
+        const Entry *end = entries + size();
+        const Entry *it = std::lower_bound(entries, end, h, [](const Entry &e, uint64_t v)
+                                           { return e.hash < v; });
+        for (; it != end && it->hash == h; ++it)
+        {
+            size_t i = static_cast<size_t>(it - entries);
+            if (it->nameLength == name.size() &&
+                std::memcmp(view + header.namesOffset + it->nameOffset, name.data(), name.size()) == 0)
+                return i;
+        }
+        return SIZE_MAX;
+    }
+
+    // Replaces the manifest of `root` (via a temporary file) with `items`.
+    bool write(const string &root, const unsigned char salt[16], uint64_t keyCheck, uint64_t settings,
+               vector<std::pair<string, Entry>> &items)
+    {
+        for (auto &item : items)
+            item.second.hash = pathHash(item.first);
+        std::sort(items.begin(), items.end(), [](const std::pair<string, Entry> &a, const std::pair<string, Entry> &b)
+                  { return a.second.hash != b.second.hash ? a.second.hash < b.second.hash : a.first < b.first; });
+        vector<Entry> table;
+        string names;
+        table.reserve(items.size());
+        for (auto &item : items)
+        {
+            item.second.nameOffset = names.size();
+            item.second.nameLength = static_cast<uint32_t>(item.first.size());
+            names += item.first;
+            table.push_back(item.second);
+        }
+        Header h = {};
+        std::memcpy(h.magic, "SLINCR01", 8);
+        h.keyCheck = keyCheck;
+        std::memcpy(h.salt, salt, sizeof(h.salt));
+        h.settings = settings;
+        h.count = table.size();
+        h.namesOffset = sizeof(Header) + table.size() * sizeof(Entry);
+        h.namesSize = names.size();
+        h.crc = stealth::crc32c(reinterpret_cast<const unsigned char *>(table.data()), table.size() * sizeof(Entry));
+        h.crc = stealth::crc32c(reinterpret_cast<const unsigned char *>(names.data()), names.size(), h.crc);
+
+        const string path = pathFor(root);
+        const string tmp = path + ".tmp";
+        std::error_code ec;
+        {
+            RawFile out;
+            vector<RawFile::Piece> pieces = {{&h, sizeof(h)},
+                                             {table.data(), table.size() * sizeof(Entry)},
+                                             {names.data(), names.size()}};
+            if (!out.openWrite(tmp, true) || !out.writeGatherAt(pieces, 0) || !out.sync())
+            {
+                fs::remove(tmp, ec);
+                return false;
+            }
+        }
+        unmap();
+        fs::rename(tmp, path, ec);
+        return !ec;
+    }
+
+private:
+    struct Header
+    {
+        char magic[8]; // "SLINCR01"
+        uint64_t keyCheck;
+        uint64_t settings; // cipher, format and compression of the recorded outputs
+        uint64_t count;
+        uint64_t namesOffset;
+        uint64_t namesSize;
+        uint32_t crc; // CRC-32C of everything after the header
+        uint32_t reserved;
+        unsigned char salt[16];
+    };
+
+    static uint64_t pathHash(const string &name)
+    {
+        uint64_t h = 1469598103934665603ULL; // FNV-1a
+        for (unsigned char c : name)
+        {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    void unmap()
+    {
+        if (view)
+            file.unmapRange(view, static_cast<size_t>(mappedSize));
+        view = nullptr;
+        entries = nullptr;
+        mappedSize = 0;
+        header = {};
+        file.close();
+    }
+
+    RawFile file;
+    const unsigned char *view = nullptr;
+    const Entry *entries = nullptr;
+    uint64_t mappedSize = 0;
+    Header header = {};
+};
+
+// Encrypts or decrypts whole directory trees with FileCrypto's naming. The trees are
+// walked in parallel, then files are queued largest first across a work-stealing
+// pool; files at or above the parallel threshold are cut into ranges that any
+// worker can pick up, so one huge file does not serialize the end of the run.
+// Container files below the threshold are one single-threaded task each; larger
+// ones run after the pool, one at a time, each spread over all workers.
+class TreeCrypto : public BaseCrypto
+{
+public:
+    TreeCrypto() = default;
+
+    // Prints one batch status line per file and returns the number of failures.
+    int run(const vector<string> &roots, unsigned long long key, bool decrypt, const string &command)
+    {
+        WorkStealingPool pool(resolvedWorkerCount());
+        std::mutex foundMutex;
+        vector<Source> found;
+        std::deque<RootState> states;
+
+        auto wanted = [decrypt](const fs::path &p)
+        {
+            string ext = extension_of(p.string());
+            return ext != ".slckpt" && ext != ".sljournal" && ext != ".slman" && (ext == ".enc") == decrypt;
+        };
+        std::function<void(const fs::path &, unsigned, RootState *)> scan =
+            [&](const fs::path &dir, unsigned worker, RootState *state)
+        {
+            vector<Source> local;
+            std::error_code ec;
+            for (fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec))
+            {
+                std::error_code sec;
+                if (it->is_directory(sec) && !it->is_symlink(sec))
+                {
+                    fs::path sub = it->path();
+                    pool.push(worker, [&scan, sub, state](unsigned w)
+                              { scan(sub, w, state); });
+                }
+                else if (it->is_regular_file(sec) && wanted(it->path()))
+                {
+                    local.push_back(Source{it->path().string(), state});
+                }
+            }
+            std::lock_guard<std::mutex> lock(foundMutex);
+            found.insert(found.end(), local.begin(), local.end());
+        };
+
+        int failures = 0;
+        for (const string &root : roots)
+        {
+            string r = trim(root);
+            std::error_code ec;
+            if (fs::is_directory(r, ec))
+            {
+                RootState *state = nullptr;
+                if (incrementalTrees && !decrypt)
+                {
+                    states.emplace_back();
+                    state = &states.back();
+                    if (!openRoot(*state, r, key))
+                    {
+                        cout << "failed\t" << command << "\t" << r
+                             << "\tThe password does not match the tree manifest (stealth_tree.slman)\n";
+                        ++failures;
+                        states.pop_back();
+                        continue;
+                    }
+                }
+                pool.push(0, [&scan, r, state](unsigned w)
+                          { scan(fs::path(r), w, state); });
+            }
+            else if (fs::is_regular_file(r, ec))
+            {
+                found.push_back(Source{r, nullptr});
+            }
+            else
+            {
+                cout << "failed\t" << command << "\t" << r << "\tInput does not exist\n";
+                ++failures;
+            }
+        }
+        pool.run();
+        failures += process(pool, found, key, decrypt, command);
+        for (RootState &state : states)
+            failures += finishRoot(state, key, command);
+        return failures;
+    }
+
+private:
+    // Incremental state of one directory root: the previous run's manifest, which of
+    // its entries were found again, and the entries recorded by this run.
+    struct RootState
+    {
+        string root;
+        TreeManifest previous;
+        bool sameSettings = false;
+        vector<bool> seen;
+        std::unordered_set<string> outputs; // of every source found in this run
+        std::mutex m;
+        vector<std::pair<string, TreeManifest::Entry>> next;
+    };
+
+    struct Source
+    {
+        string path;
+        RootState *state; // null unless incremental
+    };
+
+    struct TreeFile
+    {
+        string in;
+        string out;
+        RootState *state = nullptr;
+        string rel; // path below the root, '/'-separated
+        TreeManifest::Entry entry = {};
+        vector<uint32_t> rangeCrcs; // plaintext CRC-32C per range, for entry.fingerprint
+        uint64_t size; // payload bytes, without a ChaCha20 header
+        bool split;
+        bool container = false;
+        uint64_t inSkip = 0; // header bytes before the payload in the input
+        uint64_t outSkip = 0;
+        CipherKey cipher{0ULL};
+        CipherHeader header;
+        std::atomic<uint64_t> rangesLeft{0};
+        std::atomic<bool> failed{false};
+    };
+
+    int process(WorkStealingPool &pool, const vector<Source> &paths, unsigned long long key, bool decrypt,
+                const string &command)
+    {
+        std::mutex reportMutex;
+        std::atomic<int> failures(0);
+        auto report = [&](const TreeFile &f, const char *status, const string &detail)
+        {
+            std::lock_guard<std::mutex> lock(reportMutex);
+            cout << status << "\t" << command << "\t" << f.in << "\t" << detail << "\n";
+        };
+        // Files of an incremental root are recorded whether or not they succeed, so
+        // the next run still treats their outputs as its own.
+        auto record = [](TreeFile &f, bool ok)
+        {
+            if (!f.state)
+                return;
+            TreeManifest::Entry e = f.entry;
+            if (!ok)
+                e.size = TreeManifest::kIncomplete;
+            std::lock_guard<std::mutex> lock(f.state->m);
+            f.state->next.emplace_back(f.rel, e);
+        };
+
+        // Sources that differ only in their extension (a.pdf, a.txt) map to the same
+        // output; none of them is written.
+        std::unordered_map<string, vector<string>> inputsByOutput;
+        for (const Source &source : paths)
+        {
+            const string out = decrypt ? FileCrypto::decryptedPathFor(source.path)
+                                       : FileCrypto::encryptedPathFor(source.path);
+            inputsByOutput[out].push_back(source.path);
+            if (source.state)
+                source.state->outputs.insert(out);
+        }
+
+        std::deque<TreeFile> files;
+        vector<TreeFile *> order;
+        for (const Source &source : paths)
+        {
+            const string &in = source.path;
+            files.emplace_back();
+            TreeFile &f = files.back();
+            f.in = in;
+            f.out = decrypt ? FileCrypto::decryptedPathFor(in) : FileCrypto::encryptedPathFor(in);
+            f.state = source.state;
+            string others;
+            for (const string &other : inputsByOutput[f.out])
+            {
+                if (other != in)
+                    others += (others.empty() ? "" : ", ") + other;
+            }
+            if (!others.empty())
+            {
+                report(f, "failed", "output " + f.out + " would also be written by " + others);
+                ++failures;
+                continue;
+            }
+            bool owned = false;
+            if (f.state)
+            {
+                string error;
+                if (unchanged(f, owned, error))
+                {
+                    record(f, true);
+                    report(f, "skipped", "unchanged");
+                    continue;
+                }
+                if (!error.empty())
+                {
+                    report(f, "failed", error);
+                    ++failures;
+                    continue;
+                }
+            }
+            f.size = filesize_bytes(in);
+            bool resumable = !decrypt && resumeRuns && fs::exists(checkpointPathFor(f.out));
+            if (fs::exists(f.out) && overwritePolicy != OverwritePolicy::Overwrite && !resumable && !owned)
+            {
+                bool skip = overwritePolicy == OverwritePolicy::Skip;
+                report(f, skip ? "skipped" : "failed", "output already exists");
+                if (!skip)
+                    ++failures;
+                continue;
+            }
+            f.cipher = CipherKey(key);
+            if (decrypt ? hasContainerMagic(in) : containerFormat)
+            {
+                f.container = true;
+            }
+            else if (decrypt)
+            {
+                HeaderState state = readCipherHeader(in, 0, f.size, f.cipher);
+                if (state == HeaderState::WrongPassword)
+                {
+                    report(f, "failed", "password does not match");
+                    ++failures;
+                    continue;
+                }
+                if (state == HeaderState::Valid)
+                {
+                    f.inSkip = sizeof(CipherHeader);
+                    f.size -= f.inSkip;
+                }
+            }
+            else if (cipherMode == CipherMode::ChaCha20)
+            {
+                f.cipher = newCipherHeader(f.header);
+                f.outSkip = sizeof(CipherHeader);
+            }
+            f.split = !f.container && useParallel(f.size);
+            order.push_back(&f);
+        }
+
+        std::sort(order.begin(), order.end(), [](const TreeFile *a, const TreeFile *b)
+                  { return a->size > b->size; });
+
+        uint64_t totalBytes = 0;
+        for (const TreeFile *f : order)
+            totalBytes += f->size;
+        progress.beginJob(totalBytes, order.size());
+
+        // Sources of an incremental root get their fingerprint from the data as it is
+        // encrypted, so they are read once.
+        const uint64_t rangeSize = static_cast<uint64_t>(blockSize) * 8;
+        vector<vector<unsigned char>> buffers(pool.size());
+        unsigned next = 0;
+        vector<TreeFile *> largeContainers;
+        auto runContainer = [&](TreeFile &f, bool parallel)
+        {
+            string error;
+            bool ok = decrypt ? ContainerCrypto::decryptTo(f.in, f.out, key, "", parallel, error)
+                              : ContainerCrypto::encryptTo(f.in, f.out, key, "", parallel,
+                                                           f.state ? &f.entry.fingerprint : nullptr, error);
+            progress.itemDone();
+            record(f, ok);
+            report(f, ok ? "ok" : "failed", ok ? f.out : error);
+            if (!ok)
+                ++failures;
+        };
+        for (TreeFile *f : order)
+        {
+            if (f->container && useParallel(f->size))
+            {
+                // Chunk groups of a large container go to workers of its own, so it
+                // waits until the pool's workers are done.
+                largeContainers.push_back(f);
+                continue;
+            }
+            if (f->container)
+            {
+                pool.push(next++, [&, f](unsigned)
+                          { runContainer(*f, false); });
+                continue;
+            }
+            if (f->split || f->outSkip)
+            {
+                // Split outputs are created up front so every range can write into them;
+                // so are outputs that start with a cipher header.
+                RawFile dst;
+                if (!dst.openWrite(f->out, true) || (f->outSkip && !dst.writeAt(&f->header, sizeof(f->header), 0)) ||
+                    !dst.resize(f->outSkip + f->size))
+                {
+                    record(*f, false);
+                    report(*f, "failed", "Failed to create output");
+                    ++failures;
+                    continue;
+                }
+            }
+            uint64_t ranges = f->split ? (f->size + rangeSize - 1) / rangeSize : 1;
+            f->rangesLeft = ranges;
+            if (f->state)
+                f->rangeCrcs.assign(static_cast<size_t>(ranges), 0);
+            for (uint64_t r = 0; r < ranges; ++r)
+            {
+                uint64_t offset = r * rangeSize;
+                uint64_t len = f->split ? std::min(rangeSize, f->size - offset) : f->size;
+                uint32_t *crc = f->state ? &f->rangeCrcs[static_cast<size_t>(r)] : nullptr;
+                pool.push(next++, [&, f, offset, len, crc](unsigned w)
+                          {
+                    if (!transformTreeRange(*f, offset, len, buffers[w], crc))
+                        f->failed = true;
+                    if (--f->rangesLeft == 0)
+                    {
+                        f->entry.fingerprint = 0;
+                        for (size_t k = 0; k < f->rangeCrcs.size(); ++k)
+                            f->entry.fingerprint = stealth::crc32cCombine(
+                                f->entry.fingerprint, f->rangeCrcs[k],
+                                std::min(rangeSize, f->size - static_cast<uint64_t>(k) * rangeSize));
+                        progress.itemDone();
+                        record(*f, !f->failed);
+                        if (f->failed)
+                        {
+                            report(*f, "failed", "I/O error");
+                            ++failures;
+                        }
+                        else
+                        {
+                            report(*f, "ok", f->out);
+                        }
+                    } });
+            }
+        }
+        pool.run();
+        for (TreeFile *f : largeContainers)
+            runContainer(*f, true);
+        progress.endJob();
+        return failures;
+    }
+
+    // Settings that change what an output looks like; outputs recorded under other
+    // settings are written again.
+    static uint64_t outputSettings()
+    {
+        return static_cast<uint64_t>(cipherMode == CipherMode::ChaCha20) | static_cast<uint64_t>(containerFormat) << 1 |
+               static_cast<uint64_t>(compressOutput) << 2;
+    }
+
+    // Maps the root's previous manifest; false if it was written with another password.
+    static bool openRoot(RootState &state, const string &root, unsigned long long key)
+    {
+        state.root = root;
+        if (state.previous.load(root) &&
+            state.previous.keyCheck() != passwordCheck("SLINCR", state.previous.salt(), key))
+            return false;
+        state.sameSettings = state.previous.settings() == outputSettings();
+        state.seen.assign(state.previous.size(), false);
+        return true;
+    }
+
+    // True if the source has the size, time and inode (or, after a touch or copy,
+    // the content fingerprint) recorded for it and its output is still there.
+    // `owned` is set if the previous run wrote this source's output. Fills f.rel
+    // and f.entry; `error` is set if the source cannot be read.
+    static bool unchanged(TreeFile &f, bool &owned, string &error)
+    {
+        RootState &state = *f.state;
+        f.rel = fs::path(f.in).lexically_relative(state.root).generic_string();
+        RawFile probe;
+        TreeManifest::Entry &e = f.entry;
+        if (!probe.openRead(f.in) || !probe.identity(e.size, e.mtime, e.inode))
+        {
+            error = "Cannot read input";
+            return false;
+        }
+        probe.close();
+        const size_t i = state.previous.find(f.rel);
+        if (i == SIZE_MAX)
+            return false;
+        state.seen[i] = true;
+        owned = true;
+        const TreeManifest::Entry &old = state.previous.at(i);
+        if (!state.sameSettings || old.size != e.size || !fs::exists(f.out))
+            return false;
+        if (old.mtime == e.mtime && old.inode == e.inode)
+        {
+            e.fingerprint = old.fingerprint;
+            return true;
+        }
+        return fingerprintOf(f.in, e.fingerprint) && e.fingerprint == old.fingerprint;
+    }
+
+    static bool fingerprintOf(const string &path, uint32_t &crc)
+    {
+        RawFile in;
+        if (!in.openRead(path))
+            return false;
+        const uint64_t size = filesize_bytes(path);
+        vector<unsigned char> buf(static_cast<size_t>(std::min<uint64_t>(blockSize, size)));
+        crc = 0;
+        for (uint64_t pos = 0; pos < size; pos += buf.size())
+        {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(buf.size(), size - pos));
+            if (!readFully(in, buf.data(), n, pos))
+                return false;
+            auto t0 = op_clock();
+            crc = stealth::crc32c(buf.data(), n, crc);
+            add_op_time(opCounters.transformNs, t0);
+        }
+        return true;
+    }
+
+    // Removes the outputs of sources that are gone since the last run and writes the
+    // root's new manifest.
+    static int finishRoot(RootState &state, unsigned long long key, const string &command)
+    {
+        int failures = 0;
+        for (size_t i = 0; i < state.seen.size(); ++i)
+        {
+            if (state.seen[i])
+                continue;
+            const string rel = state.previous.nameAt(i);
+            const string src = (fs::path(state.root) / fs::path(rel)).string();
+            std::error_code ec;
+            TreeManifest::Entry e = state.previous.at(i);
+            if (fs::exists(src, ec))
+            {
+                // Still there but not processed this time (e.g. unreadable): keep owning its output.
+                e.size = TreeManifest::kIncomplete;
+                state.next.emplace_back(rel, e);
+                continue;
+            }
+            const string out = FileCrypto::encryptedPathFor(src);
+            if (state.outputs.count(out))
+            {
+                // Another source (a.pdf for a deleted a.txt) maps to the same output.
+                cout << "skipped\t" << command << "\t" << src << "\tkept " << out
+                     << " (it is the output of another source)\n";
+                continue;
+            }
+            bool removed = fs::remove(out, ec);
+            if (ec)
+            {
+                cout << "failed\t" << command << "\t" << src << "\tCannot remove " << out << "\n";
+                ++failures;
+                state.next.emplace_back(rel, e);
+                continue;
+            }
+            fs::remove(checkpointPathFor(out), ec);
+            if (removed)
+                cout << "ok\t" << command << "\t" << src << "\tremoved " << out << "\n";
+        }
+        unsigned char salt[16];
+        randomSalt(salt);
+        if (!state.previous.write(state.root, salt, passwordCheck("SLINCR", salt, key), outputSettings(), state.next))
+        {
+            cout << "failed\t" << command << "\t" << state.root << "\tCannot write "
+                 << TreeManifest::pathFor(state.root) << "\n";
+            ++failures;
+        }
+        return failures;
+    }
+
+    // With `crc`, also returns the CRC-32C of the range's input bytes.
+    static bool transformTreeRange(const TreeFile &f, uint64_t offset, uint64_t len, vector<unsigned char> &buffer,
+                                   uint32_t *crc)
+    {
+        RawFile src;
+        RawFile dst;
+        if (!src.openRead(f.in) || !dst.openWrite(f.out, !f.split && !f.outSkip))
+            return false;
+        if (buffer.size() < blockSize)
+            buffer.resize(blockSize);
+        for (uint64_t done = 0; done < len;)
+        {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(blockSize, len - done));
+            if (!readFully(src, buffer.data(), n, f.inSkip + offset + done))
+                return false;
+            if (crc)
+                *crc = stealth::crc32c(buffer.data(), n, *crc);
+            xorBuffer(buffer.data(), n, f.cipher, offset + done);
+            if (!dst.writeAt(buffer.data(), n, f.outSkip + offset + done))
+                return false;
+            progress.add(n);
+            done += n;
+        }
+        return true;
+    }
+};
+
+// Deduplicating archive: a file is cut into content-defined chunks (FastCDC with
+// normalized chunking) and every distinct chunk is stored once, encrypted, in a
+// store directory shared by all archived versions. Each version is a manifest
+// listing its chunk identities, so an unchanged region costs nothing to archive
+// again and an edit only adds the chunks around it.
+//
+// Store layout: store.hdr (cipher, salt, password check), chunks.pack (sealed
+// chunks back to back, each encrypted at its own pack offset, so no key-stream
+// byte is used twice), chunks.idx (one ChunkRecord per chunk) and manifests/.
+class ChunkStore : public BaseCrypto
+{
+public:
+    static const uint64_t kMinChunk = 256 * 1024;
+    static const uint64_t kAvgChunk = 1024 * 1024;
+    static const uint64_t kMaxChunk = 4 * 1024 * 1024;
+
+    // Adds `filePath` to the store at `dir` (created on first use with the current
+    // --cipher; later runs keep the store's cipher) and writes its manifest to
+    // dir/manifests/<name>.<UTC time>.slm.
+    bool archive(const string &dir, const string &filePath, unsigned long long key)
+    {
+        const string file = trim(filePath);
+        RawFile src;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        uint64_t id = 0;
+        if (!src.openRead(file) || !src.identity(size, mtime, id))
+        {
+            cout << "File does not exist: " << file << "\n";
+            return false;
+        }
+        if (!open(dir, key, true))
+            return false;
+        ProgressReporter::FileScope shown(progress, file, size);
+        const bool parallel = useParallel(size);
+
+        // Window layout: 64 bytes of hash history, then `have` bytes of file data
+        // starting at file offset `filePos`. Data after the last cut is carried over.
+        const size_t window = static_cast<size_t>(std::max<uint64_t>(kWindow, 2 * kMaxChunk));
+        vector<unsigned char> buf(kHistory + window);
+        vector<ChunkId> ids;
+        vector<ChunkRecord> added;
+        uint64_t filePos = 0;
+        size_t have = 0;
+        uint64_t newBytes = 0;
+        uint64_t newChunks = 0;
+        uint64_t uncommitted = 0;
+        while (filePos + have < size || have > 0)
+        {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(window - have, size - filePos - have));
+            if (want > 0 && !readFully(src, buf.data() + kHistory + have, want, filePos + have))
+            {
+                cout << "Failed to read " << file << "\n";
+                return false;
+            }
+            have += want;
+            const bool atEnd = filePos + have == size;
+            const unsigned char *data = buf.data() + kHistory;
+
+            vector<uint64_t> candidates = findCandidates(buf.data(), have, parallel);
+            vector<Piece> pieces;
+            size_t s = 0;
+            size_t next = 0;
+            while (s < have && (atEnd || have - s >= kMaxChunk))
+            {
+                size_t end = cutPoint(candidates, next, s, have);
+                pieces.push_back(Piece{s, end - s, ChunkId(), false, {}, ChunkRecord()});
+                s = end;
+            }
+            const uint64_t before = newBytes;
+            bool ok = storePieces(data, pieces, parallel, ids, added, newBytes);
+            // Like a checkpointed encrypt, index what is stored every interval so an
+            // interrupted run keeps its chunks and the next one only adds the rest.
+            uncommitted += newBytes - before;
+            if (ok && checkpointInterval > 0 && uncommitted >= checkpointInterval)
+            {
+                ok = commit(added);
+                newChunks += added.size();
+                added.clear();
+                uncommitted = 0;
+            }
+            if (!ok)
+            {
+                cout << "Failed to write to the chunk store.\n";
+                return false;
+            }
+            progress.add(s);
+
+            // Keep the last 64 bytes before the cut as history for the next window.
+            std::memmove(buf.data(), buf.data() + s, kHistory + have - s);
+            filePos += s;
+            have -= s;
+        }
+        src.close();
+
+        string manifest;
+        if (!commit(added) || !writeManifest(dir, file, size, mtime, ids, manifest))
+        {
+            cout << "Failed to write to the chunk store.\n";
+            return false;
+        }
+        newChunks += added.size();
+        cout << "Archived " << file << ": " << ids.size() << " chunks, " << newChunks << " new (" << newBytes
+             << " bytes stored), manifest " << manifest << "\n";
+        return true;
+    }
+
+    // Rebuilds the file of a manifest from the store at `dir`. Without `outPath` the
+    // archived file name is used, in the current directory. Every chunk is checked
+    // against its identity, so damage or a foreign store cannot go unnoticed.
+    bool restore(const string &dir, const string &manifestPath, string outPath, unsigned long long key)
+    {
+        ManifestHeader mh;
+        string name;
+        vector<ChunkId> ids;
+        if (!readManifest(trim(manifestPath), mh, name, ids) || !open(dir, key, false))
+            return false;
+        if (std::memcmp(mh.storeSalt, storeSalt, sizeof(storeSalt)) != 0)
+        {
+            cout << "The manifest belongs to a different chunk store.\n";
+            return false;
+        }
+
+        vector<ChunkRecord> chunks(ids.size());
+        vector<uint64_t> at(ids.size() + 1, 0);
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            auto it = records.find(ids[i]);
+            if (it == records.end())
+            {
+                cout << "Chunk " << i << " is missing from the chunk store.\n";
+                return false;
+            }
+            chunks[i] = it->second;
+            at[i + 1] = at[i] + chunks[i].plain;
+        }
+        if (at.back() != mh.fileSize)
+        {
+            cout << "The manifest does not match the chunk store.\n";
+            return false;
+        }
+
+        if (outPath.empty())
+            outPath = basename_of(name);
+        if (!confirm_overwrite_if_exists(outPath))
+            return false;
+        RawFile dst;
+        if (!dst.openWrite(outPath, true) || !dst.resize(mh.fileSize))
+        {
+            cout << "Cannot create output: " << outPath << "\n";
+            return false;
+        }
+        ProgressReporter::FileScope shown(progress, outPath, mh.fileSize);
+        std::atomic<uint64_t> bad(UINT64_MAX);
+        vector<vector<unsigned char>> sealed(resolvedWorkerCount());
+        vector<vector<unsigned char>> plain(resolvedWorkerCount());
+        bool ok = forEachIndex(ids.size(), useParallel(mh.fileSize), [&](unsigned worker, size_t i)
+                               {
+            const ChunkRecord &r = chunks[i];
+            vector<unsigned char> &in = sealed[worker];
+            vector<unsigned char> &out = plain[worker];
+            in.resize(static_cast<size_t>(kMaxChunk));
+            out.resize(static_cast<size_t>(kMaxChunk));
+            unsigned char check[32];
+            bool good = readFully(pack, in.data(), r.stored, r.offset) && stealth::crc32c(in.data(), r.stored) == r.crc;
+            if (good)
+            {
+                xorBuffer(in.data(), r.stored, cipher, r.offset);
+                good = r.stored == r.plain ? (std::memcpy(out.data(), in.data(), r.plain), true)
+                                           : stealth::lzDecompress(in.data(), r.stored, out.data(), r.plain);
+            }
+            if (good)
+            {
+                stealth::hmacSha256(idKey, out.data(), r.plain, check);
+                good = std::memcmp(check, ids[i].b, sizeof(check)) == 0;
+            }
+            if (!good)
+            {
+                uint64_t seen = bad;
+                while (i < seen && !bad.compare_exchange_weak(seen, i))
+                {
+                }
+                return false;
+            }
+            progress.add(r.plain);
+            return dst.writeAt(out.data(), r.plain, at[i]); });
+        if (!ok)
+        {
+            if (bad != UINT64_MAX)
+                cout << "Chunk " << bad << " of the manifest is damaged in the chunk store.\n";
+            else
+                cout << "I/O error while restoring " << outPath << "\n";
+            dst.close();
+            std::error_code ec;
+            fs::remove(outPath, ec);
+            return false;
+        }
+        cout << "Restored " << outPath << " (" << mh.fileSize << " bytes, " << ids.size() << " chunks)\n";
+        return true;
+    }
+
+private:
+    static const size_t kHistory = 64; // bytes a gear hash looks back
+    static const uint64_t kWindow = 64 * 1024 * 1024;
+    // Normalized chunking: a stricter mask before the average size and a looser one
+    // after it pull chunk sizes towards kAvgChunk (2^20 bytes, so 20 ± 2 bits). The
+    // top bits are used because they depend on all 64 bytes of the hash window.
+    static const uint64_t kStrictMask = ~0ULL << (64 - 22);
+    static const uint64_t kLooseMask = ~0ULL << (64 - 18);
+
+    struct StoreHeader
+    {
+        char magic[8]; // "SLSTOR01"
+        uint32_t version; // 1
+        uint32_t cipher; // 0 = XOR, 1 = ChaCha20
+        unsigned char salt[16];
+        uint64_t keyCheck;
+        uint32_t headerCrc; // CRC-32C of the bytes before this field
+        uint32_t reserved;
+    };
+
+    struct ChunkId
+    {
+        unsigned char b[32]; // HMAC-SHA-256 of the plaintext under the store's id key
+
+        bool operator==(const ChunkId &o) const
+        {
+            return std::memcmp(b, o.b, sizeof(b)) == 0;
+        }
+    };
+
+    struct ChunkIdHash
+    {
+        size_t operator()(const ChunkId &id) const
+        {
+            uint64_t v;
+            std::memcpy(&v, id.b, sizeof(v));
+            return static_cast<size_t>(v);
+        }
+    };
+
+    // chunks.idx entry. `crc` covers the stored (sealed) bytes; stored < plain
+    // means the chunk was compressed.
+    struct ChunkRecord
+    {
+        ChunkId id;
+        uint64_t offset;
+        uint32_t stored;
+        uint32_t plain;
+        uint32_t crc;
+        uint32_t reserved;
+    };
+
+    // Manifest: this header, the file name, one ChunkId per chunk in file order and
+    // a CRC-32C of everything before it.
+    struct ManifestHeader
+    {
+        char magic[8]; // "SLMANI01"
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t fileSize;
+        int64_t mtime;
+        uint64_t chunkCount;
+        uint64_t nameLength;
+        unsigned char storeSalt[16];
+    };
+
+    // One cut of the current window. `fresh` chunks are not in the store yet.
+    struct Piece
+    {
+        size_t pos;
+        size_t len;
+        ChunkId id;
+        bool fresh;
+        vector<unsigned char> sealed;
+        ChunkRecord record;
+    };
+
+    string root;
+    CipherKey cipher = CipherKey(0ULL);
+    unsigned char idKey[32] = {};
+    unsigned char storeSalt[16] = {};
+    RawFile lockFile; // store.hdr, locked while this run writes
+    RawFile pack;
+    RawFile index;
+    uint64_t packEnd = 0;
+    uint64_t indexEnd = 0;
+    std::unordered_map<ChunkId, ChunkRecord, ChunkIdHash> records;
+
+    static uint32_t headerCrcOf(const StoreHeader &h)
+    {
+        return stealth::crc32c(reinterpret_cast<const unsigned char *>(&h), offsetof(StoreHeader, headerCrc));
+    }
+
+    // Runs fn(worker, i) for i in [0, n) on all workers when `parallel`; stops
+    // handing out indices after the first failure.
+    static bool forEachIndex(size_t n, bool parallel, const std::function<bool(unsigned, size_t)> &fn)
+    {
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&](unsigned w)
+        {
+            for (size_t i; !failed && (i = next.fetch_add(1)) < n;)
+                if (!fn(w, i))
+                    failed = true;
+        };
+        unsigned workers = parallel ? static_cast<unsigned>(std::min<size_t>(resolvedWorkerCount(), n)) : 1;
+        vector<std::thread> pool;
+        for (unsigned w = 1; w < workers; ++w)
+            pool.emplace_back(worker, w);
+        worker(0);
+        for (std::thread &t : pool)
+            t.join();
+        return !failed;
+    }
+
+    // Opens (or, with `create`, initializes) the store and loads its chunk index.
+    // Index records past the end of the pack are left over from an interrupted run
+    // and are dropped; the next run overwrites them.
+    bool open(const string &dir, unsigned long long key, bool create)
+    {
+        root = trim(dir);
+        const string headerPath = (fs::path(root) / "store.hdr").string();
+        StoreHeader h = {};
+        if (!fs::exists(headerPath))
+        {
+            std::error_code ec;
+            if (!create || (!fs::create_directories(fs::path(root) / "manifests", ec) && ec))
+            {
+                cout << "Chunk store not found: " << root << "\n";
+                return false;
+            }
+            std::memcpy(h.magic, "SLSTOR01", 8);
+            h.version = 1;
+            if (cipherMode == CipherMode::ChaCha20)
+            {
+                CipherHeader ch;
+                newCipherHeader(ch);
+                h.cipher = 1;
+                std::memcpy(h.salt, ch.salt, sizeof(h.salt));
+                h.keyCheck = ch.check;
+            }
+            else
+            {
+                randomSalt(h.salt);
+                h.keyCheck = passwordCheck("SLSTORE", h.salt, key);
+            }
+            h.headerCrc = headerCrcOf(h);
+            RawFile out;
+            if (!out.openWrite(headerPath, true) || !out.writeAt(&h, sizeof(h), 0) || !out.sync())
+            {
+                cout << "Cannot create chunk store: " << root << "\n";
+                return false;
+            }
+        }
+
+        // A writer holds the header locked until it is done, so two store-file
+        // runs cannot append to the pack and index at the same time.
+        if (!(create ? lockFile.openWrite(headerPath, false) : lockFile.openRead(headerPath)) ||
+            !readFully(lockFile, reinterpret_cast<unsigned char *>(&h), sizeof(h), 0) ||
+            std::memcmp(h.magic, "SLSTOR01", 8) != 0 || h.version != 1 ||
+            h.headerCrc != headerCrcOf(h))
+        {
+            cout << "Chunk store header is damaged or of an unknown version: " << headerPath << "\n";
+            return false;
+        }
+        if (create && !lockFile.lock(false))
+        {
+            cout << "Chunk store is in use by another store-file run: " << root << "\n";
+            return false;
+        }
+        uint64_t check = passwordCheck("SLSTORE", h.salt, key);
+        cipher = CipherKey(key);
+        if (h.cipher == 1)
+        {
+            cipher = CipherKey(stealth::chachaSubKey(chachaMaster, h.salt, check));
+        }
+        if (check != h.keyCheck)
+        {
+            cout << "The password does not match this chunk store.\n";
+            return false;
+        }
+        std::memcpy(storeSalt, h.salt, sizeof(storeSalt));
+
+        // Chunk identities are keyed, so the index reveals nothing about content to
+        // someone without the password.
+        passwordMac("SLSTORE-ID", h.salt, key, idKey);
+
+        const string packPath = (fs::path(root) / "chunks.pack").string();
+        const string indexPath = (fs::path(root) / "chunks.idx").string();
+        bool opened = create ? pack.openWrite(packPath, false) && index.openWrite(indexPath, false)
+                             : pack.openRead(packPath) && index.openRead(indexPath);
+        if (!opened)
+        {
+            cout << "Cannot open the chunk store files in " << root << "\n";
+            return false;
+        }
+        packEnd = filesize_bytes(packPath);
+        const uint64_t count = filesize_bytes(indexPath) / sizeof(ChunkRecord);
+        vector<ChunkRecord> all(static_cast<size_t>(count));
+        if (!readFully(index, reinterpret_cast<unsigned char *>(all.data()), all.size() * sizeof(ChunkRecord), 0))
+        {
+            cout << "Cannot read the chunk index in " << root << "\n";
+            return false;
+        }
+        records.clear();
+        records.reserve(all.size());
+        indexEnd = 0;
+        for (const ChunkRecord &r : all)
+        {
+            if (r.stored > r.plain || r.plain > kMaxChunk || r.offset + r.stored > packEnd)
+                break;
+            records.emplace(r.id, r);
+            indexEnd += sizeof(ChunkRecord);
+        }
+        return true;
+    }
+
+    // Gear-hash cut candidates of data[0, have) (data starts after the history),
+    // scanned in parallel slices that are concatenated in order.
+    static vector<uint64_t> findCandidates(const unsigned char *buf, size_t have, bool parallel)
+    {
+        const size_t kSlice = 8 * 1024 * 1024;
+        const size_t slices = (have + kSlice - 1) / kSlice;
+        vector<vector<uint64_t>> found(slices);
+        forEachIndex(slices, parallel, [&](unsigned, size_t i)
+                     {
+            size_t begin = kHistory + i * kSlice;
+            stealth::gearCandidates(buf, begin, std::min(begin + kSlice, kHistory + have), kLooseMask, kStrictMask,
+                                    found[i]);
+            return true; });
+        vector<uint64_t> all;
+        for (const vector<uint64_t> &f : found)
+            for (uint64_t c : f)
+                all.push_back(((c >> 1) - kHistory) << 1 | (c & 1));
+        return all;
+    }
+
+    // End of the chunk starting at `s`: the first strict candidate between
+    // kMinChunk and kAvgChunk, else the first loose one up to kMaxChunk, else
+    // kMaxChunk (or the end of the data). `next` walks the sorted candidates.
+    static size_t cutPoint(const vector<uint64_t> &candidates, size_t &next, size_t s, size_t have)
+    {
+        const size_t limit = static_cast<size_t>(std::min<uint64_t>(have, s + kMaxChunk));
+        if (limit - s <= kMinChunk)
+            return limit;
+        while (next < candidates.size() && (candidates[next] >> 1) + 1 < s + kMinChunk)
+            ++next;
+        size_t loose = limit;
+        for (size_t k = next; k < candidates.size(); ++k)
+        {
+            size_t end = static_cast<size_t>(candidates[k] >> 1) + 1;
+            if (end > limit)
+                break;
+            if (end - s < kAvgChunk)
+            {
+                if (candidates[k] & 1)
+                    return end;
+            }
+            else
+            {
+                loose = std::min(loose, end);
+                break;
+            }
+        }
+        return loose;
+    }
+
+    // Identifies the window's chunks, then seals the ones the store does not have
+    // yet (compressed with --compress) and appends them to the pack in file order.
+    bool storePieces(const unsigned char *data, vector<Piece> &pieces, bool parallel, vector<ChunkId> &ids,
+                     vector<ChunkRecord> &added, uint64_t &newBytes)
+    {
+        forEachIndex(pieces.size(), parallel, [&](unsigned, size_t i)
+                     {
+            auto t0 = op_clock();
+            stealth::hmacSha256(idKey, data + pieces[i].pos, pieces[i].len, pieces[i].id.b);
+            add_op_time(opCounters.transformNs, t0);
+            return true; });
+
+        vector<size_t> fresh;
+        for (size_t i = 0; i < pieces.size(); ++i)
+        {
+            ids.push_back(pieces[i].id);
+            if (records.emplace(pieces[i].id, ChunkRecord()).second)
+                fresh.push_back(i);
+        }
+        forEachIndex(fresh.size(), parallel, [&](unsigned, size_t k)
+                     {
+            Piece &p = pieces[fresh[k]];
+            p.sealed.resize(std::max(p.len, stealth::lzCompressBound(p.len)));
+            size_t packed = 0;
+            if (compressOutput)
+            {
+                auto t0 = op_clock();
+                packed = stealth::lzCompress(data + p.pos, p.len, p.sealed.data(), p.len - 1);
+                add_op_time(opCounters.transformNs, t0);
+            }
+            if (packed == 0)
+                std::memcpy(p.sealed.data(), data + p.pos, p.len);
+            p.sealed.resize(packed ? packed : p.len);
+            return true; });
+
+        for (size_t i : fresh)
+        {
+            Piece &p = pieces[i];
+            p.record.id = p.id;
+            p.record.offset = packEnd;
+            p.record.stored = static_cast<uint32_t>(p.sealed.size());
+            p.record.plain = static_cast<uint32_t>(p.len);
+            packEnd += p.sealed.size();
+            newBytes += p.sealed.size();
+        }
+        bool ok = forEachIndex(fresh.size(), parallel, [&](unsigned, size_t k)
+                               {
+            Piece &p = pieces[fresh[k]];
+            xorBuffer(p.sealed.data(), p.sealed.size(), cipher, p.record.offset);
+            p.record.crc = stealth::crc32c(p.sealed.data(), p.sealed.size());
+            bool good = pack.writeAt(p.sealed.data(), p.sealed.size(), p.record.offset);
+            vector<unsigned char>().swap(p.sealed);
+            return good; });
+        for (size_t i : fresh)
+        {
+            records[pieces[i].id] = pieces[i].record;
+            added.push_back(pieces[i].record);
+        }
+        return ok;
+    }
+
+    // Makes the new chunks durable before they are indexed, and the index durable
+    // before a manifest refers to it.
+    bool commit(const vector<ChunkRecord> &added)
+    {
+        if (added.empty())
+            return true;
+        if (!pack.sync() || !index.writeAt(added.data(), added.size() * sizeof(ChunkRecord), indexEnd) ||
+            !index.sync())
+            return false;
+        indexEnd += added.size() * sizeof(ChunkRecord);
+        return true;
+    }
+
+    bool writeManifest(const string &dir, const string &file, uint64_t size, int64_t mtime,
+                       const vector<ChunkId> &ids, string &path)
+    {
+        const string name = basename_of(file);
+        ManifestHeader mh = {};
+        std::memcpy(mh.magic, "SLMANI01", 8);
+        mh.version = 1;
+        mh.fileSize = size;
+        mh.mtime = mtime;
+        mh.chunkCount = ids.size();
+        mh.nameLength = name.size();
+        std::memcpy(mh.storeSalt, storeSalt, sizeof(storeSalt));
+        uint32_t crc = stealth::crc32c(reinterpret_cast<const unsigned char *>(&mh), sizeof(mh));
+        crc = stealth::crc32c(reinterpret_cast<const unsigned char *>(name.data()), name.size(), crc);
+        crc = stealth::crc32c(reinterpret_cast<const unsigned char *>(ids.data()), ids.size() * sizeof(ChunkId), crc);
+
+        char stamp[32];
+        std::time_t now = std::time(nullptr);
+        std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", std::gmtime(&now));
+        const fs::path base = fs::path(trim(dir)) / "manifests";
+        std::error_code ec;
+        fs::create_directories(base, ec);
+        path = (base / (name + "." + stamp + ".slm")).string();
+        for (int n = 2; fs::exists(path); ++n)
+            path = (base / (name + "." + stamp + "-" + std::to_string(n) + ".slm")).string();
+
+        const string tmp = path + ".tmp";
+        RawFile out;
+        vector<RawFile::Piece> parts = {{&mh, sizeof(mh)},
+                                        {name.data(), name.size()},
+                                        {ids.data(), ids.size() * sizeof(ChunkId)},
+                                        {&crc, sizeof(crc)}};
+        if (!out.openWrite(tmp, true) || !out.writeGatherAt(parts, 0) || !out.sync())
+        {
+            fs::remove(tmp, ec);
+            return false;
+        }
+        out.close();
+        fs::rename(tmp, path, ec);
+        return !ec;
+    }
+
+    static bool readManifest(const string &path, ManifestHeader &mh, string &name, vector<ChunkId> &ids)
+    {
+        const uint64_t size = filesize_bytes(path);
+        vector<unsigned char> all(static_cast<size_t>(size));
+        RawFile in;
+        if (!in.openRead(path) || !readFully(in, all.data(), all.size(), 0))
+        {
+            cout << "Manifest does not exist: " << path << "\n";
+            return false;
+        }
+        uint32_t crc = 0;
+        bool ok = size >= sizeof(mh) + sizeof(crc);
+        if (ok)
+        {
+            std::memcpy(&mh, all.data(), sizeof(mh));
+            std::memcpy(&crc, all.data() + size - sizeof(crc), sizeof(crc));
+            ok = std::memcmp(mh.magic, "SLMANI01", 8) == 0 && mh.version == 1 &&
+                 mh.nameLength < size && mh.chunkCount < size / sizeof(ChunkId) &&
+                 size == sizeof(mh) + mh.nameLength + mh.chunkCount * sizeof(ChunkId) + sizeof(crc) &&
+                 stealth::crc32c(all.data(), static_cast<size_t>(size - sizeof(crc))) == crc;
+        }
+        if (!ok)
+        {
+            cout << "Not a manifest, or the manifest is damaged: " << path << "\n";
+            return false;
+        }
+        name.assign(reinterpret_cast<const char *>(all.data() + sizeof(mh)), static_cast<size_t>(mh.nameLength));
+        ids.resize(static_cast<size_t>(mh.chunkCount));
+        std::memcpy(ids.data(), all.data() + sizeof(mh) + mh.nameLength, ids.size() * sizeof(ChunkId));
+        return true;
+    }
+};
+
+// Original bit-at-a-time codec, kept as the reference for --selfcheck and --bench-base64.
+static string base64EncodeLegacy(const vector<unsigned char> &data)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    string encoded;
+    int val = 0, valb = -6;
+    for (unsigned char c : data)
+    {
+        val = (val << 8) + c;
+        valb += 8;
+        while (valb >= 0)
+        {
+            encoded.push_back(table[(val >> valb) & 0x3F]);
+            valb -= 6;
+        }
+    }
+    if (valb > -6)
+        encoded.push_back(table[((val << 8) >> (valb + 8)) & 0x3F]);
+    while (encoded.size() % 4)
+        encoded.push_back('=');
+    return encoded;
+}
+
+static vector<unsigned char> base64DecodeLegacy(const string &s)
+{
+    static const int T[256] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, 64, -1, -1,
+        -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+        -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51};
+
+    vector<unsigned char> out;
+    int val = 0, valb = -8;
+    for (unsigned char c : s)
+    {
+        if (T[c] == -1)
+            break;
+        if (T[c] == 64)
+            break;
+        val = (val << 6) + T[c];
+        valb += 6;
+        if (valb >= 0)
+        {
+            out.push_back((val >> valb) & 0xFF);
+            valb -= 8;
+        }
+    }
+    return out;
+}
+
+// Base64 block kernels. encode consumes whole 3-byte groups and decode whole 4-char
+// groups of plain alphabet characters; both return how much input they consumed and
+// leave anything else (tails, whitespace, padding, errors) to the scalar codec.
+struct Base64Kernels
+{
+    const char *name;
+    size_t (*encode)(const unsigned char *in, size_t n, char *out);
+    size_t (*decode)(const char *in, size_t n, unsigned char *out, size_t &produced);
+};
+
+static const signed char base64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -2, -2, -1, -1, -2, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -3, -1, -1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}; // -2 whitespace, -3 '='
+
+static size_t base64EncodeScalar(const unsigned char *in, size_t n, char *out)
+{
+    size_t i = 0;
+    for (; i + 3 <= n; i += 3)
+    {
+        uint32_t v = (uint32_t(in[i]) << 16) | (uint32_t(in[i + 1]) << 8) | in[i + 2];
+        *out++ = base64_chars[(v >> 18) & 0x3F];
+        *out++ = base64_chars[(v >> 12) & 0x3F];
+        *out++ = base64_chars[(v >> 6) & 0x3F];
+        *out++ = base64_chars[v & 0x3F];
+    }
+    return i;
+}
+
+static size_t base64DecodeScalar(const char *in, size_t n, unsigned char *out, size_t &produced)
+{
+    size_t i = 0;
+    produced = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        int a = base64_values[static_cast<unsigned char>(in[i])];
+        int b = base64_values[static_cast<unsigned char>(in[i + 1])];
+        int c = base64_values[static_cast<unsigned char>(in[i + 2])];
+        int d = base64_values[static_cast<unsigned char>(in[i + 3])];
+        if ((a | b | c | d) < 0)
+            break;
+        uint32_t v = (uint32_t(a) << 18) | (uint32_t(b) << 12) | (uint32_t(c) << 6) | uint32_t(d);
+        out[produced++] = static_cast<unsigned char>(v >> 16);
+        out[produced++] = static_cast<unsigned char>(v >> 8);
+        out[produced++] = static_cast<unsigned char>(v);
+    }
+    return i;
+}
+
+#ifdef STEALTH_X86_SIMD
+// Lookup-by-shuffle kernels after Mula and Lemire: split 3 bytes into four 6-bit
+// indices with multiplies, then map indices to ASCII (and back) with pshufb tables.
+__attribute__((target("ssse3"))) static __m128i base64EncodeLanes128(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+    __m128i reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    reduced = _mm_or_si128(reduced, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, reduced), indices);
+}
+
+__attribute__((target("ssse3"))) static size_t base64EncodeSsse3(const unsigned char *in, size_t n, char *out)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 12, out += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), base64EncodeLanes128(v));
+    }
+    return i + base64EncodeScalar(in + i, n - i, out);
+}
+
+// Returns false if any of the 16 characters is outside the plain alphabet.
+__attribute__((target("ssse3"))) static bool base64DecodeLanes128(__m128i in, __m128i &packed)
+{
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                        0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                        0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+    const __m128i loNibbles = _mm_and_si128(in, nibble);
+    const __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+    const __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+        return false;
+    const __m128i eqSlash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    const __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eqSlash, hiNibbles));
+    const __m128i values = _mm_add_epi8(in, roll);
+    const __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i words = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    packed = _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+// Each block stores 16 bytes of which 12 are valid, so a block only runs while at
+// least 8 more input characters follow (see Base64Decoder::capacityFor).
+__attribute__((target("ssse3"))) static size_t base64DecodeSsse3(const char *in, size_t n, unsigned char *out,
+                                                                  size_t &produced)
+{
+    size_t i = 0;
+    produced = 0;
+    __m128i packed;
+    for (; i + 24 <= n; i += 16, produced += 12)
+    {
+        if (!base64DecodeLanes128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), packed))
+            break;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + produced), packed);
+    }
+    size_t tail = 0;
+    i += base64DecodeScalar(in + i, n - i, out + produced, tail);
+    produced += tail;
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t base64EncodeAvx2(const unsigned char *in, size_t n, char *out)
+{
+    const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                         10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    for (; i + 28 <= n; i += 24, out += 32)
+    {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 12));
+        __m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuf);
+        const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+        __m256i reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        reduced = _mm256_or_si256(reduced, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        __m256i chars = _mm256_add_epi8(_mm256_shuffle_epi8(shift, reduced), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), chars);
+    }
+    return i + base64EncodeSsse3(in + i, n - i, out);
+}
+
+__attribute__((target("avx2"))) static size_t base64DecodeAvx2(const char *in, size_t n, unsigned char *out,
+                                                                size_t &produced)
+{
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                           0x1B, 0x1B, 0x1B, 0x1A, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    produced = 0;
+    for (; i + 44 <= n; i += 32, produced += 24)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        const __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble);
+        const __m256i lo = _mm256_shuffle_epi8(lutLo, _mm256_and_si256(v, nibble));
+        const __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+        const __m256i eqSlash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+        const __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eqSlash, hiNibbles));
+        const __m256i values = _mm256_add_epi8(v, roll);
+        const __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        const __m256i words = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        const __m256i lanes = _mm256_shuffle_epi8(words, pack);
+        const __m256i packed = _mm256_permutevar8x32_epi32(lanes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + produced), packed);
+    }
+    size_t tail = 0;
+    i += base64DecodeSsse3(in + i, n - i, out + produced, tail);
+    produced += tail;
+    return i;
+}
+#endif
+
+static vector<Base64Kernels> availableBase64Kernels()
+{
+    vector<Base64Kernels> kernels;
+    kernels.push_back({"scalar", base64EncodeScalar, base64DecodeScalar});
+#ifdef STEALTH_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        kernels.push_back({"ssse3", base64EncodeSsse3, base64DecodeSsse3});
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", base64EncodeAvx2, base64DecodeAvx2});
+#endif
+    return kernels;
+}
+
+static const Base64Kernels &activeBase64Kernels()
+{
+    static const Base64Kernels kernels = availableBase64Kernels().back();
+    return kernels;
+}
+
+// Incremental Base64 encoder. Input may be fed in chunks of any size; output goes
+// to caller-provided buffers of at least capacityFor(n) bytes per call.
+class Base64Encoder
+{
+public:
+    explicit Base64Encoder(const Base64Kernels &kernels = activeBase64Kernels()) : k(kernels) {}
+
+    static size_t capacityFor(size_t n)
+    {
+        return (n + 2) / 3 * 4 + 4;
+    }
+
+    size_t update(const unsigned char *in, size_t n, char *out)
+    {
+        size_t written = 0;
+        while (npend > 0 && npend < 3 && n > 0)
+        {
+            pending[npend++] = *in++;
+            --n;
+        }
+        if (npend == 3)
+        {
+            base64EncodeScalar(pending, 3, out);
+            written = 4;
+            npend = 0;
+        }
+        size_t used = k.encode(in, n, out + written);
+        written += used / 3 * 4;
+        for (size_t i = used; i < n; ++i)
+            pending[npend++] = in[i];
+        return written;
+    }
+
+    // Flushes the last one or two bytes with '=' padding; writes at most 4 chars.
+    size_t finish(char *out)
+    {
+        if (npend == 0)
+            return 0;
+        uint32_t v = uint32_t(pending[0]) << 16;
+        if (npend == 2)
+            v |= uint32_t(pending[1]) << 8;
+        out[0] = base64_chars[(v >> 18) & 0x3F];
+        out[1] = base64_chars[(v >> 12) & 0x3F];
+        out[2] = npend == 2 ? base64_chars[(v >> 6) & 0x3F] : '=';
+        out[3] = '=';
+        npend = 0;
+        return 4;
+    }
+
+private:
+    const Base64Kernels &k;
+    unsigned char pending[3] = {0, 0, 0};
+    size_t npend = 0;
+};
+
+// Incremental Base64 decoder. Optionally skips whitespace (e.g. line breaks); stops
+// at padding, and at the first other non-alphabet character, which marks it failed.
+class Base64Decoder
+{
+public:
+    explicit Base64Decoder(bool skipWhitespace = true, const Base64Kernels &kernels = activeBase64Kernels())
+        : skipSpace(skipWhitespace), k(kernels) {}
+
+    static size_t capacityFor(size_t n)
+    {
+        return (n / 4 + 1) * 3;
+    }
+
+    size_t update(const char *in, size_t n, unsigned char *out)
+    {
+        size_t written = 0;
+        size_t i = 0;
+        while (i < n && !done)
+        {
+            if (npend == 0)
+            {
+                size_t produced = 0;
+                i += k.decode(in + i, n - i, out + written, produced);
+                written += produced;
+                if (i >= n)
+                    break;
+            }
+            int v = base64_values[static_cast<unsigned char>(in[i++])];
+            if (v >= 0)
+            {
+                quad[npend++] = static_cast<unsigned char>(v);
+                if (npend == 4)
+                {
+                    written += flushQuad(out + written);
+                    npend = 0;
+                }
+            }
+            else if (v == -3)
+            {
+                done = true;
+            }
+            else if (v != -2 || !skipSpace)
+            {
+                done = true;
+                bad = true;
+            }
+        }
+        return written;
+    }
+
+    // Emits the bytes of a trailing partial group (unpadded input); at most 2 bytes.
+    size_t finish(unsigned char *out)
+    {
+        size_t written = npend >= 2 ? flushQuad(out, npend - 1) : 0;
+        npend = 0;
+        return written;
+    }
+
+    bool failed() const
+    {
+        return bad;
+    }
+
+private:
+    size_t flushQuad(unsigned char *out, size_t bytes = 3)
+    {
+        uint32_t v = (uint32_t(quad[0]) << 18) | (uint32_t(quad[1]) << 12) | (uint32_t(quad[2]) << 6) | quad[3];
+        for (size_t b = 0; b < bytes; ++b)
+            out[b] = static_cast<unsigned char>(v >> (16 - 8 * b));
+        return bytes;
+    }
+
+    bool skipSpace;
+    const Base64Kernels &k;
+    unsigned char quad[4] = {0, 0, 0, 0};
+    size_t npend = 0;
+    bool done = false;
+    bool bad = false;
+};
+
+string base64Encode(const vector<unsigned char> &data)
+{
+    Base64Encoder enc;
+    string encoded(Base64Encoder::capacityFor(data.size()), '\0');
+    size_t n = enc.update(data.data(), data.size(), &encoded[0]);
+    n += enc.finish(&encoded[n]);
+    encoded.resize(n);
+    return encoded;
+}
+
+// Returns false (with `out` holding what preceded the bad character) if `s` is
+// not valid Base64.
+bool base64Decode(const string &s, vector<unsigned char> &out)
+{
+    Base64Decoder dec;
+    out.resize(Base64Decoder::capacityFor(s.size()));
+    size_t n = dec.update(s.data(), s.size(), out.data());
+    n += dec.finish(out.data() + n);
+    out.resize(n);
+    return !dec.failed();
+}
+
+// Compares every Base64 kernel with the original codec on random data, random chunk
+// boundaries and line-wrapped input.
+static bool selfCheckBase64(int rounds = 200)
+{
+    std::mt19937_64 rng(std::random_device{}());
+    bool ok = true;
+    for (const Base64Kernels &k : availableBase64Kernels())
+    {
+        bool kernelOk = true;
+        for (int r = 0; r < rounds && kernelOk; ++r)
+        {
+            vector<unsigned char> data(static_cast<size_t>(rng() % 3000));
+            for (unsigned char &b : data)
+                b = static_cast<unsigned char>(rng());
+            string expected = base64EncodeLegacy(data);
+
+            Base64Encoder enc(k);
+            string encoded;
+            size_t at = 0;
+            while (at < data.size())
+            {
+                size_t n = std::min<size_t>(data.size() - at, 1 + rng() % 200);
+                string buf(Base64Encoder::capacityFor(n), '\0');
+                encoded.append(buf, 0, enc.update(data.data() + at, n, &buf[0]));
+                at += n;
+            }
+            char tail[4];
+            encoded.append(tail, enc.finish(tail));
+            kernelOk = encoded == expected;
+
+            string wrapped;
+            for (size_t i = 0; i < encoded.size(); i += 76)
+                wrapped += encoded.substr(i, 76) + "\r\n";
+            Base64Decoder dec(true, k);
+            vector<unsigned char> decoded;
+            at = 0;
+            while (at < wrapped.size())
+            {
+                size_t n = std::min<size_t>(wrapped.size() - at, 1 + rng() % 300);
+                vector<unsigned char> buf(Base64Decoder::capacityFor(n));
+                size_t got = dec.update(wrapped.data() + at, n, buf.data());
+                decoded.insert(decoded.end(), buf.begin(), buf.begin() + static_cast<std::ptrdiff_t>(got));
+                at += n;
+            }
+            unsigned char rest[3];
+            size_t got = dec.finish(rest);
+            decoded.insert(decoded.end(), rest, rest + got);
+            kernelOk = kernelOk && !dec.failed() && decoded == data && base64DecodeLegacy(encoded) == data;
+        }
+        cout << "Base64 kernel " << std::left << std::setw(8) << k.name << std::right
+             << (kernelOk ? "ok" : "MISMATCH") << "\n";
+        ok = ok && kernelOk;
+    }
+    return ok;
+}
+
+// Prints encode/decode throughput of the original functions and of every kernel.
+static void benchBase64(size_t mib)
+{
+    vector<unsigned char> data(mib * 1024 * 1024);
+    std::mt19937_64 rng(42);
+    for (unsigned char &b : data)
+        b = static_cast<unsigned char>(rng());
+    const string encoded = base64EncodeLegacy(data);
+    const double mb = static_cast<double>(data.size()) / (1024.0 * 1024.0);
+
+    auto report = [&](const string &name, double encSec, double decSec)
+    {
+        cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+             << " encode " << std::setw(8) << mb / encSec << " MB/s   decode " << std::setw(8) << mb / decSec
+             << " MB/s\n";
+        cout.unsetf(std::ios::floatfield);
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    string e = base64EncodeLegacy(data);
+    double encSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    t0 = std::chrono::steady_clock::now();
+    vector<unsigned char> d = base64DecodeLegacy(encoded);
+    double decSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    report("legacy", encSec, decSec);
+
+    string outChars(Base64Encoder::capacityFor(data.size()), '\0');
+    vector<unsigned char> outBytes(Base64Decoder::capacityFor(encoded.size()));
+    for (const Base64Kernels &k : availableBase64Kernels())
+    {
+        t0 = std::chrono::steady_clock::now();
+        Base64Encoder enc(k);
+        size_t n = enc.update(data.data(), data.size(), &outChars[0]);
+        enc.finish(&outChars[n]);
+        encSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        t0 = std::chrono::steady_clock::now();
+        Base64Decoder dec(true, k);
+        n = dec.update(encoded.data(), encoded.size(), outBytes.data());
+        dec.finish(outBytes.data() + n);
+        decSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        report(k.name, encSec, decSec);
+    }
+}
+
+class TextCrypto : public BaseCrypto
+{
+public:
+    TextCrypto() = default;
+
+    bool encryptInput(const string &input, unsigned long long key, bool isFile)
+    {
+        if (isFile)
+            return encryptFile(input, key);
+
+        vector<unsigned char> encrypted;
+        CipherKey cipher(key);
+        if (cipherMode == CipherMode::ChaCha20)
+        {
+            CipherHeader header;
+            cipher = newCipherHeader(header);
+            const unsigned char *h = reinterpret_cast<const unsigned char *>(&header);
+            encrypted.assign(h, h + sizeof(header));
+        }
+        size_t start = encrypted.size();
+        encrypted.insert(encrypted.end(), input.begin(), input.end());
+        xorBuffer(encrypted.data() + start, input.size(), cipher, 0);
+        string encoded = base64Encode(encrypted);
+
+        cout << "Encrypted text (Base64): " << encoded << "\n";
+        return true;
+    }
+
+    bool decryptInput(const string &input, unsigned long long key, bool isFile)
+    {
+        if (isFile)
+            return decryptFile(input, key);
+
+        vector<unsigned char> encrypted;
+        if (!base64Decode(input, encrypted))
+        {
+            cout << "Input is not valid Base64.\n";
+            return false;
+        }
+        CipherKey cipher(key);
+        size_t start = 0;
+        switch (parseCipherHeader(encrypted.data(), encrypted.size(), cipher))
+        {
+        case HeaderState::WrongPassword:
+            reportWrongPassword();
+            return false;
+        case HeaderState::Valid:
+            start = sizeof(CipherHeader);
+            break;
+        case HeaderState::None:
+            break;
+        }
+        xorBuffer(encrypted.data() + start, encrypted.size() - start, cipher, 0);
+        string decrypted(encrypted.begin() + static_cast<std::ptrdiff_t>(start), encrypted.end());
+
+        cout << "Decrypted text: " << decrypted << "\n";
+        return true;
+    }
+
+    // Streams a text file through XOR and Base64 into <file>_enc.txt in blockSize
+    // chunks, so memory use does not depend on the file size.
+    bool encryptFile(const string &input, unsigned long long key)
+    {
+        string filePath = trim(input);
+        if (!fs::exists(filePath))
+        {
+            cout << "Text file does not exist: " << filePath << "\n";
+            return false;
+        }
+        string outPath = filePath + "_enc.txt";
+        if (!confirm_overwrite_if_exists(outPath))
+        {
+            cout << "Skipping encrypt for: " << filePath << "\n";
+            return false;
+        }
+        ifstream fin(filePath, ios::binary);
+        ofstream fout(outPath, ios::binary);
+        if (!fin || !fout)
+        {
+            cout << "Failed to open text file.\n";
+            return false;
+        }
+
+        ProgressReporter::FileScope shown(progress, basename_of(outPath), filesize_bytes(filePath));
+        uint64_t processed = 0;
+        vector<unsigned char> chunk(blockSize);
+        string encoded(Base64Encoder::capacityFor(chunk.size()), '\0');
+        Base64Encoder enc;
+        CipherKey cipher(key);
+        if (cipherMode == CipherMode::ChaCha20)
+        {
+            CipherHeader header;
+            cipher = newCipherHeader(header);
+            size_t n = enc.update(reinterpret_cast<const unsigned char *>(&header), sizeof(header), &encoded[0]);
+            fout.write(encoded.data(), static_cast<std::streamsize>(n));
+        }
+        while (fin)
+        {
+            auto t0 = op_clock();
+            fin.read(reinterpret_cast<char *>(chunk.data()), static_cast<std::streamsize>(chunk.size()));
+            size_t got = static_cast<size_t>(fin.gcount());
+            count_io(false, got, t0);
+            if (got == 0)
+                break;
+            ++opCounters.refills;
+            xorBuffer(chunk.data(), got, cipher, processed);
+            t0 = op_clock();
+            size_t n = enc.update(chunk.data(), got, &encoded[0]);
+            add_op_time(opCounters.transformNs, t0);
+            t0 = op_clock();
+            fout.write(encoded.data(), static_cast<std::streamsize>(n));
+            count_io(true, n, t0);
+            processed += got;
+            progress.add(got);
+        }
+        fout.write(encoded.data(), static_cast<std::streamsize>(enc.finish(&encoded[0])));
+        fout.close();
+        if (!fout)
+        {
+            cout << "Failed to write encrypted text file.\n";
+            return false;
+        }
+        cout << "\nEncrypted text saved to: " << outPath << "\n";
+        return true;
+    }
+
+    // Reverse of encryptFile: decodes Base64 (line breaks allowed) chunk by chunk
+    // and writes the plaintext to <file>_dec.txt.
+    bool decryptFile(const string &input, unsigned long long key)
+    {
+        string filePath = trim(input);
+        if (!fs::exists(filePath))
+        {
+            cout << "Encrypted text file does not exist: " << filePath << "\n";
+            return false;
+        }
+        string outPath = filePath + "_dec.txt";
+        if (!confirm_overwrite_if_exists(outPath))
+        {
+            cout << "Skipping decrypt for: " << filePath << "\n";
+            return false;
+        }
+        ifstream fin(filePath, ios::binary);
+        ofstream fout(outPath, ios::binary);
+        if (!fin || !fout)
+        {
+            cout << "Failed to open encrypted text file.\n";
+            return false;
+        }
+
+        ProgressReporter::FileScope shown(progress, basename_of(outPath), filesize_bytes(filePath));
+        uint64_t produced = 0;
+        string chunk(blockSize, '\0');
+        vector<unsigned char> decoded(Base64Decoder::capacityFor(chunk.size()));
+        Base64Decoder dec(true);
+
+        // The first sizeof(CipherHeader) decoded bytes decide the cipher, so they are
+        // held back until that many have arrived (or the input ends).
+        vector<unsigned char> head;
+        bool decided = false;
+        bool wrongPassword = false;
+        CipherKey cipher(key);
+        auto put = [&](unsigned char *p, size_t n)
+        {
+            xorBuffer(p, n, cipher, produced);
+            auto t0 = op_clock();
+            fout.write(reinterpret_cast<const char *>(p), static_cast<std::streamsize>(n));
+            count_io(true, n, t0);
+            produced += n;
+        };
+        auto emit = [&](unsigned char *p, size_t n, bool last)
+        {
+            if (!decided)
+            {
+                size_t take = std::min(n, sizeof(CipherHeader) - head.size());
+                head.insert(head.end(), p, p + take);
+                p += take;
+                n -= take;
+                if (head.size() < sizeof(CipherHeader) && !last)
+                    return;
+                decided = true;
+                HeaderState state = parseCipherHeader(head.data(), head.size(), cipher);
+                wrongPassword = state == HeaderState::WrongPassword;
+                if (state == HeaderState::None)
+                    put(head.data(), head.size());
+            }
+            if (!wrongPassword)
+                put(p, n);
+        };
+        while (fin && !dec.failed() && !wrongPassword)
+        {
+            auto t0 = op_clock();
+            fin.read(&chunk[0], static_cast<std::streamsize>(chunk.size()));
+            size_t got = static_cast<size_t>(fin.gcount());
+            count_io(false, got, t0);
+            if (got == 0)
+                break;
+            ++opCounters.refills;
+            t0 = op_clock();
+            size_t n = dec.update(chunk.data(), got, decoded.data());
+            add_op_time(opCounters.transformNs, t0);
+            emit(decoded.data(), n, false);
+            progress.add(got);
+        }
+        emit(decoded.data(), dec.finish(decoded.data()), true);
+        fout.close();
+        if (wrongPassword)
+        {
+            reportWrongPassword();
+            std::error_code ec;
+            fs::remove(outPath, ec);
+            return false;
+        }
+        if (dec.failed() || !fout)
+        {
+            cout << "\nInput is not valid Base64; partial output removed.\n";
+            std::error_code ec;
+            fs::remove(outPath, ec);
+            return false;
+        }
+        cout << "\nDecrypted text saved to: " << outPath << "\n";
+        return true;
+    }
+};
+
+class Stego : public BaseCrypto
+{
+private:
+    // Format 2 appends this fixed-size trailer after the payload so retrieval can find
+    // everything from the end of the file. The STEGOSTR header before the payload is
+    // unchanged, so format 1 readers that know the cover size still work.
+    struct StegoTrailer
+    {
+        uint64_t payloadOffset;
+        uint64_t payloadLength;
+        uint64_t nameLength;
+        char magic[8];
+    };
+
+    static bool readTrailer(const string &path, StegoTrailer &t, const char *magic = "STEGOTR2")
+    {
+        uint64_t fileLen = filesize_bytes(path);
+        RawFile fin;
+        if (fileLen < sizeof(t) || !fin.openRead(path) ||
+            fin.readAt(&t, sizeof(t), fileLen - sizeof(t)) != static_cast<long long>(sizeof(t)))
+            return false;
+        return std::memcmp(t.magic, magic, 8) == 0 && t.nameLength <= t.payloadOffset &&
+               t.payloadOffset <= fileLen - sizeof(t) &&
+               t.payloadLength == fileLen - sizeof(t) - t.payloadOffset;
+    }
+
+    // Archive (format 3) layout: cover | entry data... | index | trailer. The trailer
+    // reuses StegoTrailer with payloadOffset/payloadLength describing the index and
+    // nameLength holding the entry count. Entry data is encrypted with one continuous
+    // key stream, so each entry records where in that stream it starts. With ChaCha20
+    // the index starts with the cipher header that selects that stream's key; the
+    // entry table after it stays readable so the archive can be listed without a password.
+    struct ArchiveEntry
+    {
+        string name;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t keyStart;
+    };
+
+    static void appendU64(vector<unsigned char> &buf, uint64_t v)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(&v);
+        buf.insert(buf.end(), p, p + sizeof(v));
+    }
+
+    // `cipher` becomes the entry key when the index has a cipher header for this password.
+    static bool readArchiveIndex(const string &path, vector<ArchiveEntry> &entries, CipherKey &cipher,
+                                 HeaderState &state)
+    {
+        StegoTrailer t;
+        if (!readTrailer(path, t, "STEGOAR3"))
+            return false;
+        vector<unsigned char> index(static_cast<size_t>(t.payloadLength));
+        RawFile fin;
+        if (!fin.openRead(path) || !readFully(fin, index.data(), index.size(), t.payloadOffset))
+            return false;
+
+        state = parseCipherHeader(index.data(), index.size(), cipher);
+        entries.clear();
+        size_t at = state == HeaderState::None ? 0 : sizeof(CipherHeader);
+        for (uint64_t i = 0; i < t.nameLength; ++i)
+        {
+            uint64_t fields[4];
+            if (index.size() - at < sizeof(fields))
+                return false;
+            std::memcpy(fields, index.data() + at, sizeof(fields));
+            at += sizeof(fields);
+            if (index.size() - at < fields[0] || fields[1] + fields[2] > t.payloadOffset)
+                return false;
+            ArchiveEntry e;
+            e.name.assign(reinterpret_cast<const char *>(index.data() + at), static_cast<size_t>(fields[0]));
+            e.offset = fields[1];
+            e.length = fields[2];
+            e.keyStart = fields[3];
+            at += static_cast<size_t>(fields[0]);
+            entries.push_back(e);
+        }
+        return true;
+    }
+
+    // Archive names are relative paths with '/' separators; anything that could
+    // escape the output directory is rejected.
+    static bool safeEntryName(const string &name)
+    {
+        if (name.empty() || name[0] == '/' || name.find('\\') != string::npos || name.find(':') != string::npos)
+            return false;
+        stringstream parts(name);
+        string part;
+        while (std::getline(parts, part, '/'))
+        {
+            if (part.empty() || part == "." || part == "..")
+                return false;
+        }
+        return true;
+    }
+
+    bool extractPayload(const string &img, string hiddenFileName, uint64_t payloadOffset,
+                        uint64_t payloadLength, unsigned long long key, bool compressed = false)
+    {
+        hiddenFileName = basename_of(hiddenFileName);
+        if (hiddenFileName.empty())
+            hiddenFileName = "recovered_file.bin";
+
+        CipherKey cipher(key);
+        uint64_t skip = 0;
+        switch (readCipherHeader(img, payloadOffset, payloadLength, cipher))
+        {
+        case HeaderState::WrongPassword:
+            reportWrongPassword();
+            return false;
+        case HeaderState::Valid:
+            skip = sizeof(CipherHeader);
+            break;
+        case HeaderState::None:
+            break;
+        }
+
+        string dir = dirname_of(img);
+        string outPath = (fs::path(dir) / fs::path(string("recovered_") + hiddenFileName)).string();
+        if (!confirm_overwrite_if_exists(outPath))
+        {
+            cout << "Skipping retrieval.\n";
+            return false;
+        }
+
+        if (compressed)
+        {
+            if (!extractCompressed(img, payloadOffset + skip, payloadLength - skip, cipher, outPath))
+            {
+                std::error_code ec;
+                fs::remove(outPath, ec);
+                return false;
+            }
+        }
+        else if (!transformRange(img, payloadOffset + skip, outPath, 0, payloadLength - skip, cipher, true))
+        {
+            cout << "Failed to open output file for writing retrieved content.\n";
+            return false;
+        }
+
+        cout << "\nRetrieved hidden file to: " << outPath << "\n";
+        return true;
+    }
+
+    // Compressed (STEGOTRZ) payload, after the optional cipher header: the sealed
+    // chunks back to back, their stored lengths, then the plaintext size. Chunks are
+    // sealed as in a compressed container.
+    static bool storeCompressed(const string &file, RawFile &fout, uint64_t at, uint64_t total,
+                                const CipherKey &cipher, uint64_t &written)
+    {
+        RawFile fin;
+        if (!fin.openRead(file))
+            return false;
+        const uint64_t chunks = (total + kChunkUnit - 1) / kChunkUnit;
+        vector<unsigned char> buf(static_cast<size_t>(kChunkUnit));
+        vector<unsigned char> scratch(static_cast<size_t>(kChunkUnit));
+        vector<uint32_t> lengths(static_cast<size_t>(chunks));
+        written = 0;
+        for (uint64_t i = 0; i < chunks; ++i)
+        {
+            size_t len = static_cast<size_t>(std::min(kChunkUnit, total - i * kChunkUnit));
+            if (!readFully(fin, buf.data(), len, i * kChunkUnit))
+                return false;
+            size_t stored = sealChunk(buf.data(), len, i, cipher, true, scratch.data());
+            if (!fout.writeAt(buf.data(), stored, at + written))
+                return false;
+            lengths[static_cast<size_t>(i)] = static_cast<uint32_t>(stored);
+            written += stored;
+        }
+        vector<RawFile::Piece> tail = {{lengths.data(), lengths.size() * sizeof(uint32_t)}, {&total, sizeof(total)}};
+        if (!fout.writeGatherAt(tail, at + written))
+            return false;
+        written += lengths.size() * sizeof(uint32_t) + sizeof(total);
+        return true;
+    }
+
+    // Reverses storeCompressed for the `length` payload bytes at `at`. A chunk that
+    // does not decompress to its full size means a wrong password or damage.
+    static bool extractCompressed(const string &img, uint64_t at, uint64_t length, const CipherKey &cipher,
+                                  const string &outPath)
+    {
+        RawFile fin;
+        RawFile fout;
+        uint64_t total = 0;
+        bool read = length >= sizeof(total) && fin.openRead(img) &&
+                    readFully(fin, reinterpret_cast<unsigned char *>(&total), sizeof(total), at + length - sizeof(total));
+        const uint64_t chunks = (total + kChunkUnit - 1) / kChunkUnit;
+        if (!read || chunks > (length - sizeof(total)) / sizeof(uint32_t))
+        {
+            cout << "Hidden payload is damaged.\n";
+            return false;
+        }
+        vector<uint32_t> lengths(static_cast<size_t>(chunks));
+        const uint64_t dataLen = length - sizeof(total) - chunks * sizeof(uint32_t);
+        uint64_t sum = 0;
+        read = readFully(fin, reinterpret_cast<unsigned char *>(lengths.data()),
+                         lengths.size() * sizeof(uint32_t), at + dataLen);
+        for (uint32_t n : lengths)
+            sum += n;
+        if (!read || sum != dataLen)
+        {
+            cout << "Hidden payload is damaged.\n";
+            return false;
+        }
+        if (!fout.openWrite(outPath, true))
+        {
+            cout << "Failed to open output file for writing retrieved content.\n";
+            return false;
+        }
+
+        vector<unsigned char> buf(static_cast<size_t>(kChunkUnit));
+        vector<unsigned char> plain(static_cast<size_t>(kChunkUnit));
+        uint64_t pos = at;
+        for (uint64_t i = 0; i < chunks; ++i)
+        {
+            size_t len = static_cast<size_t>(std::min(kChunkUnit, total - i * kChunkUnit));
+            size_t stored = lengths[static_cast<size_t>(i)];
+            if (stored > len || !readFully(fin, buf.data(), stored, pos))
+            {
+                cout << "Hidden payload is damaged.\n";
+                return false;
+            }
+            xorBuffer(buf.data(), stored, cipher, i * kChunkUnit);
+            const unsigned char *out = buf.data();
+            if (stored < len)
+            {
+                if (!stealth::lzDecompress(buf.data(), stored, plain.data(), len))
+                {
+                    cout << "Hidden payload could not be decompressed (wrong password or damaged file).\n";
+                    return false;
+                }
+                out = plain.data();
+            }
+            if (!fout.writeAt(out, len, i * kChunkUnit))
+            {
+                cout << "Failed to write retrieved content.\n";
+                return false;
+            }
+            pos += stored;
+        }
+        return true;
+    }
+
+public:
+    Stego() = default;
+
+    // True if the file ends with a format 2 trailer, i.e. retrieval needs no cover size.
+    static bool hasTrailer(const string &imageWithFile)
+    {
+        StegoTrailer t;
+        return readTrailer(trim(imageWithFile), t) || readTrailer(trim(imageWithFile), t, "STEGOTRZ");
+    }
+
+    bool storeFileInImage(const string &imagePath, const string &filePath, unsigned long long key)
+    {
+        string img = trim(imagePath);
+        string file = trim(filePath);
+
+        if (!fs::exists(img))
+        {
+            cout << "Image does not exist: " << img << "\n";
+            return false;
+        }
+        if (!fs::exists(file))
+        {
+            cout << "File to hide does not exist: " << file << "\n";
+            return false;
+        }
+
+        string out = make_output_same_dir(img, "_stego", extension_of(img).empty() ? ".img" : "");
+        if (!confirm_overwrite_if_exists(out))
+        {
+            cout << "Skipping store in image.\n";
+            return false;
+        }
+
+        RawFile finFile;
+        if (!finFile.openRead(file) || !copy_file_fast(img, out))
+        {
+            cout << "Failed to open files for stego store.\n";
+            return false;
+        }
+        RawFile fout;
+        if (!fout.openWrite(out, false))
+        {
+            cout << "Failed to open files for stego store.\n";
+            return false;
+        }
+
+        const string signature = "STEGOSTR";
+        string hiddenFileName = basename_of(file);
+        uint64_t nameLen = static_cast<uint64_t>(hiddenFileName.size());
+        vector<RawFile::Piece> pieces = {{signature.data(), signature.size()},
+                                         {&nameLen, sizeof(nameLen)},
+                                         {hiddenFileName.data(), hiddenFileName.size()}};
+        uint64_t coverSize = filesize_bytes(img);
+        uint64_t payloadOffset = coverSize + signature.size() + sizeof(nameLen) + hiddenFileName.size();
+        uint64_t total = filesize_bytes(file);
+
+        // With ChaCha20 the payload starts with the cipher header.
+        CipherKey cipher(key);
+        CipherHeader header;
+        uint64_t headerLen = 0;
+        if (cipherMode == CipherMode::ChaCha20)
+        {
+            cipher = newCipherHeader(header);
+            headerLen = sizeof(header);
+            pieces.push_back({&header, sizeof(header)});
+        }
+        StegoTrailer trailer = {payloadOffset, headerLen + total, nameLen, {'S', 'T', 'E', 'G', 'O', 'T', 'R', '2'}};
+        if (compressOutput)
+        {
+            finFile.close();
+            bool ok = fout.writeGatherAt(pieces, coverSize) &&
+                      storeCompressed(file, fout, payloadOffset + headerLen, total, cipher, trailer.payloadLength);
+            std::memcpy(trailer.magic, "STEGOTRZ", 8);
+            trailer.payloadLength += headerLen;
+            ok = ok && fout.writeAt(&trailer, sizeof(trailer), payloadOffset + trailer.payloadLength);
+            fout.close();
+            if (!ok)
+            {
+                cout << "Failed to write hidden payload.\n";
+                return false;
+            }
+            cout << "\nStored file '" << hiddenFileName << "' (compressed) inside image: " << out << "\n";
+            return true;
+        }
+
+        // Payloads that fit in one block go out in the same gathered write as the
+        // header and trailer; larger ones go through the regular range transform.
+        vector<unsigned char> payload;
+        if (total <= blockSize)
+        {
+            payload.resize(static_cast<size_t>(total));
+            if (!readFully(finFile, payload.data(), payload.size(), 0))
+            {
+                cout << "Failed to read file to hide.\n";
+                return false;
+            }
+            xorBuffer(payload.data(), payload.size(), cipher, 0);
+            pieces.push_back({payload.data(), payload.size()});
+            pieces.push_back({&trailer, sizeof(trailer)});
+        }
+        finFile.close();
+        bool ok = fout.writeGatherAt(pieces, coverSize);
+        if (ok && total > blockSize)
+        {
+            ok = transformRange(file, 0, out, payloadOffset + headerLen, total, cipher, false) &&
+                 fout.writeAt(&trailer, sizeof(trailer), payloadOffset + headerLen + total);
+        }
+        fout.close();
+        if (!ok)
+        {
+            cout << "Failed to write hidden payload.\n";
+            return false;
+        }
+
+        cout << "\nStored file '" << hiddenFileName << "' inside image: " << out << "\n";
+        cout << "Original image size (bytes), only needed by older versions for retrieval: " << coverSize << "\n";
+        return true;
+    }
+
+    static bool isArchive(const string &imageWithFile)
+    {
+        StegoTrailer t;
+        return readTrailer(trim(imageWithFile), t, "STEGOAR3");
+    }
+
+    static vector<string> archiveEntryNames(const string &imageWithFiles)
+    {
+        vector<ArchiveEntry> entries;
+        vector<string> names;
+        CipherKey ignored(0ULL);
+        HeaderState state;
+        if (readArchiveIndex(trim(imageWithFiles), entries, ignored, state))
+        {
+            for (const ArchiveEntry &e : entries)
+                names.push_back(e.name);
+        }
+        return names;
+    }
+
+    // Hides many files (folders are added recursively, keeping their relative paths)
+    // behind one copy of the cover, followed by an index of all entries.
+    bool storeFilesInImage(const string &imagePath, const vector<string> &paths, unsigned long long key)
+    {
+        string img = trim(imagePath);
+        if (!fs::exists(img))
+        {
+            cout << "Image does not exist: " << img << "\n";
+            return false;
+        }
+
+        // The cover and the output (left by an earlier run) are never hidden in
+        // themselves, e.g. when the cover sits in the folder being stored.
+        string out = make_output_same_dir(img, "_stego", extension_of(img).empty() ? ".img" : "");
+        auto isCoverOrOutput = [&](const fs::path &p)
+        {
+            std::error_code ec;
+            return fs::equivalent(p, img, ec) || (fs::exists(out, ec) && fs::equivalent(p, out, ec));
+        };
+        vector<std::pair<string, string>> sources; // (path on disk, entry name)
+        std::unordered_map<string, string> byName;
+        auto add = [&](const string &path, const string &name)
+        {
+            auto ins = byName.emplace(name, path);
+            if (!ins.second)
+            {
+                cout << "Two files would be stored as " << name << ": " << ins.first->second << " and " << path
+                     << "\n";
+                return false;
+            }
+            sources.push_back({path, name});
+            return true;
+        };
+        for (const string &raw : paths)
+        {
+            string p = trim(raw);
+            std::error_code ec;
+            if (fs::is_directory(p, ec))
+            {
+                fs::path dirPath = fs::path(p).lexically_normal();
+                if (!dirPath.has_filename())
+                    dirPath = dirPath.parent_path();
+                fs::path root = dirPath.parent_path();
+                for (fs::recursive_directory_iterator it(dirPath, ec), end; it != end && !ec; it.increment(ec))
+                {
+                    if (it->is_regular_file(ec) && !isCoverOrOutput(it->path()) &&
+                        !add(it->path().string(), it->path().lexically_relative(root).generic_string()))
+                        return false;
+                }
+            }
+            else if (fs::is_regular_file(p, ec))
+            {
+                if (!isCoverOrOutput(p) && !add(p, basename_of(p)))
+                    return false;
+            }
+            else
+            {
+                cout << "File to hide does not exist: " << p << "\n";
+                return false;
+            }
+        }
+        if (sources.empty())
+        {
+            cout << "Nothing to hide.\n";
+            return false;
+        }
+
+        if (!confirm_overwrite_if_exists(out))
+        {
+            cout << "Skipping store in image.\n";
+            return false;
+        }
+        if (!copy_file_fast(img, out))
+        {
+            cout << "Failed to open files for stego store.\n";
+            return false;
+        }
+
+        const uint64_t dataStart = filesize_bytes(img);
+        uint64_t offset = dataStart;
+        vector<unsigned char> index;
+        CipherKey cipher(key);
+        if (cipherMode == CipherMode::ChaCha20)
+        {
+            CipherHeader header;
+            cipher = newCipherHeader(header);
+            const unsigned char *h = reinterpret_cast<const unsigned char *>(&header);
+            index.assign(h, h + sizeof(header));
+        }
+        for (const auto &src : sources)
+        {
+            uint64_t len = filesize_bytes(src.first);
+            if (!transformRange(src.first, 0, out, offset, len, cipher, false, offset - dataStart))
+            {
+                cout << "Failed to write hidden payload for: " << src.first << "\n";
+                return false;
+            }
+            appendU64(index, src.second.size());
+            appendU64(index, offset);
+            appendU64(index, len);
+            appendU64(index, offset - dataStart);
+            index.insert(index.end(), src.second.begin(), src.second.end());
+            offset += len;
+        }
+
+        StegoTrailer trailer = {offset, index.size(), sources.size(), {'S', 'T', 'E', 'G', 'O', 'A', 'R', '3'}};
+        RawFile fout;
+        if (!fout.openWrite(out, false) ||
+            !fout.writeGatherAt({{index.data(), index.size()}, {&trailer, sizeof(trailer)}}, offset))
+        {
+            cout << "Failed to write stego archive index.\n";
+            return false;
+        }
+        cout << "\nStored " << sources.size() << " file(s) inside image: " << out << "\n";
+        return true;
+    }
+
+    // Prints the archive index. Only the trailer and index are read.
+    bool listArchive(const string &imageWithFiles)
+    {
+        string img = trim(imageWithFiles);
+        vector<ArchiveEntry> entries;
+        CipherKey ignored(0ULL);
+        HeaderState state;
+        if (!readArchiveIndex(img, entries, ignored, state))
+        {
+            cout << "No stego archive found in: " << img << "\n";
+            return false;
+        }
+        cout << entries.size() << " hidden file(s):\n";
+        for (const ArchiveEntry &e : entries)
+            cout << "  " << std::setw(12) << e.length << "  " << e.name << "\n";
+        return true;
+    }
+
+    // Extracts one archive entry, reading only the index and that entry's bytes.
+    bool extractFromArchive(const string &imageWithFiles, const string &entryName, unsigned long long key)
+    {
+        string img = trim(imageWithFiles);
+        string name = trim(entryName);
+        vector<ArchiveEntry> entries;
+        CipherKey cipher(key);
+        HeaderState state;
+        if (!readArchiveIndex(img, entries, cipher, state))
+        {
+            cout << "No stego archive found in: " << img << "\n";
+            return false;
+        }
+        if (state == HeaderState::WrongPassword)
+        {
+            reportWrongPassword();
+            return false;
+        }
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const ArchiveEntry &e)
+                               { return e.name == name; });
+        if (it == entries.end())
+        {
+            cout << "No entry named '" << name << "' in archive.\n";
+            return false;
+        }
+        if (!safeEntryName(it->name))
+        {
+            cout << "Refusing unsafe entry name: " << it->name << "\n";
+            return false;
+        }
+
+        fs::path outPath = fs::path(dirname_of(img)) / fs::path(string("recovered_") + it->name);
+        if (!confirm_overwrite_if_exists(outPath.string()))
+        {
+            cout << "Skipping retrieval.\n";
+            return false;
+        }
+        std::error_code ec;
+        fs::create_directories(outPath.parent_path(), ec);
+        if (!transformRange(img, it->offset, outPath.string(), 0, it->length, cipher, true, it->keyStart))
+        {
+            cout << "Failed to open output file for writing retrieved content.\n";
+            return false;
+        }
+        cout << "\nRetrieved hidden file to: " << outPath.string() << "\n";
+        return true;
+    }
+
+    // Format 2 retrieval: one read of the trailer at end-of-file locates the payload.
+    bool retrieveFileFromImage(const string &imageWithFile, unsigned long long key)
+    {
+        string img = trim(imageWithFile);
+        if (!fs::exists(img))
+        {
+            cout << "Image-with-file does not exist: " << img << "\n";
+            return false;
+        }
+
+        StegoTrailer t;
+        bool plain = readTrailer(img, t);
+        bool compressed = !plain && readTrailer(img, t, "STEGOTRZ");
+        if (!plain && !compressed)
+        {
+            cout << "No stego trailer found; the original image size is needed for this file.\n";
+            return false;
+        }
+
+        string hiddenFileName(static_cast<size_t>(t.nameLength), '\0');
+        RawFile fin;
+        if (!fin.openRead(img) ||
+            (t.nameLength > 0 && !readFully(fin, reinterpret_cast<unsigned char *>(&hiddenFileName[0]),
+                                            hiddenFileName.size(), t.payloadOffset - t.nameLength)))
+        {
+            cout << "Failed to read hidden filename; aborting.\n";
+            return false;
+        }
+        fin.close();
+        return extractPayload(img, hiddenFileName, t.payloadOffset, t.payloadLength, key, compressed);
+    }
+
+    // Format 1 retrieval: the header sits right after the original cover image bytes.
+    bool retrieveFileFromImage(const string &imageWithFile, uint64_t originalImageSize, unsigned long long key)
+    {
+        string img = trim(imageWithFile);
+        if (!fs::exists(img))
+        {
+            cout << "Image-with-file does not exist: " << img << "\n";
+            return false;
+        }
+
+        ifstream fin(img, ios::binary);
+        if (!fin)
+        {
+            cout << "Failed to open image-with-file for reading.\n";
+            return false;
+        }
+
+        uint64_t fileLen = filesize_bytes(img);
+        if (originalImageSize >= fileLen)
+        {
+            cout << "Given original image size is equal or larger than the file; nothing to retrieve.\n";
+            fin.close();
+            return false;
+        }
+
+        fin.seekg(static_cast<std::streamoff>(originalImageSize), ios::beg);
+
+        char sigBuf[9] = {0};
+        fin.read(sigBuf, 8);
+        string signature(sigBuf, 8);
+        if (signature != "STEGOSTR")
+        {
+            cout << "Warning: signature not found at expected position. Retrieval may fail.\n";
+        }
+
+        uint64_t nameLen = 0;
+        fin.read(reinterpret_cast<char *>(&nameLen), sizeof(nameLen));
+        if (!fin)
+        {
+            cout << "Failed to read filename length; retrieval aborted.\n";
+            fin.close();
+            return false;
+        }
+
+        string hiddenFileName;
+        if (nameLen > 0)
+        {
+            if (nameLen > fileLen)
+            {
+                cout << "Failed to read hidden filename; aborting.\n";
+                fin.close();
+                return false;
+            }
+            hiddenFileName.resize(static_cast<size_t>(nameLen));
+            fin.read(&hiddenFileName[0], static_cast<std::streamsize>(nameLen));
+            if (!fin)
+            {
+                cout << "Failed to read hidden filename; aborting.\n";
+                fin.close();
+                return false;
+            }
+        }
+
+        uint64_t payloadOffset = static_cast<uint64_t>(fin.tellg());
+        uint64_t remaining = fileLen > payloadOffset ? (fileLen - payloadOffset) : 0;
+        fin.close();
+
+        // A format 2 file read the old way must not hand the trailer back as payload.
+        StegoTrailer t;
+        if (readTrailer(img, t) && t.payloadOffset == payloadOffset)
+            remaining = t.payloadLength;
+
+        return extractPayload(img, hiddenFileName, payloadOffset, remaining, key);
+    }
+};
+
+// --stats: one JSON line per operation (counter deltas around the call) and a
+// totals line per batch or session, written to statsOut.
+struct OpSample
+{
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t syscalls;
+    uint64_t refills;
+    uint64_t readNs;
+    uint64_t transformNs;
+    uint64_t writeNs;
+};
+
+static std::ostream *statsOut = nullptr;
+static OpSample statsTotals = {};
+static uint64_t statsOperations = 0;
+static uint64_t statsFailed = 0;
+static double statsWallSec = 0;
+
+static OpSample sample_counters()
+{
+    return {opCounters.bytesRead, opCounters.bytesWritten, opCounters.reads, opCounters.writes,
+            opCounters.syscalls, opCounters.refills, opCounters.readNs, opCounters.transformNs,
+            opCounters.writeNs};
+}
+
+static string json_escape(const string &text)
+{
+    string out;
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x20)
+        {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "\\u%04x", c);
+            out += hex;
+        }
+        else
+        {
+            out += static_cast<char>(c);
+        }
+    }
+    return out;
+}
+
+static const char *component_of(const string &command)
+{
+    if (command.find("image") != string::npos)
+        return "ImageCrypto";
+    if (command.find("text") != string::npos)
+        return "TextCrypto";
+    if (command.find("stego") != string::npos)
+        return "Stego";
+    if (command.find("tree") != string::npos)
+        return "TreeCrypto";
+    return "FileCrypto";
+}
+
+static void write_stats_counters(std::ostream &os, double wallSec, const OpSample &d)
+{
+    double readSec = d.readNs / 1e9;
+    double transformSec = d.transformNs / 1e9;
+    double writeSec = d.writeNs / 1e9;
+    uint64_t moved = std::max(d.bytesRead, d.bytesWritten);
+    const char *dominant = "read";
+    if (transformSec > readSec && transformSec >= writeSec)
+        dominant = "transform";
+    else if (writeSec > readSec)
+        dominant = "write";
+    os << std::fixed << std::setprecision(6) << "\"wall_s\":" << wallSec << ",\"bytes_read\":" << d.bytesRead
+       << ",\"bytes_written\":" << d.bytesWritten << ",\"read_s\":" << readSec << ",\"transform_s\":"
+       << transformSec << ",\"write_s\":" << writeSec << ",\"reads\":" << d.reads << ",\"writes\":" << d.writes
+       << ",\"syscalls\":" << d.syscalls << ",\"refills\":" << d.refills << std::setprecision(2)
+       << ",\"mb_per_s\":" << (wallSec > 0 ? moved / wallSec / 1e6 : 0.0) << ",\"dominant\":\"" << dominant
+       << "\"";
+    os.unsetf(std::ios::floatfield);
+}
+
+// Runs one operation, recording its counters when --stats is on.
+static bool run_with_stats(const string &command, const string &item, const std::function<bool()> &op)
+{
+    if (!statsOut)
+        return op();
+    OpSample before = sample_counters();
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = op();
+    double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    OpSample after = sample_counters();
+    OpSample d = {after.bytesRead - before.bytesRead, after.bytesWritten - before.bytesWritten,
+                  after.reads - before.reads, after.writes - before.writes,
+                  after.syscalls - before.syscalls, after.refills - before.refills,
+                  after.readNs - before.readNs, after.transformNs - before.transformNs,
+                  after.writeNs - before.writeNs};
+
+    *statsOut << "{\"kind\":\"operation\",\"op\":\"" << command << "\",\"component\":\"" << component_of(command)
+              << "\",\"item\":\"" << json_escape(item) << "\",\"ok\":" << (ok ? "true" : "false") << ",";
+    write_stats_counters(*statsOut, wallSec, d);
+    *statsOut << "}\n";
+    statsOut->flush();
+
+    statsTotals.bytesRead += d.bytesRead;
+    statsTotals.bytesWritten += d.bytesWritten;
+    statsTotals.reads += d.reads;
+    statsTotals.writes += d.writes;
+    statsTotals.syscalls += d.syscalls;
+    statsTotals.refills += d.refills;
+    statsTotals.readNs += d.readNs;
+    statsTotals.transformNs += d.transformNs;
+    statsTotals.writeNs += d.writeNs;
+    ++statsOperations;
+    statsFailed += ok ? 0 : 1;
+    statsWallSec += wallSec;
+    return ok;
+}
+
+// Totals line for a batch command ("batch") or an interactive session.
+static void write_stats_summary(const string &kind, const string &label)
+{
+    if (!statsOut || statsOperations == 0)
+        return;
+    *statsOut << "{\"kind\":\"" << kind << "\",\"op\":\"" << json_escape(label)
+              << "\",\"operations\":" << statsOperations << ",\"failed\":" << statsFailed << ",";
+    write_stats_counters(*statsOut, statsWallSec, statsTotals);
+    *statsOut << "}\n";
+    statsOut->flush();
+    statsTotals = {};
+    statsOperations = statsFailed = 0;
+    statsWallSec = 0;
+}
+
+static void printMainMenuOptions()
+{
+    cout << "\n====== MAIN MENU ======\n";
+    cout << "1. Encrypt Image\n";
+    cout << "2. Decrypt Image\n";
+    cout << "3. Encrypt File\n";
+    cout << "4. Decrypt File\n";
+    cout << "5. Encrypt Text\n";
+    cout << "6. Decrypt Text\n";
+    cout << "7. Store File in Image (Stego)\n";
+    cout << "8. Retrieve File from Image (Stego)\n";
+    cout << "9. Logout\n";
+    cout << "10. Store Files/Folders in Image (Stego Archive)\n";
+    cout << "11. List Stego Archive\n";
+    cout << "12. Extract File from Stego Archive\n";
+    cout << "13. Encrypt Text File (Base64 output)\n";
+    cout << "14. Decrypt Text File\n";
+    cout << "Enter choice: ";
+}
+
+static void mainMenuFlow(UserManager &userManager)
+{
+    ImageCrypto imageCrypto;
+    FileCrypto fileCrypto;
+    TextCrypto textCrypto;
+    Stego stego;
+
+    cout << "Enter the password for making the encryption key: ";
+    string password;
+    std::getline(cin, password);
+    unsigned long long key = userManager.getKey(password);
+    BaseCrypto::setPassphrase(password);
+
+    bool keepRunning = true;
+    while (keepRunning)
+    {
+        printMainMenuOptions();
+        string choiceLine;
+        std::getline(cin, choiceLine);
+        int choice = 0;
+        try
+        {
+            choice = std::stoi(trim(choiceLine));
+        }
+        catch (...)
+        {
+            choice = 0;
+        }
+
+        switch (choice)
+        {
+        case 1:
+        { // Encrypt Image
+            cout << "Enter image path: ";
+            string in;
+            std::getline(cin, in);
+            in = trim(in);
+            if (in.empty())
+            {
+                cout << "No image path provided.\n";
+                break;
+            }
+            run_with_stats("encrypt-image", in, [&]()
+                           { return imageCrypto.encrypt(in, key); });
+            break;
+        }
+        case 2:
+        { // Decrypt Image
+            cout << "Enter encrypted image path: ";
+            string in;
+            std::getline(cin, in);
+            in = trim(in);
+            if (in.empty())
+            {
+                cout << "No path provided.\n";
+                break;
+            }
+            run_with_stats("decrypt-image", in, [&]()
+                           { return imageCrypto.decrypt(in, key); });
+            break;
+        }
+        case 3:
+        { // Encrypt File
+            cout << "Enter file path to encrypt: ";
+            string in;
+            std::getline(cin, in);
+            in = trim(in);
+            if (in.empty())
+            {
+                cout << "No file path provided.\n";
+                break;
+            }
+            run_with_stats("encrypt-file", in, [&]()
+                           { return fileCrypto.encrypt(in, key); });
+            break;
+        }
+        case 4:
+        { // Decrypt File
+            cout << "Enter encrypted file path to decrypt: ";
+            string in;
+            std::getline(cin, in);
+            in = trim(in);
+            if (in.empty())
+            {
+                cout << "No file path provided.\n";
+                break;
+            }
+            run_with_stats("decrypt-file", in, [&]()
+                           { return fileCrypto.decrypt(in, key); });
+            break;
+        }
+        case 5:
+        {
+            cout << "Enter text to encrypt (single line): ";
+            string txt;
+            std::getline(cin, txt);
+            txt = trim(txt);
+            if (txt.empty())
+            {
+                cout << "Empty text. Nothing to encrypt.\n";
+                break;
+            }
+
+            // Use TextCrypto's encryptInput
+            if (!run_with_stats("encrypt-text", "(console text)", [&]()
+                                { return textCrypto.encryptInput(txt, key, false); }))
+            {
+                cout << "Encryption failed.\n";
+            }
+            break;
+        }
+
+        case 6:
+        {
+            cout << "Enter encrypted text to decrypt (Base64 string): ";
+            string enc;
+            std::getline(cin, enc);
+            enc = trim(enc);
+            if (enc.empty())
+            {
+                cout << "Empty. Nothing to decrypt.\n";
+                break;
+            }
+
+            // Use TextCrypto's decryptInput
+            if (!run_with_stats("decrypt-text", "(console text)", [&]()
+                                { return textCrypto.decryptInput(enc, key, false); }))
+            {
+                cout << "Decryption failed.\n";
+            }
+            break;
+        }
+
+        case 7:
+        { // Store File in Image
+            cout << "Enter image path (cover image): ";
+            string img;
+            std::getline(cin, img);
+            img = trim(img);
+            cout << "Enter file path to hide: ";
+            string file;
+            std::getline(cin, file);
+            file = trim(file);
+            if (img.empty() || file.empty())
+            {
+                cout << "Missing image or file path.\n";
+                break;
+            }
+            run_with_stats("stego-store", img, [&]()
+                           { return stego.storeFileInImage(img, file, key); });
+            break;
+        }
+        case 8:
+        { // Retrieve File from Image
+            cout << "Enter image-with-file path: ";
+            string img;
+            std::getline(cin, img);
+            img = trim(img);
+            if (img.empty())
+            {
+                cout << "Missing path.\n";
+                break;
+            }
+            if (Stego::isArchive(img))
+            {
+                cout << "This image holds a stego archive; use options 11 and 12.\n";
+                break;
+            }
+            if (Stego::hasTrailer(img))
+            {
+                run_with_stats("stego-retrieve", img, [&]()
+                               { return stego.retrieveFileFromImage(img, key); });
+                break;
+            }
+            cout << "Enter original image size (in bytes) used when storing (you can use file properties): ";
+            string sizeStr;
+            std::getline(cin, sizeStr);
+            uint64_t origSize = 0;
+            try
+            {
+                origSize = std::stoull(trim(sizeStr));
+            }
+            catch (...)
+            {
+                cout << "Invalid number. Aborting retrieve.\n";
+                break;
+            }
+            run_with_stats("stego-retrieve", img, [&]()
+                           { return stego.retrieveFileFromImage(img, origSize, key); });
+            break;
+        }
+        case 9:
+        {
+            cout << "Logging out...\n";
+            keepRunning = false;
+            break;
+        }
+        case 10:
+        { // Store many files in one image
+            cout << "Enter image path (cover image): ";
+            string img;
+            std::getline(cin, img);
+            img = trim(img);
+            cout << "Enter file or folder paths to hide, one per line (empty line to finish):\n";
+            vector<string> paths;
+            string line;
+            while (std::getline(cin, line) && !trim(line).empty())
+                paths.push_back(trim(line));
+            if (img.empty() || paths.empty())
+            {
+                cout << "Missing image or file paths.\n";
+                break;
+            }
+            run_with_stats("stego-store", img, [&]()
+                           { return stego.storeFilesInImage(img, paths, key); });
+            break;
+        }
+        case 11:
+        { // List archive entries
+            cout << "Enter image-with-files path: ";
+            string img;
+            std::getline(cin, img);
+            img = trim(img);
+            if (img.empty())
+            {
+                cout << "Missing path.\n";
+                break;
+            }
+            stego.listArchive(img);
+            break;
+        }
+        case 12:
+        { // Extract one archive entry
+            cout << "Enter image-with-files path: ";
+            string img;
+            std::getline(cin, img);
+            img = trim(img);
+            cout << "Enter name of the hidden file (as listed): ";
+            string name;
+            std::getline(cin, name);
+            name = trim(name);
+            if (img.empty() || name.empty())
+            {
+                cout << "Missing path or name.\n";
+                break;
+            }
+            run_with_stats("stego-extract", img + ":" + name, [&]()
+                           { return stego.extractFromArchive(img, name, key); });
+            break;
+        }
+        case 13:
+        case 14:
+        { // Streaming text file modes
+            cout << (choice == 13 ? "Enter text file path to encrypt: " : "Enter encrypted text file path to decrypt: ");
+            string in;
+            std::getline(cin, in);
+            in = trim(in);
+            if (in.empty())
+            {
+                cout << "No file path provided.\n";
+                break;
+            }
+            run_with_stats(choice == 13 ? "encrypt-text-file" : "decrypt-text-file", in, [&]()
+                           { return choice == 13 ? textCrypto.encryptInput(in, key, true)
+                                                 : textCrypto.decryptInput(in, key, true); });
+            break;
+        }
+        default:
+            cout << "Invalid choice. Enter number 1-14.\n";
+        }
+        waitShort();
+    }
+}
+
+// Collects everything written to cout while alive, so batch mode can report each
+// item on one line instead of the interactive messages.
+class CoutCapture
+{
+public:
+    CoutCapture() : old(cout.rdbuf(buf.rdbuf())) {}
+    ~CoutCapture()
+    {
+        cout.rdbuf(old);
+    }
+
+    // Last message line, ignoring progress bar redraws.
+    string lastLine() const
+    {
+        string text = buf.str();
+        string last;
+        string line;
+        for (size_t i = 0; i <= text.size(); ++i)
+        {
+            if (i == text.size() || text[i] == '\n' || text[i] == '\r')
+            {
+                line = trim(line);
+                if (!line.empty() && line[0] != '[')
+                    last = line;
+                line.clear();
+            }
+            else
+            {
+                line += (text[i] == '\t') ? ' ' : text[i];
+            }
+        }
+        return last;
+    }
+
+private:
+    std::ostringstream buf;
+    std::streambuf *old;
+};
+
+// Scriptable mode: runs one command over many paths without prompts or sleeps and
+// prints "<status>\t<command>\t<item>\t<detail>" per item, where status is ok,
+// skipped (output exists, --skip-existing) or failed. Returns 1 if any item failed.
+static int runBatch(const string &command, const vector<string> &args, unsigned long long key, uint64_t coverSize)
+{
+    ImageCrypto imageCrypto;
+    FileCrypto fileCrypto;
+    TextCrypto textCrypto;
+    Stego stego;
+    int failures = 0;
+
+    auto runItem = [&](const string &item, const std::function<bool()> &op)
+    {
+        refusedExistingOutput = false;
+        bool ok;
+        string detail;
+        {
+            CoutCapture capture;
+            ok = run_with_stats(command, item, op);
+            detail = capture.lastLine();
+        }
+        if (!ok && refusedExistingOutput)
+            detail = "output already exists";
+        const char *status = ok ? "ok" : "failed";
+        if (!ok && refusedExistingOutput && overwritePolicy == OverwritePolicy::Skip)
+            status = "skipped";
+        else if (!ok)
+            ++failures;
+        cout << status << "\t" << command << "\t" << item << "\t" << detail << "\n";
+    };
+
+    if (command == "encrypt-file" || command == "decrypt-file" || command == "encrypt-image" ||
+        command == "decrypt-image" || command == "encrypt-text-file" || command == "decrypt-text-file")
+    {
+        uint64_t totalBytes = 0;
+        for (const string &path : args)
+            totalBytes += filesize_bytes(trim(path));
+        progress.beginJob(totalBytes, args.size());
+        for (const string &path : args)
+        {
+            runItem(path, [&]()
+                    {
+                if (command == "encrypt-file")
+                    return fileCrypto.encrypt(path, key);
+                if (command == "decrypt-file")
+                    return fileCrypto.decrypt(path, key);
+                if (command == "encrypt-image")
+                    return imageCrypto.encrypt(path, key);
+                if (command == "decrypt-image")
+                    return imageCrypto.decrypt(path, key);
+                if (command == "encrypt-text-file")
+                    return textCrypto.encryptFile(path, key);
+                return textCrypto.decryptFile(path, key); });
+            progress.itemDone();
+        }
+        progress.endJob();
+    }
+    else if (command == "encrypt-tree" || command == "decrypt-tree")
+    {
+        TreeCrypto tree;
+        string roots;
+        for (const string &root : args)
+            roots += (roots.empty() ? "" : ",") + root;
+        run_with_stats(command, roots, [&]()
+                       {
+            int failed = tree.run(args, key, command == "decrypt-tree", command);
+            failures += failed;
+            return failed == 0; });
+    }
+    else if (command == "decrypt-range" && (args.size() == 3 || args.size() == 4))
+    {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        try
+        {
+            offset = std::stoull(args[1]);
+            length = std::stoull(args[2]);
+        }
+        catch (...)
+        {
+            cout << "decrypt-range needs FILE OFFSET LENGTH [OUT]\n";
+            return 2;
+        }
+        if (args.size() == 4 && args[3] != "-")
+        {
+            const string outPath = args[3];
+            runItem(args[0], [&]()
+                    {
+                if (!confirm_overwrite_if_exists(outPath))
+                    return false;
+                ofstream out(outPath, ios::binary | ios::trunc);
+                if (!out)
+                {
+                    cout << "Cannot create output: " << outPath << "\n";
+                    return false;
+                }
+                return fileCrypto.decryptRange(args[0], offset, length, key, out); });
+        }
+        else
+        {
+            // The bytes themselves go to stdout, so only a failure is reported (on stderr).
+            std::ostream data(cout.rdbuf());
+            bool ok;
+            string detail;
+            {
+                CoutCapture capture;
+                ok = run_with_stats(command, args[0], [&]()
+                                    { return fileCrypto.decryptRange(args[0], offset, length, key, data); });
+                detail = capture.lastLine();
+            }
+            if (!ok)
+            {
+                std::cerr << "failed\t" << command << "\t" << args[0] << "\t" << detail << "\n";
+                ++failures;
+            }
+        }
+    }
+    else if (command == "stego-store" && args.size() >= 2)
+    {
+        vector<string> files(args.begin() + 1, args.end());
+        bool single = files.size() == 1 && !fs::is_directory(files[0]);
+        runItem(args[0], [&]()
+                { return single ? stego.storeFileInImage(args[0], files[0], key)
+                                : stego.storeFilesInImage(args[0], files, key); });
+    }
+    else if (command == "stego-retrieve")
+    {
+        for (const string &img : args)
+        {
+            if (Stego::isArchive(img))
+            {
+                for (const string &name : Stego::archiveEntryNames(img))
+                    runItem(img + ":" + name, [&]()
+                            { return stego.extractFromArchive(img, name, key); });
+            }
+            else
+            {
+                runItem(img, [&]()
+                        { return coverSize > 0 && !Stego::hasTrailer(img)
+                                     ? stego.retrieveFileFromImage(img, coverSize, key)
+                                     : stego.retrieveFileFromImage(img, key); });
+            }
+        }
+    }
+    else if (command == "stego-extract" && args.size() >= 2)
+    {
+        for (size_t i = 1; i < args.size(); ++i)
+            runItem(args[0] + ":" + args[i], [&]()
+                    { return stego.extractFromArchive(args[0], args[i], key); });
+    }
+    else if (command == "verify")
+    {
+        for (const string &path : args)
+        {
+            runItem(path, [&]()
+                    {
+                string error;
+                if (!ContainerCrypto::verify(path, "", error))
+                {
+                    cout << error << "\n";
+                    return false;
+                }
+                uint64_t size = ContainerCrypto::dataSize(path);
+                cout << (size + ContainerCrypto::kChunkSize - 1) / ContainerCrypto::kChunkSize
+                     << " chunks verified (" << size << " bytes)\n";
+                return true; });
+        }
+    }
+    else if (command == "store-file" && args.size() >= 2)
+    {
+        ChunkStore store;
+        uint64_t totalBytes = 0;
+        for (size_t i = 1; i < args.size(); ++i)
+            totalBytes += filesize_bytes(trim(args[i]));
+        progress.beginJob(totalBytes, args.size() - 1);
+        for (size_t i = 1; i < args.size(); ++i)
+        {
+            runItem(args[i], [&]()
+                    { return store.archive(args[0], args[i], key); });
+            progress.itemDone();
+        }
+        progress.endJob();
+    }
+    else if (command == "restore-file" && (args.size() == 2 || args.size() == 3))
+    {
+        ChunkStore store;
+        runItem(args[1], [&]()
+                { return store.restore(args[0], args[1], args.size() == 3 ? args[2] : "", key); });
+    }
+    else if (command == "stego-list")
+    {
+        for (const string &img : args)
+        {
+            vector<string> names = Stego::archiveEntryNames(img);
+            if (names.empty() && !Stego::isArchive(img))
+            {
+                cout << "failed\t" << command << "\t" << img << "\tNo stego archive found\n";
+                ++failures;
+            }
+            for (const string &name : names)
+                cout << "entry\t" << command << "\t" << img << "\t" << name << "\n";
+        }
+    }
+    else
+    {
+        cout << "Unknown command or missing arguments: " << command << "\n";
+        return 2;
+    }
+    write_stats_summary("batch", command);
+    return failures > 0 ? 1 : 0;
+}
+
+#ifndef _WIN32
+// Daemon protocol: fixed-size binary frames over a Unix stream socket. A client
+// first sends KEY (payload: password) or LOGIN (payload: "user\npassword", which
+// also sets the key); each TRANSFORM frame then carries two descriptors via
+// SCM_RIGHTS, input and output, so file data never passes through the socket.
+// Every request gets one reply frame.
+enum DaemonOp : uint32_t
+{
+    DaemonKey = 1,
+    DaemonLogin = 2,
+    DaemonTransform = 3
+};
+
+struct DaemonRequest
+{
+    char magic[4]; // "SLD1"
+    uint32_t op;
+    uint64_t inOffset;
+    uint64_t outOffset;
+    uint64_t length; // kDaemonToEnd: the rest of the input
+    uint64_t keyOffset;
+    uint32_t payloadLength;
+    uint32_t reserved;
+};
+
+struct DaemonReply
+{
+    char magic[4];
+    uint32_t status; // 0 on success
+    uint64_t bytes;
+    uint64_t micros; // time from request to reply
+    char message[104];
+};
+
+static const uint64_t kDaemonToEnd = ~0ULL;
+static const uint32_t kDaemonMaxPayload = 4096;
+
+static bool send_all(int sock, const void *buf, size_t len)
+{
+    const char *p = static_cast<const char *>(buf);
+    while (len > 0)
+    {
+        ssize_t n = ::send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool recv_all(int sock, void *buf, size_t len)
+{
+    char *p = static_cast<char *>(buf);
+    while (len > 0)
+    {
+        ssize_t n = ::recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Sends one frame with up to two descriptors attached to its first byte.
+static bool send_frame(int sock, const void *frame, size_t len, const vector<int> &fds)
+{
+    if (fds.empty())
+        return send_all(sock, frame, len);
+    iovec iov = {const_cast<void *>(frame), len};
+    alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+    cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    std::memcpy(CMSG_DATA(c), fds.data(), fds.size() * sizeof(int));
+    ssize_t n;
+    do
+    {
+        n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    return send_all(sock, static_cast<const char *>(frame) + n, len - static_cast<size_t>(n));
+}
+
+// Receives one frame and any descriptors that came with it (the caller owns them).
+static bool recv_frame(int sock, void *frame, size_t len, vector<int> &fds)
+{
+    iovec iov = {frame, len};
+    alignas(cmsghdr) char control[CMSG_SPACE(4 * sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do
+    {
+        n = ::recvmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+        size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; ++i)
+        {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds.push_back(fd);
+        }
+    }
+    return recv_all(sock, static_cast<char *>(frame) + n, len - static_cast<size_t>(n));
+}
+
+// Long-running local service: one thread per client session handles the protocol
+// and a fixed pool of warm workers runs the transforms, so many sessions can be
+// served at once without a process start, login or key derivation per file.
+class StealthDaemon : public BaseCrypto
+{
+public:
+    explicit StealthDaemon(UserManager &users) : userManager(users) {}
+
+    int serve(const string &socketPath)
+    {
+        int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (listener < 0 || socketPath.size() >= sizeof(addr.sun_path))
+        {
+            cout << "Cannot create socket: " << socketPath << "\n";
+            return 1;
+        }
+        std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        struct stat st;
+        if (::lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            ::unlink(socketPath.c_str()); // stale socket from an earlier run
+        mode_t oldMask = ::umask(077);
+        int bound = ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        ::umask(oldMask);
+        if (bound != 0 || ::listen(listener, 64) != 0)
+        {
+            cout << "Cannot listen on " << socketPath << ": " << std::strerror(errno) << "\n";
+            ::close(listener);
+            return 1;
+        }
+
+        unsigned workers = resolvedWorkerCount();
+        for (unsigned i = 0; i < workers; ++i)
+            std::thread([this]()
+                        { workerLoop(); })
+                .detach();
+        cout << "Serving on " << socketPath << " with " << workers << " workers\n";
+        cout.flush();
+
+        for (;;)
+        {
+            int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                    continue;
+                cout << "accept failed: " << std::strerror(errno) << "\n";
+                ::close(listener);
+                return 1;
+            }
+            std::thread([this, client]()
+                        { session(client); })
+                .detach();
+        }
+    }
+
+private:
+    struct Job
+    {
+        RawFile in;
+        RawFile out;
+        DaemonRequest request;
+        unsigned long long key;
+        bool ok = false;
+        uint64_t bytes = 0;
+        string error;
+        bool done = false;
+    };
+
+    void workerLoop()
+    {
+        for (;;)
+        {
+            Job *job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [this]()
+                                { return !queue.empty(); });
+                job = queue.front();
+                queue.pop_front();
+            }
+            run(*job);
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                job->done = true;
+            }
+            jobDone.notify_all();
+        }
+    }
+
+    static void run(Job &job)
+    {
+        const DaemonRequest &r = job.request;
+        struct stat st;
+        if (::fstat(job.in.handle(), &st) != 0 || static_cast<uint64_t>(st.st_size) < r.inOffset)
+        {
+            job.error = "cannot stat input";
+            return;
+        }
+        uint64_t available = static_cast<uint64_t>(st.st_size) - r.inOffset;
+        job.bytes = r.length == kDaemonToEnd ? available : r.length;
+        if (job.bytes > available)
+        {
+            job.error = "range extends past end of input";
+            return;
+        }
+        // The pool already runs one job per worker, so each job takes the single-stream
+        // pipeline; transformRange() would start another worker per core for large jobs.
+        job.ok = transformRangePipelined(job.in, r.inOffset, job.out, r.outOffset, job.bytes, job.key, r.keyOffset,
+                                         "");
+        if (!job.ok)
+            job.error = "I/O error";
+    }
+
+    void session(int client)
+    {
+        bool haveKey = false;
+        unsigned long long key = 0;
+        for (;;)
+        {
+            DaemonRequest request;
+            vector<int> fds;
+            if (!recv_frame(client, &request, sizeof(request), fds))
+            {
+                for (int fd : fds)
+                    ::close(fd);
+                break;
+            }
+            auto t0 = std::chrono::steady_clock::now();
+            DaemonReply reply = {};
+            std::memcpy(reply.magic, "SLD1", 4);
+            string message = "ok";
+            string payload;
+            if (std::memcmp(request.magic, "SLD1", 4) != 0 || request.payloadLength > kDaemonMaxPayload)
+            {
+                for (int fd : fds)
+                    ::close(fd);
+                break;
+            }
+            payload.resize(request.payloadLength);
+            if (!payload.empty() && !recv_all(client, &payload[0], payload.size()))
+            {
+                for (int fd : fds)
+                    ::close(fd);
+                break;
+            }
+
+            if (request.op == DaemonKey)
+            {
+                key = userManager.getKey(payload);
+                haveKey = true;
+            }
+            else if (request.op == DaemonLogin)
+            {
+                size_t nl = payload.find('\n');
+                bool valid;
+                {
+                    std::lock_guard<std::mutex> lock(usersMutex);
+                    valid = nl != string::npos && userManager.verify(payload.substr(0, nl), payload.substr(nl + 1));
+                }
+                if (valid)
+                {
+                    key = userManager.getKey(payload.substr(nl + 1));
+                    haveKey = true;
+                }
+                else
+                {
+                    message = "invalid username or password";
+                }
+            }
+            else if (request.op == DaemonTransform && fds.size() == 2 && haveKey)
+            {
+                Job job;
+                job.in.adopt(fds[0]);
+                job.out.adopt(fds[1]);
+                fds.clear();
+                job.request = request;
+                job.key = key;
+                {
+                    std::unique_lock<std::mutex> lock(queueMutex);
+                    queue.push_back(&job);
+                    queueReady.notify_one();
+                    jobDone.wait(lock, [&job]()
+                                 { return job.done; });
+                }
+                reply.bytes = job.bytes;
+                if (!job.ok)
+                    message = job.error;
+            }
+            else
+            {
+                message = !haveKey ? "no key: send KEY or LOGIN first" : "bad request";
+            }
+            for (int fd : fds)
+                ::close(fd);
+
+            reply.status = message == "ok" ? 0 : 1;
+            reply.micros = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+            std::strncpy(reply.message, message.c_str(), sizeof(reply.message) - 1);
+            if (!send_all(client, &reply, sizeof(reply)))
+                break;
+        }
+        ::close(client);
+    }
+
+    UserManager &userManager;
+    std::mutex usersMutex;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::condition_variable jobDone;
+    std::deque<Job *> queue;
+};
+
+// Batch client for a running daemon: opens each input and output locally and
+// hands both descriptors to the daemon. Prints the usual batch status lines.
+static int runRemoteBatch(const string &socketPath, const string &command, const vector<string> &args,
+                          const string &password)
+{
+    bool encrypt = command == "encrypt-file" || command == "encrypt-image";
+    bool image = command == "encrypt-image" || command == "decrypt-image";
+    if (!encrypt && !image && command != "decrypt-file")
+    {
+        cout << "--connect supports encrypt-file, decrypt-file, encrypt-image and decrypt-image\n";
+        return 2;
+    }
+    if (BaseCrypto::getCipherMode() != CipherMode::Xor)
+    {
+        cout << "--connect only supports the XOR cipher.\n";
+        return 2;
+    }
+
+    int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (sock < 0 || socketPath.size() >= sizeof(addr.sun_path))
+        return 2;
+    std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    if (::connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        cout << "Cannot connect to daemon at " << socketPath << ": " << std::strerror(errno) << "\n";
+        ::close(sock);
+        return 2;
+    }
+
+    auto request = [&](uint32_t op, const string &payload, const vector<int> &fds, DaemonReply &reply)
+    {
+        DaemonRequest r = {};
+        std::memcpy(r.magic, "SLD1", 4);
+        r.op = op;
+        r.length = kDaemonToEnd;
+        r.payloadLength = static_cast<uint32_t>(payload.size());
+        return send_frame(sock, &r, sizeof(r), fds) && send_all(sock, payload.data(), payload.size()) &&
+               recv_all(sock, &reply, sizeof(reply));
+    };
+
+    DaemonReply reply;
+    if (!request(DaemonKey, password, {}, reply) || reply.status != 0)
+    {
+        cout << "Daemon refused the key\n";
+        ::close(sock);
+        return 2;
+    }
+
+    int failures = 0;
+    for (const string &path : args)
+    {
+        string in = trim(path);
+        string out = image ? (encrypt ? ImageCrypto::encryptedPathFor(in) : ImageCrypto::decryptedPathFor(in))
+                           : (encrypt ? FileCrypto::encryptedPathFor(in) : FileCrypto::decryptedPathFor(in));
+        const char *status = "ok";
+        string detail;
+        RawFile src;
+        RawFile dst;
+        if (fs::exists(out) && overwritePolicy != OverwritePolicy::Overwrite)
+        {
+            status = overwritePolicy == OverwritePolicy::Skip ? "skipped" : "failed";
+            detail = "output already exists";
         }
-        else
+        else if (!encrypt && BaseCrypto::hasCipherHeader(in))
         {
-
-            hiddenFileName = "recovered_file.bin";
+            status = "failed";
+            detail = "ChaCha20 files cannot be decrypted through the daemon";
         }
-
-        string dir = dirname_of(img);
-        string outPath = (fs::path(dir) / fs::path(string("recovered_") + hiddenFileName)).string();
-        if (!confirm_overwrite_if_exists(outPath))
+        else if (!encrypt && BaseCrypto::hasContainerMagic(in))
         {
-            cout << "Skipping retrieval.\n";
-            fin.close();
-            return false;
+            status = "failed";
+            detail = "container files cannot be decrypted through the daemon";
         }
-
-        ofstream fout(outPath, ios::binary);
-        if (!fout)
+        else if (!src.openRead(in) || !dst.openWrite(out, true))
         {
-            cout << "Failed to open output file for writing retrieved content.\n";
-            fin.close();
-            return false;
+            status = "failed";
+            detail = "Failed to open files";
         }
-
-        char buffer;
-        size_t idx = 0;
-        uint64_t processed = 0;
-        uint64_t remaining = fileLen > static_cast<uint64_t>(fin.tellg()) ? (fileLen - static_cast<uint64_t>(fin.tellg())) : 0;
-
-        while (fin.get(buffer))
+        else if (!request(DaemonTransform, "", {src.handle(), dst.handle()}, reply))
         {
-            unsigned char byte = static_cast<unsigned char>(buffer);
-            unsigned char dec = applyXor(byte, key, idx);
-            fout.put(static_cast<char>(dec));
-            ++idx;
-            ++processed;
-            if ((processed & 0x1FFF) == 0 || processed == remaining)
-            {
-                print_progress_bar(processed, remaining);
-            }
+            status = "failed";
+            detail = "daemon connection lost";
         }
-
-        fin.close();
-        fout.close();
-
-        cout << "\nRetrieved hidden file to: " << outPath << "\n";
-        return true;
+        else if (reply.status != 0)
+        {
+            status = "failed";
+            detail = reply.message;
+        }
+        else
+        {
+            std::ostringstream os;
+            os << out << " (" << reply.bytes << " bytes, " << std::fixed << std::setprecision(3)
+               << reply.micros / 1000.0 << " ms)";
+            detail = os.str();
+        }
+        if (string(status) == "failed")
+            ++failures;
+        cout << status << "\t" << command << "\t" << in << "\t" << detail << "\n";
+        if (detail == "daemon connection lost")
+            break;
     }
-};
+    ::close(sock);
+    return failures > 0 ? 1 : 0;
+}
+#endif
 
-static void printMainMenuOptions()
+static void printUsage(const char *prog)
 {
-    cout << "\n====== MAIN MENU ======\n";
-    cout << "1. Encrypt Image\n";
-    cout << "2. Decrypt Image\n";
-    cout << "3. Encrypt File\n";
-    cout << "4. Decrypt File\n";
-    cout << "5. Encrypt Text\n";
-    cout << "6. Decrypt Text\n";
-    cout << "7. Store File in Image (Stego)\n";
-    cout << "8. Retrieve File from Image (Stego)\n";
-    cout << "9. Logout\n";
-    cout << "Enter choice: ";
+    cout << "Usage: " << prog << " [options]                      interactive menu\n";
+    cout << "       " << prog << " [options] COMMAND PATH...      batch mode\n";
+    cout << "Commands: encrypt-file, decrypt-file, encrypt-image, decrypt-image,\n";
+    cout << "          encrypt-text-file, decrypt-text-file, encrypt-tree DIR..., decrypt-tree DIR...,\n";
+    cout << "          decrypt-range FILE OFFSET LENGTH [OUT|-], verify FILE...,\n";
+    cout << "          store-file STORE FILE..., restore-file STORE MANIFEST [OUT],\n";
+    cout << "          stego-store COVER FILE...,\n";
+    cout << "          stego-retrieve IMAGE..., stego-list IMAGE..., stego-extract IMAGE NAME...\n";
+    cout << "Batch options:\n";
+    cout << "  --password PW           encryption password (or --password-file, or $STEALTH_PASSWORD)\n";
+    cout << "  --password-file FILE    read the password from the first line of FILE\n";
+    cout << "  --overwrite             replace existing outputs\n";
+    cout << "  --skip-existing         leave existing outputs and report the item as skipped\n";
+    cout << "                          (default: an existing output fails the item)\n";
+    cout << "  --rollback              roll interrupted in-place runs back instead of resuming\n";
+    cout << "  --cover-size BYTES      cover size for stego files written without a trailer\n";
+    cout << "Options:\n";
+    cout << "  --selfcheck             verify the XOR, ChaCha20 and Base64 kernels and exit\n";
+    cout << "  --bench-base64 [MIB]    compare Base64 codec throughput and exit\n";
+    cout << "  --block-size BYTES      streaming buffer size (default 4194304)\n";
+    cout << "  --threads N             workers for large files (0 = all cores)\n";
+    cout << "  --parallel-min BYTES    smallest input processed in parallel (default 67108864)\n";
+    cout << "  --queue-depth N         buffers in flight in the I/O pipeline (default 4)\n";
+    cout << "  --no-io-uring           use the thread-based pipeline even if io_uring works\n";
+    cout << "  --io-stats              print pipeline stage timings and overlap\n";
+    cout << "  --stats FILE            append per-operation JSON counters to FILE (- for stderr)\n";
+    cout << "  --cipher xor|chacha20   cipher for new outputs (default xor; decrypt detects it)\n";
+    cout << "  --format chunked|raw    file/tree output layout (default chunked, CRC-checked)\n";
+    cout << "  --compress              LZ4-compress file, tree and stego payloads before encrypting\n";
+    cout << "  --checkpoint-every N    sync and checkpoint file encrypts every N bytes\n";
+    cout << "                          (default 268435456, 0 = off)\n";
+    cout << "  --resume                continue interrupted file encrypts from their checkpoint\n";
+    cout << "  --incremental           encrypt-tree skips unchanged sources and removes outputs of\n";
+    cout << "                          deleted ones (manifest: <root>/stealth_tree.slman)\n";
+    cout << "  --in-place              image/file modes overwrite the input (journaled)\n";
+    cout << "  --users FILE            user database (default stealth_users.db)\n";
+    cout << "  --import-users FILE     add username:password lines to the user database and exit\n";
+    cout << "  --serve SOCKET          run as a daemon serving jobs on a Unix socket\n";
+    cout << "  --connect SOCKET        send batch file/image jobs to a running daemon (raw format)\n";
 }
 
-static void mainMenuFlow(UserManager &userManager)
+#ifndef STEALTH_LOCK_NO_MAIN
+int main(int argc, char *argv[])
 {
-    ImageCrypto imageCrypto;
-    FileCrypto fileCrypto;
-    TextCrypto textCrypto;
-    Stego stego;
-
-    cout << "Enter the password for making the encryption key: ";
+    vector<string> positional;
     string password;
-    std::getline(cin, password);
-    unsigned long long key = userManager.getKey(password);
+    bool havePassword = false;
+    OverwritePolicy batchPolicy = OverwritePolicy::Fail;
+    uint64_t coverSize = 0;
+    bool endOfOptions = false;
+    ofstream statsFile;
+    string importPath;
+    string servePath;
+    string connectPath;
+    bool rawFormat = false;
+    bool formatGiven = false;
+    bool compress = false;
+    bool incremental = false;
 
-    bool keepRunning = true;
-    while (keepRunning)
+    for (int i = 1; i < argc; ++i)
     {
-        printMainMenuOptions();
-        string choiceLine;
-        std::getline(cin, choiceLine);
-        int choice = 0;
-        try
-        {
-            choice = std::stoi(trim(choiceLine));
-        }
-        catch (...)
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (endOfOptions || arg.size() < 2 || arg.compare(0, 2, "--") != 0)
         {
-            choice = 0;
+            positional.push_back(arg);
+            continue;
         }
-
-        switch (choice)
+        try
         {
-        case 1:
-        { // Encrypt Image
-            cout << "Enter image path: ";
-            string in;
-            std::getline(cin, in);
-            in = trim(in);
-            if (in.empty())
+            if (arg == "--")
             {
-                cout << "No image path provided.\n";
-                break;
+                endOfOptions = true;
             }
-            imageCrypto.encrypt(in, key);
-            break;
-        }
-        case 2:
-        { // Decrypt Image
-            cout << "Enter encrypted image path: ";
-            string in;
-            std::getline(cin, in);
-            in = trim(in);
-            if (in.empty())
+            else if (arg == "--password" && hasValue)
             {
-                cout << "No path provided.\n";
-                break;
+                password = argv[++i];
+                havePassword = true;
             }
-            imageCrypto.decrypt(in, key);
-            break;
-        }
-        case 3:
-        { // Encrypt File
-            cout << "Enter file path to encrypt: ";
-            string in;
-            std::getline(cin, in);
-            in = trim(in);
-            if (in.empty())
+            else if (arg == "--password-file" && hasValue)
             {
-                cout << "No file path provided.\n";
-                break;
+                ifstream pin(argv[++i]);
+                if (!pin || !std::getline(pin, password))
+                {
+                    cout << "Cannot read password file: " << argv[i] << "\n";
+                    return 2;
+                }
+                if (!password.empty() && password.back() == '\r')
+                    password.pop_back();
+                havePassword = true;
             }
-            fileCrypto.encrypt(in, key);
-            break;
-        }
-        case 4:
-        { // Decrypt File
-            cout << "Enter encrypted file path to decrypt: ";
-            string in;
-            std::getline(cin, in);
-            in = trim(in);
-            if (in.empty())
+            else if (arg == "--overwrite")
             {
-                cout << "No file path provided.\n";
-                break;
+                batchPolicy = OverwritePolicy::Overwrite;
             }
-            fileCrypto.decrypt(in, key);
-            break;
-        }
-        case 5:
-        {
-            cout << "Enter text to encrypt (single line): ";
-            string txt;
-            std::getline(cin, txt);
-            txt = trim(txt);
-            if (txt.empty())
+            else if (arg == "--skip-existing")
             {
-                cout << "Empty text. Nothing to encrypt.\n";
-                break;
+                batchPolicy = OverwritePolicy::Skip;
             }
-
-            // Use TextCrypto's encryptInput
-            if (!textCrypto.encryptInput(txt, key, false))
+            else if (arg == "--rollback")
             {
-                cout << "Encryption failed.\n";
+                rollbackInPlaceByDefault = true;
             }
-            break;
-        }
-
-        case 6:
-        {
-            cout << "Enter encrypted text to decrypt (Base64 string): ";
-            string enc;
-            std::getline(cin, enc);
-            enc = trim(enc);
-            if (enc.empty())
+            else if (arg == "--cover-size" && hasValue)
             {
-                cout << "Empty. Nothing to decrypt.\n";
-                break;
+                coverSize = std::stoull(argv[++i]);
             }
-
-            // Use TextCrypto's decryptInput
-            if (!textCrypto.decryptInput(enc, key, false))
+            else if (arg == "--selfcheck")
             {
-                cout << "Decryption failed.\n";
+                bool xorOk = BaseCrypto::selfCheckKernels();
+                bool chachaOk = BaseCrypto::selfCheckChaCha();
+                bool base64Ok = selfCheckBase64();
+                return xorOk && chachaOk && base64Ok ? 0 : 1;
             }
-            break;
-        }
-
-        case 7:
-        { // Store File in Image
-            cout << "Enter image path (cover image): ";
-            string img;
-            std::getline(cin, img);
-            img = trim(img);
-            cout << "Enter file path to hide: ";
-            string file;
-            std::getline(cin, file);
-            file = trim(file);
-            if (img.empty() || file.empty())
+            else if (arg == "--bench-base64")
             {
-                cout << "Missing image or file path.\n";
-                break;
+                size_t mib = 64;
+                if (hasValue && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                    mib = static_cast<size_t>(std::stoul(argv[++i]));
+                benchBase64(mib ? mib : 1);
+                return 0;
             }
-            stego.storeFileInImage(img, file, key);
-            break;
-        }
-        case 8:
-        { // Retrieve File from Image
-            cout << "Enter image-with-file path: ";
-            string img;
-            std::getline(cin, img);
-            img = trim(img);
-            if (img.empty())
+            else if (arg == "--block-size" && hasValue)
             {
-                cout << "Missing path.\n";
-                break;
+                BaseCrypto::setBlockSize(static_cast<size_t>(std::stoull(argv[++i])));
             }
-            cout << "Enter original image size (in bytes) used when storing (you can use file properties): ";
-            string sizeStr;
-            std::getline(cin, sizeStr);
-            uint64_t origSize = 0;
-            try
+            else if (arg == "--threads" && hasValue)
             {
-                origSize = std::stoull(trim(sizeStr));
+                BaseCrypto::setWorkerCount(static_cast<unsigned>(std::stoul(argv[++i])));
             }
-            catch (...)
+            else if (arg == "--parallel-min" && hasValue)
             {
-                cout << "Invalid number. Aborting retrieve.\n";
-                break;
+                BaseCrypto::setParallelThreshold(std::stoull(argv[++i]));
+            }
+            else if (arg == "--queue-depth" && hasValue)
+            {
+                BaseCrypto::setQueueDepth(static_cast<unsigned>(std::stoul(argv[++i])));
+            }
+            else if (arg == "--no-io-uring")
+            {
+                BaseCrypto::setUseIoUring(false);
+            }
+            else if (arg == "--io-stats")
+            {
+                BaseCrypto::setReportIoStats(true);
+            }
+            else if (arg == "--users" && hasValue)
+            {
+                UserManager::setStorePath(argv[++i]);
+            }
+            else if (arg == "--import-users" && hasValue)
+            {
+                importPath = argv[++i];
+            }
+            else if (arg == "--serve" && hasValue)
+            {
+                servePath = argv[++i];
+            }
+            else if (arg == "--connect" && hasValue)
+            {
+                connectPath = argv[++i];
+            }
+            else if (arg == "--stats" && hasValue)
+            {
+                string target = argv[++i];
+                if (target == "-")
+                {
+                    statsOut = &std::cerr;
+                }
+                else
+                {
+                    statsFile.open(target, ios::app);
+                    if (!statsFile)
+                    {
+                        cout << "Cannot open stats file: " << target << "\n";
+                        return 2;
+                    }
+                    statsOut = &statsFile;
+                }
+                opTiming = true;
+            }
+            else if (arg == "--cipher" && hasValue)
+            {
+                string name = argv[++i];
+                if (name != "xor" && name != "chacha20")
+                {
+                    cout << "Unknown cipher: " << name << " (use xor or chacha20)\n";
+                    return 2;
+                }
+                BaseCrypto::setCipherMode(name == "xor" ? CipherMode::Xor : CipherMode::ChaCha20);
+            }
+            else if (arg == "--format" && hasValue)
+            {
+                string name = argv[++i];
+                if (name != "chunked" && name != "raw")
+                {
+                    cout << "Unknown format: " << name << " (use chunked or raw)\n";
+                    return 2;
+                }
+                rawFormat = name == "raw";
+                formatGiven = true;
+                BaseCrypto::setContainerFormat(!rawFormat);
+            }
+            else if (arg == "--compress")
+            {
+                compress = true;
+                BaseCrypto::setCompression(true);
+            }
+            else if (arg == "--checkpoint-every" && hasValue)
+            {
+                BaseCrypto::setCheckpointInterval(std::stoull(argv[++i]));
+            }
+            else if (arg == "--resume")
+            {
+                BaseCrypto::setResume(true);
+            }
+            else if (arg == "--incremental")
+            {
+                incremental = true;
+                BaseCrypto::setIncremental(true);
+            }
+            else if (arg == "--in-place")
+            {
+                BaseCrypto::setInPlace(true);
+            }
+            else
+            {
+                printUsage(argv[0]);
+                return 2;
             }
-            stego.retrieveFileFromImage(img, origSize, key);
-            break;
         }
-        case 9:
+        catch (...)
         {
-            cout << "Logging out...\n";
-            keepRunning = false;
-            break;
+            cout << "Invalid value for " << arg << "\n";
+            return 2;
         }
-        default:
-            cout << "Invalid choice. Enter number 1-9.\n";
+    }
+    if (compress && rawFormat)
+    {
+        cout << "--compress needs the chunked format; it cannot be combined with --format raw.\n";
+        return 2;
+    }
+    // The daemon transforms raw bytes, so --connect writes raw files by default.
+    if (!connectPath.empty())
+    {
+        if ((formatGiven && !rawFormat) || compress)
+        {
+            cout << "--connect writes raw files; it cannot be combined with --format chunked or --compress.\n";
+            return 2;
         }
-        waitShort();
+        rawFormat = true;
+        BaseCrypto::setContainerFormat(false);
     }
-}
 
-int main()
-{
     UserManager userManager;
+    if (!importPath.empty())
+    {
+        long long added = userManager.importUsers(importPath);
+        if (added < 0)
+        {
+            cout << "User import failed: " << importPath << "\n";
+            return 1;
+        }
+        cout << "Imported " << added << " users.\n";
+        return 0;
+    }
+    if (!servePath.empty())
+    {
+#ifdef _WIN32
+        cout << "--serve is not supported on Windows.\n";
+        return 2;
+#else
+        progress.setOutput(&cout, false);
+        StealthDaemon daemon(userManager);
+        return daemon.serve(servePath);
+#endif
+    }
+    if (!positional.empty())
+    {
+        string command = positional[0];
+        vector<string> paths(positional.begin() + 1, positional.end());
+        if (!havePassword && command != "stego-list" && command != "verify")
+        {
+            const char *env = std::getenv("STEALTH_PASSWORD");
+            if (!env)
+            {
+                cout << "Batch mode needs --password, --password-file or STEALTH_PASSWORD.\n";
+                return 2;
+            }
+            password = env;
+        }
+        if (paths.empty())
+        {
+            printUsage(argv[0]);
+            return 2;
+        }
+        if (incremental && command != "encrypt-tree")
+        {
+            cout << "--incremental only applies to encrypt-tree.\n";
+            return 2;
+        }
+        overwritePolicy = batchPolicy;
+        askInPlaceRecovery = false;
+        if (!connectPath.empty())
+        {
+#ifdef _WIN32
+            cout << "--connect is not supported on Windows.\n";
+            return 2;
+#else
+            return runRemoteBatch(connectPath, command, paths, password);
+#endif
+        }
+        // stdout carries the result lines, so progress goes to a terminal on stderr.
+        progress.setOutput(&std::cerr, stream_is_terminal(2) && !stream_is_terminal(1));
+        BaseCrypto::setPassphrase(password);
+        return runBatch(command, paths, userManager.getKey(password), coverSize);
+    }
+
     cout << "====== USER MENU ======\n";
     bool programRunning = true;
 
@@ -1097,6 +8116,7 @@ int main()
             if (userManager.login(username, password))
             {
                 mainMenuFlow(userManager);
+                write_stats_summary("session", username);
             }
             break;
         }
@@ -1128,3 +8148,4 @@ int main()
 
     return 0;
 }
+#endif
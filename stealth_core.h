@@ -0,0 +1,1086 @@
+// Stealth-lock core: key derivation, the XOR stream cipher, ChaCha20, CRC-32C,
+// LZ4-format block compression, SHA-256 and gear-hash chunking, with no file I/O
+// and no console output.
+// shealth_lock.cpp is built on top of this header; other programs can include it
+// on its own (C++17, header-only).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+#if defined(__cpp_lib_span)
+#include <span>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define STEALTH_X86_SIMD 1
+#endif
+
+namespace stealth
+{
+    // Key from a password: DJB-style hash (hash * 33 + byte, seeded with 5381).
+    inline unsigned long long deriveKey(const std::string &password)
+    {
+        unsigned long long hash = 5381ULL;
+        for (unsigned char c : password)
+        {
+            hash = ((hash << 5) + hash) + static_cast<unsigned long long>(c); // hash * 33 + c
+        }
+        return hash;
+    }
+
+    // Byte `index` of the stream is XORed with key byte index % 8 (little-endian order).
+    inline unsigned char keyByteAt(unsigned long long key, uint64_t index)
+    {
+        return static_cast<unsigned char>((key >> ((index % 8) * 8)) & 0xFFULL);
+    }
+
+    // 8-byte key pattern in memory order for a buffer that starts at stream `offset`.
+    inline uint64_t keyPatternAt(unsigned long long key, uint64_t offset)
+    {
+        unsigned char bytes[8];
+        for (uint64_t j = 0; j < 8; ++j)
+            bytes[j] = keyByteAt(key, offset + j);
+        uint64_t pattern;
+        std::memcpy(&pattern, bytes, sizeof(pattern));
+        return pattern;
+    }
+
+    // XOR kernels. Each one XORs `len` bytes with an 8-byte pattern laid out in memory
+    // order, starting at pattern byte 0. The best one is chosen once via CPUID.
+    typedef void (*XorKernelFn)(unsigned char *data, size_t len, uint64_t pattern);
+
+    struct XorKernel
+    {
+        const char *name;
+        XorKernelFn fn;
+    };
+
+    inline void xorTailBytes(unsigned char *data, size_t len, uint64_t pattern)
+    {
+        unsigned char bytes[8];
+        std::memcpy(bytes, &pattern, sizeof(bytes));
+        for (size_t i = 0; i < len; ++i)
+            data[i] ^= bytes[i & 7];
+    }
+
+    inline void xorKernelScalar(unsigned char *data, size_t len, uint64_t pattern)
+    {
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            word ^= pattern;
+            std::memcpy(data + i, &word, sizeof(word));
+        }
+        xorTailBytes(data + i, len - i, pattern);
+    }
+
+#ifdef STEALTH_X86_SIMD
+    __attribute__((target("sse2"))) inline void xorKernelSse2(unsigned char *data, size_t len, uint64_t pattern)
+    {
+        const __m128i k = _mm_set1_epi64x(static_cast<long long>(pattern));
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(v, k));
+        }
+        xorKernelScalar(data + i, len - i, pattern);
+    }
+
+    __attribute__((target("avx2"))) inline void xorKernelAvx2(unsigned char *data, size_t len, uint64_t pattern)
+    {
+        const __m256i k = _mm256_set1_epi64x(static_cast<long long>(pattern));
+        size_t i = 0;
+        for (; i + 64 <= len; i += 64)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), _mm256_xor_si256(a, k));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i + 32), _mm256_xor_si256(b, k));
+        }
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), _mm256_xor_si256(a, k));
+        }
+        xorKernelScalar(data + i, len - i, pattern);
+    }
+
+    __attribute__((target("avx512f"))) inline void xorKernelAvx512(unsigned char *data, size_t len, uint64_t pattern)
+    {
+        const __m512i k = _mm512_set1_epi64(static_cast<long long>(pattern));
+        size_t i = 0;
+        for (; i + 64 <= len; i += 64)
+        {
+            __m512i v = _mm512_loadu_si512(data + i);
+            _mm512_storeu_si512(data + i, _mm512_xor_si512(v, k));
+        }
+        xorKernelScalar(data + i, len - i, pattern);
+    }
+#endif
+
+    // Kernels usable on this CPU, best last. The scalar kernel is always present.
+    inline std::vector<XorKernel> availableXorKernels()
+    {
+        std::vector<XorKernel> kernels;
+        kernels.push_back({"scalar", xorKernelScalar});
+#ifdef STEALTH_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            kernels.push_back({"sse2", xorKernelSse2});
+        if (__builtin_cpu_supports("avx2"))
+            kernels.push_back({"avx2", xorKernelAvx2});
+        if (__builtin_cpu_supports("avx512f"))
+            kernels.push_back({"avx512", xorKernelAvx512});
+#endif
+        return kernels;
+    }
+
+    inline const XorKernel &activeXorKernel()
+    {
+        static const XorKernel kernel = availableXorKernels().back();
+        return kernel;
+    }
+
+    // Encrypts or decrypts (the same operation) `len` bytes that sit at stream
+    // position `offset`.
+    inline void xorTransform(unsigned char *data, size_t len, unsigned long long key, uint64_t offset)
+    {
+        activeXorKernel().fn(data, len, keyPatternAt(key, offset));
+    }
+
+    // Streaming encryptor/decryptor over caller-owned buffers. transform() works on
+    // consecutive chunks and advances the stream position; concurrent calls on one
+    // instance each claim their own range of positions, so chunks must then be
+    // given in the order the calls are made. transformAt() is random access and
+    // does not touch the position. The cipher is its own inverse, so Encryptor and
+    // Decryptor are the same type.
+    class StreamCipher
+    {
+    public:
+        explicit StreamCipher(unsigned long long key, uint64_t position = 0) : k(key), pos(position) {}
+        StreamCipher(const StreamCipher &other) : k(other.k), pos(other.position()) {}
+        StreamCipher &operator=(const StreamCipher &other)
+        {
+            k = other.k;
+            pos = other.position();
+            return *this;
+        }
+
+        static StreamCipher fromPassword(const std::string &password, uint64_t position = 0)
+        {
+            return StreamCipher(deriveKey(password), position);
+        }
+
+        unsigned long long key() const
+        {
+            return k;
+        }
+
+        uint64_t position() const
+        {
+            return pos.load(std::memory_order_relaxed);
+        }
+
+        void seek(uint64_t position)
+        {
+            pos.store(position, std::memory_order_relaxed);
+        }
+
+        // Transforms the next `len` bytes of the stream in place; returns their position.
+        uint64_t transform(unsigned char *data, size_t len)
+        {
+            uint64_t at = pos.fetch_add(len, std::memory_order_relaxed);
+            xorTransform(data, len, k, at);
+            return at;
+        }
+
+        uint64_t transform(std::byte *data, size_t len)
+        {
+            return transform(reinterpret_cast<unsigned char *>(data), len);
+        }
+
+        void transformAt(unsigned char *data, size_t len, uint64_t offset) const
+        {
+            xorTransform(data, len, k, offset);
+        }
+
+        void transformAt(std::byte *data, size_t len, uint64_t offset) const
+        {
+            xorTransform(reinterpret_cast<unsigned char *>(data), len, k, offset);
+        }
+
+#if defined(__cpp_lib_span)
+        uint64_t transform(std::span<std::byte> data)
+        {
+            return transform(data.data(), data.size());
+        }
+
+        void transformAt(std::span<std::byte> data, uint64_t offset) const
+        {
+            transformAt(data.data(), data.size(), offset);
+        }
+#endif
+
+    private:
+        unsigned long long k;
+        std::atomic<uint64_t> pos;
+    };
+
+    typedef StreamCipher Encryptor;
+    typedef StreamCipher Decryptor;
+
+    // ChaCha20 in its original form: 256-bit key, 64-bit nonce and 64-bit block
+    // counter, so a single nonce covers any file size. Byte `offset` of the stream
+    // is in block offset / 64, which makes the cipher random access like the XOR one.
+    struct ChaCha20Key
+    {
+        uint32_t words[8];
+    };
+
+    inline uint32_t rotl32(uint32_t v, int n)
+    {
+        return (v << n) | (v >> (32 - n));
+    }
+
+    inline void chachaInitState(uint32_t s[16], const ChaCha20Key &key, uint64_t nonce, uint64_t counter)
+    {
+        s[0] = 0x61707865; // "expand 32-byte k"
+        s[1] = 0x3320646e;
+        s[2] = 0x79622d32;
+        s[3] = 0x6b206574;
+        for (int i = 0; i < 8; ++i)
+            s[4 + i] = key.words[i];
+        s[12] = static_cast<uint32_t>(counter);
+        s[13] = static_cast<uint32_t>(counter >> 32);
+        s[14] = static_cast<uint32_t>(nonce);
+        s[15] = static_cast<uint32_t>(nonce >> 32);
+    }
+
+    // One 64-byte keystream block as 16 little-endian words.
+    inline void chacha20Block(const ChaCha20Key &key, uint64_t nonce, uint64_t counter, uint32_t out[16])
+    {
+        uint32_t s[16];
+        chachaInitState(s, key, nonce, counter);
+        uint32_t x[16];
+        std::memcpy(x, s, sizeof(x));
+        auto quarter = [&x](int a, int b, int c, int d)
+        {
+            x[a] += x[b];
+            x[d] = rotl32(x[d] ^ x[a], 16);
+            x[c] += x[d];
+            x[b] = rotl32(x[b] ^ x[c], 12);
+            x[a] += x[b];
+            x[d] = rotl32(x[d] ^ x[a], 8);
+            x[c] += x[d];
+            x[b] = rotl32(x[b] ^ x[c], 7);
+        };
+        for (int round = 0; round < 10; ++round)
+        {
+            quarter(0, 4, 8, 12);
+            quarter(1, 5, 9, 13);
+            quarter(2, 6, 10, 14);
+            quarter(3, 7, 11, 15);
+            quarter(0, 5, 10, 15);
+            quarter(1, 6, 11, 12);
+            quarter(2, 7, 8, 13);
+            quarter(3, 4, 9, 14);
+        }
+        for (int i = 0; i < 16; ++i)
+            out[i] = x[i] + s[i];
+    }
+
+    inline void chachaBlockBytes(const ChaCha20Key &key, uint64_t nonce, uint64_t counter, unsigned char out[64])
+    {
+        uint32_t words[16];
+        chacha20Block(key, nonce, counter, words);
+        for (int i = 0; i < 16; ++i)
+            for (int b = 0; b < 4; ++b)
+                out[i * 4 + b] = static_cast<unsigned char>(words[i] >> (8 * b));
+    }
+
+    // ChaCha20 kernels XOR `blocks` whole 64-byte blocks starting at block `counter`.
+    // The SIMD ones compute 4, 8 or 16 blocks side by side (one block per vector
+    // lane) and transpose the result back into stream order.
+    typedef void (*ChaChaKernelFn)(const ChaCha20Key &key, uint64_t nonce, uint64_t counter,
+                                   unsigned char *data, size_t blocks);
+
+    struct ChaChaKernel
+    {
+        const char *name;
+        ChaChaKernelFn fn;
+    };
+
+    inline void chachaKernelScalar(const ChaCha20Key &key, uint64_t nonce, uint64_t counter,
+                                   unsigned char *data, size_t blocks)
+    {
+        unsigned char ks[64];
+        for (size_t b = 0; b < blocks; ++b)
+        {
+            chachaBlockBytes(key, nonce, counter + b, ks);
+            for (int i = 0; i < 64; ++i)
+                data[b * 64 + i] ^= ks[i];
+        }
+    }
+
+#ifdef STEALTH_X86_SIMD
+    // Loads the initial state with word i of every lane in x[i]; lane k gets block counter + k.
+#define STEALTH_CHACHA_LOAD_STATE(VEC, SET1, LOADU, LANES)                              \
+    uint32_t base[16];                                                           \
+    chachaInitState(base, key, nonce, counter);                                  \
+    uint32_t lo[LANES], hi[LANES];                                               \
+    for (int k = 0; k < LANES; ++k)                                              \
+    {                                                                            \
+        lo[k] = static_cast<uint32_t>(counter + k);                              \
+        hi[k] = static_cast<uint32_t>((counter + k) >> 32);                      \
+    }                                                                            \
+    for (int i = 0; i < 16; ++i)                                                 \
+        s[i] = SET1(static_cast<int>(base[i]));                                  \
+    s[12] = LOADU(reinterpret_cast<const VEC *>(lo));                            \
+    s[13] = LOADU(reinterpret_cast<const VEC *>(hi));
+
+#define STEALTH_CHACHA_ROUNDS(QR)  \
+    for (int round = 0; round < 10; ++round) \
+    {                              \
+        QR(0, 4, 8, 12);           \
+        QR(1, 5, 9, 13);           \
+        QR(2, 6, 10, 14);          \
+        QR(3, 7, 11, 15);          \
+        QR(0, 5, 10, 15);          \
+        QR(1, 6, 11, 12);          \
+        QR(2, 7, 8, 13);           \
+        QR(3, 4, 9, 14);           \
+    }
+
+    __attribute__((target("sse2"))) inline void chachaKernelSse2(const ChaCha20Key &key, uint64_t nonce,
+                                                                 uint64_t counter, unsigned char *data,
+                                                                 size_t blocks)
+    {
+        for (; blocks >= 4; blocks -= 4, counter += 4, data += 256)
+        {
+            __m128i s[16];
+            STEALTH_CHACHA_LOAD_STATE(__m128i, _mm_set1_epi32, _mm_loadu_si128, 4)
+            __m128i x[16];
+            for (int i = 0; i < 16; ++i)
+                x[i] = s[i];
+#define STEALTH_ROT128(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n))
+#define STEALTH_QR128(a, b, c, d)                                      \
+    x[a] = _mm_add_epi32(x[a], x[b]);                                  \
+    x[d] = STEALTH_ROT128(_mm_xor_si128(x[d], x[a]), 16);              \
+    x[c] = _mm_add_epi32(x[c], x[d]);                                  \
+    x[b] = STEALTH_ROT128(_mm_xor_si128(x[b], x[c]), 12);              \
+    x[a] = _mm_add_epi32(x[a], x[b]);                                  \
+    x[d] = STEALTH_ROT128(_mm_xor_si128(x[d], x[a]), 8);               \
+    x[c] = _mm_add_epi32(x[c], x[d]);                                  \
+    x[b] = STEALTH_ROT128(_mm_xor_si128(x[b], x[c]), 7);
+            STEALTH_CHACHA_ROUNDS(STEALTH_QR128)
+#undef STEALTH_QR128
+#undef STEALTH_ROT128
+            for (int i = 0; i < 16; ++i)
+                x[i] = _mm_add_epi32(x[i], s[i]);
+            for (int g = 0; g < 4; ++g)
+            {
+                __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+                __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+                __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m128i r[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                                _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+                for (int j = 0; j < 4; ++j)
+                {
+                    __m128i *p = reinterpret_cast<__m128i *>(data + 64 * j + 16 * g);
+                    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), r[j]));
+                }
+            }
+        }
+        chachaKernelScalar(key, nonce, counter, data, blocks);
+    }
+
+    __attribute__((target("avx2"))) inline void chachaKernelAvx2(const ChaCha20Key &key, uint64_t nonce,
+                                                                 uint64_t counter, unsigned char *data,
+                                                                 size_t blocks)
+    {
+        const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                               2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+        const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                              3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+        for (; blocks >= 8; blocks -= 8, counter += 8, data += 512)
+        {
+            __m256i s[16];
+            STEALTH_CHACHA_LOAD_STATE(__m256i, _mm256_set1_epi32, _mm256_loadu_si256, 8)
+            __m256i x[16];
+            for (int i = 0; i < 16; ++i)
+                x[i] = s[i];
+#define STEALTH_ROT256(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n))
+#define STEALTH_QR256(a, b, c, d)                                          \
+    x[a] = _mm256_add_epi32(x[a], x[b]);                                   \
+    x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16);       \
+    x[c] = _mm256_add_epi32(x[c], x[d]);                                   \
+    x[b] = STEALTH_ROT256(_mm256_xor_si256(x[b], x[c]), 12);               \
+    x[a] = _mm256_add_epi32(x[a], x[b]);                                   \
+    x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8);        \
+    x[c] = _mm256_add_epi32(x[c], x[d]);                                   \
+    x[b] = STEALTH_ROT256(_mm256_xor_si256(x[b], x[c]), 7);
+            STEALTH_CHACHA_ROUNDS(STEALTH_QR256)
+#undef STEALTH_QR256
+#undef STEALTH_ROT256
+            for (int i = 0; i < 16; ++i)
+                x[i] = _mm256_add_epi32(x[i], s[i]);
+            // In-lane 4x4 transposes leave block j in the low half and block j + 4 in
+            // the high half of r[g][j] (words 4g..4g+3).
+            __m256i r[4][4];
+            for (int g = 0; g < 4; ++g)
+            {
+                __m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+                __m256i t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m256i t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+                __m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+                r[g][0] = _mm256_unpacklo_epi64(t0, t1);
+                r[g][1] = _mm256_unpackhi_epi64(t0, t1);
+                r[g][2] = _mm256_unpacklo_epi64(t2, t3);
+                r[g][3] = _mm256_unpackhi_epi64(t2, t3);
+            }
+            for (int j = 0; j < 4; ++j)
+            {
+                __m256i out[4] = {_mm256_permute2x128_si256(r[0][j], r[1][j], 0x20),
+                                  _mm256_permute2x128_si256(r[2][j], r[3][j], 0x20),
+                                  _mm256_permute2x128_si256(r[0][j], r[1][j], 0x31),
+                                  _mm256_permute2x128_si256(r[2][j], r[3][j], 0x31)};
+                unsigned char *dst[4] = {data + 64 * j, data + 64 * j + 32, data + 64 * (j + 4),
+                                         data + 64 * (j + 4) + 32};
+                for (int k = 0; k < 4; ++k)
+                {
+                    __m256i *p = reinterpret_cast<__m256i *>(dst[k]);
+                    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), out[k]));
+                }
+            }
+        }
+        chachaKernelSse2(key, nonce, counter, data, blocks);
+    }
+
+// GCC 12 reports its own AVX-512 intrinsics (undefined pass-through operands) as
+// possibly uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f"))) inline void chachaKernelAvx512(const ChaCha20Key &key, uint64_t nonce,
+                                                                      uint64_t counter, unsigned char *data,
+                                                                      size_t blocks)
+    {
+        for (; blocks >= 16; blocks -= 16, counter += 16, data += 1024)
+        {
+            __m512i s[16];
+            STEALTH_CHACHA_LOAD_STATE(__m512i, _mm512_set1_epi32, _mm512_loadu_si512, 16)
+            __m512i x[16];
+            for (int i = 0; i < 16; ++i)
+                x[i] = s[i];
+#define STEALTH_QR512(a, b, c, d)                                   \
+    x[a] = _mm512_add_epi32(x[a], x[b]);                            \
+    x[d] = _mm512_rol_epi32(_mm512_xor_si512(x[d], x[a]), 16);      \
+    x[c] = _mm512_add_epi32(x[c], x[d]);                            \
+    x[b] = _mm512_rol_epi32(_mm512_xor_si512(x[b], x[c]), 12);      \
+    x[a] = _mm512_add_epi32(x[a], x[b]);                            \
+    x[d] = _mm512_rol_epi32(_mm512_xor_si512(x[d], x[a]), 8);       \
+    x[c] = _mm512_add_epi32(x[c], x[d]);                            \
+    x[b] = _mm512_rol_epi32(_mm512_xor_si512(x[b], x[c]), 7);
+            STEALTH_CHACHA_ROUNDS(STEALTH_QR512)
+#undef STEALTH_QR512
+            for (int i = 0; i < 16; ++i)
+                x[i] = _mm512_add_epi32(x[i], s[i]);
+            // After the in-lane transposes, 128-bit lane L of r[g][j] holds words
+            // 4g..4g+3 of block 4L + j; a 4x4 transpose of lanes gathers each block.
+            __m512i r[4][4];
+            for (int g = 0; g < 4; ++g)
+            {
+                __m512i t0 = _mm512_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+                __m512i t1 = _mm512_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+                __m512i t2 = _mm512_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+                __m512i t3 = _mm512_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+                r[g][0] = _mm512_unpacklo_epi64(t0, t1);
+                r[g][1] = _mm512_unpackhi_epi64(t0, t1);
+                r[g][2] = _mm512_unpacklo_epi64(t2, t3);
+                r[g][3] = _mm512_unpackhi_epi64(t2, t3);
+            }
+            for (int j = 0; j < 4; ++j)
+            {
+                __m512i u0 = _mm512_shuffle_i32x4(r[0][j], r[1][j], 0x44);
+                __m512i u1 = _mm512_shuffle_i32x4(r[0][j], r[1][j], 0xEE);
+                __m512i u2 = _mm512_shuffle_i32x4(r[2][j], r[3][j], 0x44);
+                __m512i u3 = _mm512_shuffle_i32x4(r[2][j], r[3][j], 0xEE);
+                __m512i out[4] = {_mm512_shuffle_i32x4(u0, u2, 0x88), _mm512_shuffle_i32x4(u0, u2, 0xDD),
+                                  _mm512_shuffle_i32x4(u1, u3, 0x88), _mm512_shuffle_i32x4(u1, u3, 0xDD)};
+                for (int lane = 0; lane < 4; ++lane)
+                {
+                    unsigned char *p = data + 64 * (4 * lane + j);
+                    _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), out[lane]));
+                }
+            }
+        }
+        chachaKernelAvx2(key, nonce, counter, data, blocks);
+    }
+#pragma GCC diagnostic pop
+#undef STEALTH_CHACHA_ROUNDS
+#undef STEALTH_CHACHA_LOAD_STATE
+#endif
+
+    // ChaCha20 kernels usable on this CPU, best last.
+    inline std::vector<ChaChaKernel> availableChaChaKernels()
+    {
+        std::vector<ChaChaKernel> kernels;
+        kernels.push_back({"scalar", chachaKernelScalar});
+#ifdef STEALTH_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            kernels.push_back({"sse2x4", chachaKernelSse2});
+        if (__builtin_cpu_supports("avx2"))
+            kernels.push_back({"avx2x8", chachaKernelAvx2});
+        if (__builtin_cpu_supports("avx512f"))
+            kernels.push_back({"avx512x16", chachaKernelAvx512});
+#endif
+        return kernels;
+    }
+
+    inline const ChaChaKernel &activeChaChaKernel()
+    {
+        static const ChaChaKernel kernel = availableChaChaKernels().back();
+        return kernel;
+    }
+
+    // Encrypts or decrypts `len` bytes that sit at stream position `offset`.
+    inline void chacha20Transform(const ChaCha20Key &key, uint64_t nonce, unsigned char *data, size_t len,
+                                  uint64_t offset)
+    {
+        uint64_t counter = offset / 64;
+        size_t skip = static_cast<size_t>(offset % 64);
+        unsigned char ks[64];
+        if (skip && len)
+        {
+            size_t n = std::min(len, 64 - skip);
+            chachaBlockBytes(key, nonce, counter++, ks);
+            for (size_t i = 0; i < n; ++i)
+                data[i] ^= ks[skip + i];
+            data += n;
+            len -= n;
+        }
+        size_t blocks = len / 64;
+        activeChaChaKernel().fn(key, nonce, counter, data, blocks);
+        data += blocks * 64;
+        len -= blocks * 64;
+        if (len)
+        {
+            chachaBlockBytes(key, nonce, counter + blocks, ks);
+            for (size_t i = 0; i < len; ++i)
+                data[i] ^= ks[i];
+        }
+    }
+
+    // CRC-32C (Castagnoli polynomial, reflected), the checksum of iSCSI and ext4.
+    // Slice-by-8 tables in software; SSE4.2 computes it with one instruction per word.
+    inline const uint32_t (&crc32cTables())[8][256]
+    {
+        struct Tables
+        {
+            uint32_t t[8][256];
+            Tables()
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t c = i;
+                    for (int k = 0; k < 8; ++k)
+                        c = (c >> 1) ^ (0x82F63B78U & (0U - (c & 1U)));
+                    t[0][i] = c;
+                }
+                for (uint32_t i = 0; i < 256; ++i)
+                    for (int s = 1; s < 8; ++s)
+                        t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        };
+        static const Tables tables;
+        return tables.t;
+    }
+
+    // Both kernels take and return the raw (pre-inverted) register value.
+    inline uint32_t crc32cSoftware(uint32_t crc, const unsigned char *p, size_t n)
+    {
+        const uint32_t(&t)[8][256] = crc32cTables();
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            uint32_t lo = crc ^ (static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+                                 static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24);
+            crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+                  t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        }
+        for (; n > 0; --n, ++p)
+            crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+        return crc;
+    }
+
+#if defined(STEALTH_X86_SIMD) && defined(__x86_64__)
+    __attribute__((target("sse4.2"))) inline uint32_t crc32cSse42(uint32_t crc, const unsigned char *p, size_t n)
+    {
+        uint64_t c = crc;
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            c = _mm_crc32_u64(c, word);
+        }
+        uint32_t c32 = static_cast<uint32_t>(c);
+        for (; n > 0; --n, ++p)
+            c32 = _mm_crc32_u8(c32, *p);
+        return c32;
+    }
+#endif
+
+    inline uint32_t crc32c(const unsigned char *data, size_t len, uint32_t crc = 0)
+    {
+#if defined(STEALTH_X86_SIMD) && defined(__x86_64__)
+        static const bool hardware = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+        if (hardware)
+            return ~crc32cSse42(~crc, data, len);
+#endif
+        return ~crc32cSoftware(~crc, data, len);
+    }
+
+    // a * b modulo the CRC-32C polynomial, both reflected (bit 31 is x^0).
+    inline uint32_t crc32cMultiply(uint32_t a, uint32_t b)
+    {
+        uint32_t m = 1U << 31;
+        uint32_t p = 0;
+        for (; m != 0; m >>= 1)
+        {
+            if (a & m)
+            {
+                p ^= b;
+                if ((a & (m - 1)) == 0)
+                    break;
+            }
+            b = (b >> 1) ^ (0x82F63B78U & (0U - (b & 1U)));
+        }
+        return p;
+    }
+
+    // CRC-32C of A followed by B from crc32c(A), crc32c(B) and B's length, without
+    // reading either again: crc(A) is shifted past len(B) zero bytes by multiplying it
+    // with x^(8 len(B)), built from the squares x^(2^k) in O(log len) steps.
+    inline uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lenB)
+    {
+        struct Powers
+        {
+            uint32_t p[64];
+            Powers()
+            {
+                p[0] = 1U << 30; // x^1
+                for (int k = 1; k < 64; ++k)
+                    p[k] = crc32cMultiply(p[k - 1], p[k - 1]);
+            }
+        };
+        static const Powers powers;
+        uint32_t shift = 1U << 31; // x^0
+        for (int k = 3; lenB != 0; lenB >>= 1, ++k)
+        {
+            if (lenB & 1)
+                shift = crc32cMultiply(powers.p[k & 63], shift);
+        }
+        return crc32cMultiply(shift, crcA) ^ crcB;
+    }
+
+    // LZ4 block format: sequences of literals followed by a back-reference (token with
+    // two 4-bit lengths, optional 255-run length bytes, literals, 16-bit offset). The
+    // compressor is the greedy single-probe variant: one hash table of 4-byte
+    // prefixes, skipping ahead faster the longer nothing matches. Blocks are
+    // independent, so callers can compress and expand them on any thread.
+    inline size_t lzCompressBound(size_t n)
+    {
+        return n + n / 255 + 16;
+    }
+
+    inline uint32_t lzLoad32(const unsigned char *p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline unsigned char *lzPutLength(unsigned char *op, size_t len)
+    {
+        for (; len >= 255; len -= 255)
+            *op++ = 255;
+        *op++ = static_cast<unsigned char>(len);
+        return op;
+    }
+
+    // Compresses src into dst. Returns the compressed size, or 0 if it would not fit
+    // in `cap` bytes (callers then store the block uncompressed).
+    inline size_t lzCompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+    {
+        const size_t kMinMatch = 4;
+        const size_t kLastLiterals = 5; // the format ends every block with literals
+        const size_t kMatchLimit = 12;  // no match may start in the last 12 bytes
+        const int kHashBits = 12;
+        std::vector<uint32_t> table(size_t(1) << kHashBits, 0);
+        unsigned char *op = dst;
+        unsigned char *const end = dst + cap;
+        size_t anchor = 0;
+
+        auto emit = [&](size_t litEnd, size_t offset, size_t matchLen) -> bool
+        {
+            size_t lit = litEnd - anchor;
+            if (static_cast<size_t>(end - op) < 1 + lit + lit / 255 + 1 + 2 + matchLen / 255 + 1)
+                return false;
+            unsigned char *token = op++;
+            *token = static_cast<unsigned char>(std::min<size_t>(lit, 15) << 4);
+            if (lit >= 15)
+                op = lzPutLength(op, lit - 15);
+            std::memcpy(op, src + anchor, lit);
+            op += lit;
+            if (matchLen == 0)
+                return true;
+            *op++ = static_cast<unsigned char>(offset);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            size_t m = matchLen - kMinMatch;
+            *token |= static_cast<unsigned char>(std::min<size_t>(m, 15));
+            if (m >= 15)
+                op = lzPutLength(op, m - 15);
+            return true;
+        };
+
+        if (n > kMatchLimit)
+        {
+            const size_t limit = n - kMatchLimit;
+            const size_t matchEnd = n - kLastLiterals;
+            size_t ip = 0;
+            while (ip < limit)
+            {
+                uint32_t seq = lzLoad32(src + ip);
+                uint32_t &slot = table[(seq * 2654435761U) >> (32 - kHashBits)];
+                size_t ref = slot;
+                slot = static_cast<uint32_t>(ip);
+                if (ref >= ip || ip - ref > 65535 || lzLoad32(src + ref) != seq)
+                {
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+                while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+                {
+                    --ip;
+                    --ref;
+                }
+                size_t len = kMinMatch;
+                while (ip + len < matchEnd && src[ip + len] == src[ref + len])
+                    ++len;
+                if (!emit(ip, ip - ref, len))
+                    return 0;
+                ip += len;
+                anchor = ip;
+                if (ip - 2 < limit)
+                    table[(lzLoad32(src + ip - 2) * 2654435761U) >> (32 - kHashBits)] = static_cast<uint32_t>(ip - 2);
+            }
+        }
+        if (!emit(n, 0, 0))
+            return 0;
+        return static_cast<size_t>(op - dst);
+    }
+
+    // Expands a block produced by lzCompress into exactly `outLen` bytes. Returns
+    // false for malformed or truncated input; never reads or writes out of bounds.
+    inline bool lzDecompress(const unsigned char *src, size_t n, unsigned char *dst, size_t outLen)
+    {
+        size_t ip = 0;
+        size_t op = 0;
+        auto readLength = [&](size_t &len) -> bool
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= n)
+                    return false;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+            return true;
+        };
+        while (ip < n)
+        {
+            unsigned char token = src[ip++];
+            size_t lit = token >> 4;
+            if (lit == 15 && !readLength(lit))
+                return false;
+            if (lit > n - ip || lit > outLen - op)
+                return false;
+            std::memcpy(dst + op, src + ip, lit);
+            ip += lit;
+            op += lit;
+            if (ip == n)
+                break;
+            if (n - ip < 2)
+                return false;
+            size_t offset = static_cast<size_t>(src[ip]) | static_cast<size_t>(src[ip + 1]) << 8;
+            ip += 2;
+            size_t len = token & 15;
+            if (len == 15 && !readLength(len))
+                return false;
+            len += 4;
+            if (offset == 0 || offset > op || len > outLen - op)
+                return false;
+            unsigned char *d = dst + op;
+            const unsigned char *from = d - offset;
+            if (offset >= len)
+            {
+                std::memcpy(d, from, len);
+            }
+            else
+            {
+                size_t i = 0;
+                for (; offset >= 8 && i + 8 <= len; i += 8)
+                    std::memcpy(d + i, from + i, 8);
+                for (; i < len; ++i)
+                    d[i] = from[i];
+            }
+            op += len;
+        }
+        return op == outLen;
+    }
+
+    // SHA-256 (FIPS 180-4), portable. Used for keyed chunk identities, where a
+    // collision would silently mix up data, so a short checksum is not enough.
+    class Sha256
+    {
+    public:
+        Sha256()
+        {
+            static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+            std::memcpy(h, init, sizeof(h));
+        }
+
+        void update(const unsigned char *p, size_t n)
+        {
+            total += n;
+            if (used)
+            {
+                size_t take = std::min(n, sizeof(buf) - used);
+                std::memcpy(buf + used, p, take);
+                used += take;
+                p += take;
+                n -= take;
+                if (used < sizeof(buf))
+                    return;
+                block(buf);
+                used = 0;
+            }
+            for (; n >= 64; n -= 64, p += 64)
+                block(p);
+            std::memcpy(buf, p, n);
+            used = n;
+        }
+
+        void final(unsigned char out[32])
+        {
+            uint64_t bits = total * 8;
+            unsigned char pad[72] = {0x80};
+            size_t padLen = (used < 56 ? 56 : 120) - used;
+            for (int i = 0; i < 8; ++i)
+                pad[padLen + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+            update(pad, padLen + 8);
+            for (int i = 0; i < 8; ++i)
+                for (int b = 0; b < 4; ++b)
+                    out[4 * i + b] = static_cast<unsigned char>(h[i] >> (24 - 8 * b));
+        }
+
+    private:
+        static uint32_t rotr(uint32_t v, int n)
+        {
+            return (v >> n) | (v << (32 - n));
+        }
+
+        void block(const unsigned char *p)
+        {
+            static const uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i)
+                w[i] = static_cast<uint32_t>(p[4 * i]) << 24 | static_cast<uint32_t>(p[4 * i + 1]) << 16 |
+                       static_cast<uint32_t>(p[4 * i + 2]) << 8 | p[4 * i + 3];
+            for (int i = 16; i < 64; ++i)
+                w[i] = w[i - 16] + (rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7] +
+                       (rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10));
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+            for (int i = 0; i < 64; ++i)
+            {
+                uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                hh = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+            h[5] += f;
+            h[6] += g;
+            h[7] += hh;
+        }
+
+        uint32_t h[8];
+        unsigned char buf[64];
+        uint64_t total = 0;
+        size_t used = 0;
+    };
+
+    inline void hmacSha256(const unsigned char key[32], const unsigned char *data, size_t len, unsigned char out[32])
+    {
+        unsigned char pad[64];
+        Sha256 inner;
+        for (int i = 0; i < 64; ++i)
+            pad[i] = static_cast<unsigned char>((i < 32 ? key[i] : 0) ^ 0x36);
+        inner.update(pad, sizeof(pad));
+        inner.update(data, len);
+        unsigned char digest[32];
+        inner.final(digest);
+        Sha256 outer;
+        for (int i = 0; i < 64; ++i)
+            pad[i] = static_cast<unsigned char>((i < 32 ? key[i] : 0) ^ 0x5c);
+        outer.update(pad, sizeof(pad));
+        outer.update(digest, sizeof(digest));
+        outer.final(out);
+    }
+
+    // Gear hash for content-defined chunking (FastCDC): h = (h << 1) + gear[byte], so
+    // bit k of h depends only on the last k + 1 bytes and the top bits on the last 64.
+    // A position's hash therefore does not depend on where hashing started, which is
+    // what lets a buffer be scanned in independent pieces.
+    inline const uint64_t (&gearTable())[256]
+    {
+        struct Table
+        {
+            uint64_t g[256];
+            Table()
+            {
+                uint64_t x = 0x5354454C47454152ULL; // "STELGEAR", splitmix64 seed
+                for (uint64_t &v : g)
+                {
+                    uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+                    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                    v = z ^ (z >> 31);
+                }
+            }
+        };
+        static const Table table;
+        return table.g;
+    }
+
+    // Appends to `out` every position i in [begin, end) whose gear hash has no bit of
+    // `loose` set, as (i << 1) | 1 if it also has none of `strict` (a superset of
+    // `loose`). data[begin - 64, begin) must be readable. The range is split into four
+    // lanes hashed in one loop, so the table lookups of independent lanes overlap
+    // instead of waiting on each other's shift-add chain.
+    inline void gearCandidates(const unsigned char *data, size_t begin, size_t end, uint64_t loose, uint64_t strict,
+                               std::vector<uint64_t> &out)
+    {
+        const uint64_t(&gear)[256] = gearTable();
+        const size_t lanes = 4;
+        const size_t per = (end - begin) / lanes;
+        std::vector<uint64_t> found[lanes];
+        uint64_t h[lanes];
+        size_t at[lanes];
+        for (size_t l = 0; l < lanes; ++l)
+        {
+            at[l] = begin + l * per;
+            h[l] = 0;
+            for (size_t i = at[l] - 64; i < at[l]; ++i)
+                h[l] = (h[l] << 1) + gear[data[i]];
+        }
+        for (size_t j = 0; j < per; ++j)
+        {
+            for (size_t l = 0; l < lanes; ++l)
+            {
+                size_t i = at[l] + j;
+                h[l] = (h[l] << 1) + gear[data[i]];
+                if ((h[l] & loose) == 0)
+                    found[l].push_back(static_cast<uint64_t>(i) << 1 | ((h[l] & strict) == 0));
+            }
+        }
+        // The last lane also takes the remainder that did not divide evenly.
+        uint64_t &tail = h[lanes - 1];
+        for (size_t i = begin + lanes * per; i < end; ++i)
+        {
+            tail = (tail << 1) + gear[data[i]];
+            if ((tail & loose) == 0)
+                found[lanes - 1].push_back(static_cast<uint64_t>(i) << 1 | ((tail & strict) == 0));
+        }
+        for (const std::vector<uint64_t> &f : found)
+            out.insert(out.end(), f.begin(), f.end());
+    }
+
+    // Master key from a password: the password is absorbed into a ChaCha20 key and the
+    // block function is then iterated to slow down guessing. It is a simple stretch,
+    // not a vetted password hash such as Argon2.
+    inline ChaCha20Key deriveChaChaKey(const std::string &password, unsigned rounds = 1u << 16)
+    {
+        const uint64_t domain = 0x3146444B4C53ULL; // "SLKDF1"
+        ChaCha20Key k = {};
+        k.words[7] = static_cast<uint32_t>(password.size());
+        uint32_t out[16];
+        for (size_t at = 0; at == 0 || at < password.size(); at += 32)
+        {
+            unsigned char chunk[32] = {};
+            std::memcpy(chunk, password.data() + at, std::min<size_t>(32, password.size() - at));
+            for (int i = 0; i < 8; ++i)
+                k.words[i] ^= static_cast<uint32_t>(chunk[4 * i]) | static_cast<uint32_t>(chunk[4 * i + 1]) << 8 |
+                              static_cast<uint32_t>(chunk[4 * i + 2]) << 16 |
+                              static_cast<uint32_t>(chunk[4 * i + 3]) << 24;
+            chacha20Block(k, domain, at, out);
+            std::memcpy(k.words, out + 8, sizeof(k.words));
+        }
+        for (unsigned r = 0; r < rounds; ++r)
+        {
+            chacha20Block(k, domain, (1ULL << 63) | r, out);
+            std::memcpy(k.words, out + 8, sizeof(k.words));
+        }
+        return k;
+    }
+
+    // Per-file key selected by a random 16-byte salt; `check` lets a reader tell a
+    // wrong password from a damaged file without revealing the key.
+    inline ChaCha20Key chachaSubKey(const ChaCha20Key &master, const unsigned char salt[16], uint64_t &check)
+    {
+        uint64_t a, b;
+        std::memcpy(&a, salt, 8);
+        std::memcpy(&b, salt + 8, 8);
+        uint32_t out[16];
+        chacha20Block(master, a, b, out);
+        ChaCha20Key k;
+        std::memcpy(k.words, out, sizeof(k.words));
+        check = static_cast<uint64_t>(out[8]) | static_cast<uint64_t>(out[9]) << 32;
+        return k;
+    }
+}